@@ -118,6 +118,7 @@ static HAL_StatusTypeDef PCD_WriteEmptyTxFifo(PCD_HandleTypeDef *hpcd, uint32_t
 
 #if defined (USB)
 static HAL_StatusTypeDef PCD_EP_ISR_Handler(PCD_HandleTypeDef *hpcd);
+static HAL_StatusTypeDef PCD_EP_DB_Transmit(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint16_t wEPVal);
 #endif /* USB */
 /**
   * @}
@@ -1211,6 +1212,73 @@ static HAL_StatusTypeDef PCD_WriteEmptyTxFifo(PCD_HandleTypeDef *hpcd, uint32_t
 #endif /* USB_OTG_FS */
 
 #if defined (USB)
+/**
+  * @brief  This function handles a completed transaction on a double
+  *         buffered IN endpoint. The buffer just sent is refilled with the
+  *         next packet while the hardware sends the other one.
+  * @param  hpcd: PCD handle
+  * @param  ep: endpoint structure
+  * @param  wEPVal: endpoint register value at the time of the interrupt
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef PCD_EP_DB_Transmit(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint16_t wEPVal)
+{
+  uint8_t  bufnum;
+  uint16_t count;
+  
+  if ((wEPVal & USB_EP_KIND) == 0)
+  {
+    /* Single packet transfer sent single buffered off pmaaddr0 */
+    ep->xfer_count = PCD_GET_EP_DBUF0_CNT(hpcd->Instance, ep->num);
+    ep->xfer_len = 0;
+    HAL_PCD_DataInStageCallback(hpcd, ep->num);
+    return HAL_OK;
+  }
+  
+  /* DTOG_TX has already moved on to the other buffer */
+  if ((wEPVal & USB_EP_DTOG_TX) != 0)
+  {
+    bufnum = 0;
+    count = PCD_GET_EP_DBUF0_CNT(hpcd->Instance, ep->num);
+  }
+  else
+  {
+    bufnum = 1;
+    count = PCD_GET_EP_DBUF1_CNT(hpcd->Instance, ep->num);
+  }
+  
+  ep->xfer_count += count;
+  ep->xfer_len = (ep->xfer_len > count) ? (ep->xfer_len - count) : 0;
+  
+  if (ep->xfer_len == 0)
+  {
+    /* TX COMPLETE. NAK before SW_BUF moves, while the EP is still VALID
+       the toggle would hand the hardware the buffer already sent */
+    PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_NAK);
+  }
+  
+  /* Hand the buffer just sent back to the application side */
+  if ((((wEPVal & USB_EP_DTOG_RX) != 0) ? 1 : 0) != bufnum)
+  {
+    PCD_FreeUserBuffer(hpcd->Instance, ep->num, PCD_EP_DBUF_IN);
+  }
+  
+  if (ep->xfer_len == 0)
+  {
+    PCD_SET_EP_DBUF_CNT(hpcd->Instance, ep->num, PCD_EP_DBUF_IN, 0);
+    HAL_PCD_DataInStageCallback(hpcd, ep->num);
+    return HAL_OK;
+  }
+  
+  if (ep->xfer_len_db != 0)
+  {
+    USB_EPFillDBufIn(hpcd->Instance, ep, bufnum);
+  }
+  
+  PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_VALID);
+  return HAL_OK;
+}
+
 /**
   * @brief  This function handles PCD Endpoint interrupt request.
   * @param  hpcd: PCD handle
@@ -1353,7 +1421,9 @@ static HAL_StatusTypeDef PCD_EP_ISR_Handler(PCD_HandleTypeDef *hpcd)
         }
         else
         {
-          HAL_PCD_EP_Receive(hpcd, ep->num, ep->xfer_buff, ep->xfer_len);
+          /* Next packet. Not through HAL_PCD_EP_Receive, which would reset
+             xfer_count and report only the last packet of the transfer */
+          USB_EPStartXfer(hpcd->Instance, ep);
         }
         
       } /* if((wEPVal & EP_CTR_RX) */
@@ -1366,49 +1436,26 @@ static HAL_StatusTypeDef PCD_EP_ISR_Handler(PCD_HandleTypeDef *hpcd)
         PCD_CLEAR_TX_EP_CTR(hpcd->Instance, epindex);
         
         /* IN double Buffering*/
-        if (ep->doublebuffer == 0)
+        if (ep->doublebuffer != 0)
         {
-          ep->xfer_count = PCD_GET_EP_TX_CNT(hpcd->Instance, ep->num);
-          if (ep->xfer_count != 0)
-          {
-            USB_WritePMA(hpcd->Instance, ep->xfer_buff, ep->pmaadress, ep->xfer_count);
-          }
+          PCD_EP_DB_Transmit(hpcd, ep, wEPVal);
         }
         else
         {
-          if (PCD_GET_ENDPOINT(hpcd->Instance, ep->num) & USB_EP_DTOG_TX)
+          /*multi-packet on the NON control IN endpoint*/
+          ep->xfer_count = PCD_GET_EP_TX_CNT(hpcd->Instance, ep->num);
+          ep->xfer_buff+=ep->xfer_count;
+       
+          /* Zero Length Packet? */
+          if (ep->xfer_len == 0)
           {
-            /*read from endpoint BUF0Addr buffer*/
-            ep->xfer_count = PCD_GET_EP_DBUF0_CNT(hpcd->Instance, ep->num);
-            if (ep->xfer_count != 0)
-            {
-              USB_WritePMA(hpcd->Instance, ep->xfer_buff, ep->pmaaddr0, ep->xfer_count);
-            }
+            /* TX COMPLETE */
+            HAL_PCD_DataInStageCallback(hpcd, ep->num);
           }
           else
           {
-            /*read from endpoint BUF1Addr buffer*/
-            ep->xfer_count = PCD_GET_EP_DBUF1_CNT(hpcd->Instance, ep->num);
-            if (ep->xfer_count != 0)
-            {
-              USB_WritePMA(hpcd->Instance, ep->xfer_buff, ep->pmaaddr1, ep->xfer_count);
-            }
+            HAL_PCD_EP_Transmit(hpcd, ep->num, ep->xfer_buff, ep->xfer_len);
           }
-          PCD_FreeUserBuffer(hpcd->Instance, ep->num, PCD_EP_DBUF_IN);  
-        }
-        /*multi-packet on the NON control IN endpoint*/
-        ep->xfer_count = PCD_GET_EP_TX_CNT(hpcd->Instance, ep->num);
-        ep->xfer_buff+=ep->xfer_count;
-       
-        /* Zero Length Packet? */
-        if (ep->xfer_len == 0)
-        {
-          /* TX COMPLETE */
-          HAL_PCD_DataInStageCallback(hpcd, ep->num);
-        }
-        else
-        {
-          HAL_PCD_EP_Transmit(hpcd, ep->num, ep->xfer_buff, ep->xfer_len);
         }
       } 
     }
@@ -1665,6 +1665,10 @@ HAL_StatusTypeDef USB_ActivateEndpoint(USB_TypeDef *USBx, USB_EPTypeDef *ep)
       /* Reset value of the data toggle bits for the endpoint out*/
       PCD_TX_DTOG(USBx, ep->num);
       
+      /* Buffer sizes are set once here. Rewriting them on every transfer
+         would wipe the count of a packet already sitting in the other one */
+      PCD_SET_EP_DBUF_CNT(USBx, ep->num, PCD_EP_DBUF_OUT, ep->maxpacket);
+      
       PCD_SET_EP_RX_STATUS(USBx, ep->num, USB_EP_RX_VALID);
       PCD_SET_EP_TX_STATUS(USBx, ep->num, USB_EP_TX_DIS);
     }
@@ -1750,41 +1754,54 @@ HAL_StatusTypeDef USB_EPStartXfer(USB_TypeDef *USBx , USB_EPTypeDef *ep)
   /* IN endpoint */
   if (ep->is_in == 1)
   {
-    /*Multi packet transfer*/
-    if (ep->xfer_len > ep->maxpacket)
-    {
-      len=ep->maxpacket;
-      ep->xfer_len-=len; 
-    }
-    else
-    {  
-      len=ep->xfer_len;
-      ep->xfer_len =0;
-    }
-    
     /* configure and validate Tx endpoint */
     if (ep->doublebuffer == 0) 
     {
+      /*Multi packet transfer*/
+      if (ep->xfer_len > ep->maxpacket)
+      {
+        len=ep->maxpacket;
+        ep->xfer_len-=len; 
+      }
+      else
+      {  
+        len=ep->xfer_len;
+        ep->xfer_len =0;
+      }
+
       USB_WritePMA(USBx, ep->xfer_buff, ep->pmaadress, len);
       PCD_SET_EP_TX_CNT(USBx, ep->num, len);
     }
+    else if (ep->xfer_len <= ep->maxpacket)
+    {
+      /* Single packet. Run the endpoint single buffered off pmaaddr0 so the
+         other buffer is never offered to the host */
+      len = ep->xfer_len;
+      ep->xfer_len_db = 0;
+
+      PCD_CLEAR_EP_DBUF(USBx, ep->num);
+      PCD_SET_EP_DBUF0_CNT(USBx, ep->num, PCD_EP_DBUF_IN, len);
+      USB_WritePMA(USBx, ep->xfer_buff, ep->pmaaddr0, len);
+    }
     else
     {
-      /* Write the data to the USB endpoint */
-      if (PCD_GET_ENDPOINT(USBx, ep->num)& USB_EP_DTOG_TX)
-      {
-        /* Set the Double buffer counter for pmabuffer1 */
-        PCD_SET_EP_DBUF1_CNT(USBx, ep->num, ep->is_in, len);
-        pmabuffer = ep->pmaaddr1;
-      }
-      else
+      /* Multi packet transfer. xfer_len counts what is not acknowledged yet,
+         xfer_len_db what is not written to PMA yet. Both buffers are filled
+         here, the one DTOG_TX points at first, and refilled from
+         PCD_EP_ISR_Handler as the host acknowledges them */
+      ep->xfer_len_db = ep->xfer_len;
+
+      PCD_SET_EP_DBUF(USBx, ep->num);
+      pmabuffer = (PCD_GET_ENDPOINT(USBx, ep->num) & USB_EP_DTOG_TX) ? 1 : 0;
+
+      /* SW_BUF marks the buffer the hardware is not to send next */
+      if (((PCD_GET_ENDPOINT(USBx, ep->num) & USB_EP_DTOG_RX) ? 1 : 0) == pmabuffer)
       {
-        /* Set the Double buffer counter for pmabuffer0 */
-        PCD_SET_EP_DBUF0_CNT(USBx, ep->num, ep->is_in, len);
-        pmabuffer = ep->pmaaddr0;
+        PCD_FreeUserBuffer(USBx, ep->num, PCD_EP_DBUF_IN);
       }
-      USB_WritePMA(USBx, ep->xfer_buff, pmabuffer, len);
-      PCD_FreeUserBuffer(USBx, ep->num, ep->is_in);
+
+      USB_EPFillDBufIn(USBx, ep, pmabuffer);
+      USB_EPFillDBufIn(USBx, ep, pmabuffer ^ 1);
     }
     
     PCD_SET_EP_TX_STATUS(USBx, ep->num, USB_EP_TX_VALID);
@@ -1809,11 +1826,6 @@ HAL_StatusTypeDef USB_EPStartXfer(USB_TypeDef *USBx , USB_EPTypeDef *ep)
       /*Set RX buffer count*/
       PCD_SET_EP_RX_CNT(USBx, ep->num, len);
     }
-    else
-    {
-      /*Set the Double buffer counter*/
-      PCD_SET_EP_DBUF_CNT(USBx, ep->num, ep->is_in, len);
-    }
     
     PCD_SET_EP_RX_STATUS(USBx, ep->num, USB_EP_RX_VALID);
   }
@@ -1821,6 +1833,40 @@ HAL_StatusTypeDef USB_EPStartXfer(USB_TypeDef *USBx , USB_EPTypeDef *ep)
   return HAL_OK;
 }
 
+/**
+  * @brief  USB_EPFillDBufIn : write the next packet of a double buffered
+  *         IN transfer into one of the endpoint PMA buffers
+  * @param  USBx : Selected device
+  * @param  ep: pointer to endpoint structure
+  * @param  bufnum : PMA buffer to fill, 0 or 1
+  * @retval HAL status
+  */
+HAL_StatusTypeDef USB_EPFillDBufIn(USB_TypeDef *USBx , USB_EPTypeDef *ep, uint8_t bufnum)
+{
+  uint32_t len = ep->xfer_len_db;
+  
+  if (len > ep->maxpacket)
+  {
+    len = ep->maxpacket;
+  }
+  
+  if (bufnum == 0)
+  {
+    PCD_SET_EP_DBUF0_CNT(USBx, ep->num, PCD_EP_DBUF_IN, len);
+    USB_WritePMA(USBx, ep->xfer_buff, ep->pmaaddr0, len);
+  }
+  else
+  {
+    PCD_SET_EP_DBUF1_CNT(USBx, ep->num, PCD_EP_DBUF_IN, len);
+    USB_WritePMA(USBx, ep->xfer_buff, ep->pmaaddr1, len);
+  }
+  
+  ep->xfer_buff += len;
+  ep->xfer_len_db -= len;
+  
+  return HAL_OK;
+}
+
 /**
   * @brief  USB_WritePacket : Writes a packet into the Tx FIFO associated 
   *         with the EP/channel
@@ -2096,6 +2142,10 @@ HAL_StatusTypeDef USB_DeActivateRemoteWakeup(USB_TypeDef *USBx)
 
 /**
   * @brief  Copy a buffer from user memory area to packet memory area (PMA)
+  * @note   PMA half-words sit at a 32 bit stride in the CPU address space.
+  *         A word aligned user buffer is read a word at a time and split
+  *         over two PMA half-words, 8 bytes per pass. An odd user buffer
+  *         is assembled byte by byte.
   * @param  USBx : pointer to USB register.
   * @param  pbUsrBuf : pointer to user memory area.
   * @param  wPMABufAddr : address into PMA.
@@ -2104,41 +2154,124 @@ HAL_StatusTypeDef USB_DeActivateRemoteWakeup(USB_TypeDef *USBx)
   */
 void USB_WritePMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
 {
-  uint32_t nbytes = (wNBytes + 1) >> 1;   /* nbytes = (wNBytes + 1) / 2 */
-  uint32_t index = 0, temp1 = 0, temp2 = 0;
-  uint16_t *pdwVal = NULL;
+  uint32_t nhalf = wNBytes >> 1;
+  uint32_t w0 = 0, w1 = 0;
+  __IO uint16_t *pdwVal = NULL;
   
-  pdwVal = (uint16_t *)(wPMABufAddr * 2 + (uint32_t)USBx + 0x400);
-  for (index = nbytes; index != 0; index--)
+  pdwVal = (__IO uint16_t *)(wPMABufAddr * 2 + (uint32_t)USBx + 0x400);
+  
+  if (((uint32_t)pbUsrBuf & 0x1) == 0)
+  {
+    /* Half-word aligned. Step up to word alignment first */
+    if ((((uint32_t)pbUsrBuf & 0x2) != 0) && (nhalf != 0))
+    {
+      *pdwVal = *(uint16_t *)pbUsrBuf;
+      pdwVal += 2;
+      pbUsrBuf += 2;
+      nhalf--;
+    }
+    
+    for (; nhalf >= 4; nhalf -= 4)
+    {
+      w0 = ((uint32_t *)pbUsrBuf)[0];
+      w1 = ((uint32_t *)pbUsrBuf)[1];
+      pdwVal[0] = (uint16_t)w0;
+      pdwVal[2] = (uint16_t)(w0 >> 16);
+      pdwVal[4] = (uint16_t)w1;
+      pdwVal[6] = (uint16_t)(w1 >> 16);
+      pdwVal += 8;
+      pbUsrBuf += 8;
+    }
+    
+    for (; nhalf != 0; nhalf--)
+    {
+      *pdwVal = *(uint16_t *)pbUsrBuf;
+      pdwVal += 2;
+      pbUsrBuf += 2;
+    }
+  }
+  else
   {
-    temp1 = (uint16_t) * pbUsrBuf;
-    pbUsrBuf++;
-    temp2 = temp1 | (uint16_t) * pbUsrBuf << 8;
-    *pdwVal++ = temp2;
-    pdwVal++;
-    pbUsrBuf++;
+    for (; nhalf >= 2; nhalf -= 2)
+    {
+      pdwVal[0] = (uint16_t)(pbUsrBuf[0] | (pbUsrBuf[1] << 8));
+      pdwVal[2] = (uint16_t)(pbUsrBuf[2] | (pbUsrBuf[3] << 8));
+      pdwVal += 4;
+      pbUsrBuf += 4;
+    }
+    
+    if (nhalf != 0)
+    {
+      *pdwVal = (uint16_t)(pbUsrBuf[0] | (pbUsrBuf[1] << 8));
+      pdwVal += 2;
+      pbUsrBuf += 2;
+    }
+  }
+  
+  /* Odd length. The byte past the end is never sent, don't read it */
+  if ((wNBytes & 0x1) != 0)
+  {
+    *pdwVal = *pbUsrBuf;
   }
 }
 
 /**
-  * @brief  Copy a buffer from user memory area to packet memory area (PMA)
+  * @brief  Copy a buffer from packet memory area (PMA) to user memory area
+  * @note   Two PMA half-words make one word store into a word aligned user
+  *         buffer, 8 bytes per pass. An odd length writes exactly wNBytes,
+  *         never the pad byte after them.
   * @param  USBx : pointer to USB register.
-* @param  pbUsrBuf : pointer to user memory area.
+  * @param  pbUsrBuf : pointer to user memory area.
   * @param  wPMABufAddr : address into PMA.
   * @param  wNBytes : number of bytes to be copied.
   * @retval None
   */
 void USB_ReadPMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
 {
-  uint32_t nbytes = (wNBytes + 1) >> 1;/* /2*/
-  uint32_t index = 0;
-  uint32_t *pdwVal = NULL;
+  uint32_t nhalf = wNBytes >> 1;
+  uint32_t w = 0;
+  __IO uint32_t *pdwVal = NULL;
+  
+  pdwVal = (__IO uint32_t *)(wPMABufAddr * 2 + (uint32_t)USBx + 0x400);
+  
+  if (((uint32_t)pbUsrBuf & 0x1) == 0)
+  {
+    /* Half-word aligned. Step up to word alignment first */
+    if ((((uint32_t)pbUsrBuf & 0x2) != 0) && (nhalf != 0))
+    {
+      *(uint16_t *)pbUsrBuf = (uint16_t)*pdwVal++;
+      pbUsrBuf += 2;
+      nhalf--;
+    }
+    
+    for (; nhalf >= 4; nhalf -= 4)
+    {
+      ((uint32_t *)pbUsrBuf)[0] = (pdwVal[0] & 0xFFFF) | (pdwVal[1] << 16);
+      ((uint32_t *)pbUsrBuf)[1] = (pdwVal[2] & 0xFFFF) | (pdwVal[3] << 16);
+      pdwVal += 4;
+      pbUsrBuf += 8;
+    }
+    
+    for (; nhalf != 0; nhalf--)
+    {
+      *(uint16_t *)pbUsrBuf = (uint16_t)*pdwVal++;
+      pbUsrBuf += 2;
+    }
+  }
+  else
+  {
+    for (; nhalf != 0; nhalf--)
+    {
+      w = *pdwVal++;
+      pbUsrBuf[0] = (uint8_t)w;
+      pbUsrBuf[1] = (uint8_t)(w >> 8);
+      pbUsrBuf += 2;
+    }
+  }
   
-  pdwVal = (uint32_t *)(wPMABufAddr * 2 + (uint32_t)USBx + 0x400);
-  for (index = nbytes; index != 0; index--)
+  if ((wNBytes & 0x1) != 0)
   {
-    *(uint16_t*)pbUsrBuf++ = *pdwVal++;
-    pbUsrBuf++;
+    *pbUsrBuf = (uint8_t)*pdwVal;
   }
 }
 
@@ -0,0 +1,364 @@
+//
+// loopback throughput and loss test for one bridged port.
+//
+// wire the port's USART TX to its RX, then
+//   cdc_bench -d /dev/ttyACM0 [-b baud] [-t seconds] [-B baud [-S]]
+//
+// a counting pattern, byte n = n % 251, is written to the CDC tty as fast
+// as it takes it, and what comes back is checked against it. a gap in
+// the pattern counts as lost bytes (modulo 251, so a single gap of 251
+// or more reads short). with -B the line coding changes to the second
+// rate half way through, which reports how long the first correct byte
+// takes to come back after the switch and what was lost from there on.
+// -S also switches to two stop bits. a frame format change re-initializes
+// the UART after draining, which is what CDC_UART_DRAIN_MS bounds.
+//
+// the port's interrupt counts are read before and after the run with
+// the CDC_GET_IRQ_COUNT vendor request, through usbfs, and reported per
+// KB that came back. that needs write access to /dev/bus/usb and a
+// device built with IRQ_PROFILE 1. other builds report 0 and the bench
+// says so. per byte interrupt RX took one USART interrupt per byte,
+// 1024/KB, which is the figure printed as before. work_get_stats() for
+// the share of time asleep in WFI is still read with the debugger.
+//
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/usbdevice_fs.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATTERN_MOD     251
+#define CHUNK_SIZE      4096
+
+/* Src/cdc_composite/usbd_cdc.h */
+#define CDC_GET_IRQ_COUNT   0x92
+#define CDC_IRQ_COUNT_SIZE  12
+
+/* one USART interrupt per byte, before circular DMA RX */
+#define IRQ_PER_KB_BEFORE   1024
+
+typedef struct
+{
+  uint64_t  sent;
+  uint64_t  received;
+  uint64_t  lost;
+  uint8_t   expect;
+  int       synced;
+} bench_t;
+
+static double
+now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static speed_t
+to_speed(long baud)
+{
+  switch(baud)
+  {
+  case 9600:    return B9600;
+  case 19200:   return B19200;
+  case 38400:   return B38400;
+  case 57600:   return B57600;
+  case 115200:  return B115200;
+  case 230400:  return B230400;
+  case 460800:  return B460800;
+  case 921600:  return B921600;
+  case 1000000: return B1000000;
+  case 2000000: return B2000000;
+  default:      break;
+  }
+  fprintf(stderr, "unsupported baud rate %ld\n", baud);
+  exit(2);
+}
+
+static void
+set_baud(int fd, long baud, int stop2)
+{
+  struct termios  tio;
+
+  if(tcgetattr(fd, &tio) != 0)
+  {
+    perror("tcgetattr");
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, to_speed(baud));
+  cfsetospeed(&tio, to_speed(baud));
+  if(stop2)
+  {
+    tio.c_cflag |= CSTOPB;
+  }
+
+  /* the CDC driver turns this into SET_LINE_CODING */
+  if(tcsetattr(fd, TCSANOW, &tio) != 0)
+  {
+    perror("tcsetattr");
+    exit(1);
+  }
+}
+
+static int
+read_sysfs(const char* dir, const char* name, const char* fmt, int* val)
+{
+  char  path[PATH_MAX];
+  FILE* f;
+  int   ok;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  f = fopen(path, "r");
+  if(f == NULL)
+  {
+    return -1;
+  }
+  ok = fscanf(f, fmt, val) == 1;
+  fclose(f);
+  return ok ? 0 : -1;
+}
+
+// the USART, RX DMA and TX DMA interrupt counts of the port behind the
+// tty. -1 if the device can't be reached through usbfs
+static int
+read_irq_count(const char* dev, uint32_t count[3])
+{
+  char    tty[PATH_MAX], path[PATH_MAX + 32], intf[PATH_MAX];
+  char*   name;
+  int     ifnum, busnum, devnum, fd, i, ret;
+  uint8_t data[CDC_IRQ_COUNT_SIZE];
+  struct usbdevfs_ctrltransfer  ctrl;
+
+  if(realpath(dev, tty) == NULL)
+  {
+    return -1;
+  }
+  name = strrchr(tty, '/');
+  name = name != NULL ? name + 1 : tty;
+
+  /* the tty's device is the port's control interface, its parent the device */
+  snprintf(path, sizeof(path), "/sys/class/tty/%s/device", name);
+  if(realpath(path, intf) == NULL || read_sysfs(intf, "bInterfaceNumber", "%x", &ifnum) != 0)
+  {
+    return -1;
+  }
+  *strrchr(intf, '/') = '\0';
+  if(read_sysfs(intf, "busnum", "%d", &busnum) != 0 || read_sysfs(intf, "devnum", "%d", &devnum) != 0)
+  {
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", busnum, devnum);
+  fd = open(path, O_RDWR);
+  if(fd < 0)
+  {
+    return -1;
+  }
+
+  /* vendor type, so usbfs lets it through while cdc_acm has the interface */
+  memset(&ctrl, 0, sizeof(ctrl));
+  ctrl.bRequestType = 0xC1;
+  ctrl.bRequest     = CDC_GET_IRQ_COUNT;
+  ctrl.wIndex       = ifnum;
+  ctrl.wLength      = CDC_IRQ_COUNT_SIZE;
+  ctrl.timeout      = 1000;
+  ctrl.data         = data;
+  ret = ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+  close(fd);
+  if(ret != CDC_IRQ_COUNT_SIZE)
+  {
+    return -1;
+  }
+
+  for(i = 0; i < 3; i++)
+  {
+    count[i] = (uint32_t)data[4 * i] | ((uint32_t)data[4 * i + 1] << 8) |
+        ((uint32_t)data[4 * i + 2] << 16) | ((uint32_t)data[4 * i + 3] << 24);
+  }
+  return 0;
+}
+
+// returns the number of bytes that matched the pattern
+static size_t
+check(bench_t* b, const uint8_t* buf, size_t len)
+{
+  size_t  i;
+  size_t  good = 0;
+
+  for(i = 0; i < len; i++)
+  {
+    if(!b->synced)
+    {
+      /* whatever the device had in its ring from before */
+      b->expect = buf[i];
+      b->synced = 1;
+    }
+
+    if(buf[i] != b->expect)
+    {
+      b->lost  += (buf[i] + PATTERN_MOD - b->expect) % PATTERN_MOD;
+      b->expect = buf[i];
+    }
+    else
+    {
+      good++;
+    }
+    b->expect = (b->expect + 1) % PATTERN_MOD;
+  }
+
+  b->received += len;
+  return good;
+}
+
+int
+main(int argc, char** argv)
+{
+  const char*     dev = "/dev/ttyACM0";
+  long            baud = 115200;
+  long            baud2 = 0;
+  int             stop2 = 0;
+  double          secs = 10;
+  int             fd, opt;
+  bench_t         b;
+  uint8_t         out[CHUNK_SIZE], in[CHUNK_SIZE];
+  size_t          out_len = 0, out_pos = 0;
+  double          start, end, t, switch_at = 0, first_after = 0;
+  uint64_t        lost_before = 0;
+  struct pollfd   pfd;
+  ssize_t         n;
+  size_t          i;
+  uint32_t        irq_start[3], irq_end[3];
+  int             irq_ok;
+
+  while((opt = getopt(argc, argv, "d:b:B:St:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'd': dev   = optarg;         break;
+    case 'b': baud  = atol(optarg);   break;
+    case 'B': baud2 = atol(optarg);   break;
+    case 'S': stop2 = 1;              break;
+    case 't': secs  = atof(optarg);   break;
+    default:
+      fprintf(stderr, "usage: %s [-d tty] [-b baud] [-B baud [-S]] [-t seconds]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0)
+  {
+    perror(dev);
+    return 1;
+  }
+  set_baud(fd, baud, 0);
+  tcflush(fd, TCIOFLUSH);
+
+  memset(&b, 0, sizeof(b));
+  pfd.fd = fd;
+  irq_ok = read_irq_count(dev, irq_start) == 0;
+
+  start = now_sec();
+  end   = start + secs;
+
+  while((t = now_sec()) < end)
+  {
+    if(baud2 != 0 && switch_at == 0 && t >= start + secs / 2)
+    {
+      set_baud(fd, baud2, stop2);
+      switch_at   = now_sec();
+      lost_before = b.lost;
+    }
+
+    if(out_pos == out_len)
+    {
+      for(i = 0; i < CHUNK_SIZE; i++)
+      {
+        out[i] = (uint8_t)((b.sent + i) % PATTERN_MOD);
+      }
+      out_len = CHUNK_SIZE;
+      out_pos = 0;
+    }
+
+    pfd.events = POLLIN | POLLOUT;
+    if(poll(&pfd, 1, 100) < 0)
+    {
+      perror("poll");
+      return 1;
+    }
+
+    if(pfd.revents & POLLOUT)
+    {
+      n = write(fd, &out[out_pos], out_len - out_pos);
+      if(n > 0)
+      {
+        out_pos += n;
+        b.sent  += n;
+      }
+      else if(n < 0 && errno != EAGAIN)
+      {
+        perror("write");
+        return 1;
+      }
+    }
+
+    if(pfd.revents & POLLIN)
+    {
+      n = read(fd, in, sizeof(in));
+      if(n > 0 && check(&b, in, n) != 0 && switch_at != 0 && first_after == 0)
+      {
+        first_after = now_sec();
+      }
+    }
+  }
+
+  /* what is still on its way back */
+  while(poll(&pfd, 1, 200) > 0 && (n = read(fd, in, sizeof(in))) > 0)
+  {
+    check(&b, in, n);
+  }
+
+  irq_ok = irq_ok && read_irq_count(dev, irq_end) == 0;
+  for(i = 0; irq_ok && i < 3; i++)
+  {
+    irq_end[i] -= irq_start[i];
+  }
+
+  printf("sent      %llu bytes\n", (unsigned long long)b.sent);
+  printf("received  %llu bytes, %.0f bytes/s\n", (unsigned long long)b.received, b.received / secs);
+  printf("lost      %llu bytes\n", (unsigned long long)b.lost);
+  if(switch_at != 0)
+  {
+    printf("switch    %ld -> %ld baud%s, first byte back after %.1f ms, %llu bytes lost from then on\n",
+        baud, baud2, stop2 ? " 2 stop bits" : "", first_after != 0 ? (first_after - switch_at) * 1e3 : -1.0,
+        (unsigned long long)(b.lost - lost_before));
+  }
+  if(!irq_ok)
+  {
+    printf("irqs      not available, no usbfs access to the device\n");
+  }
+  else if(irq_end[0] + irq_end[1] + irq_end[2] == 0)
+  {
+    printf("irqs      not counted, the device is not an IRQ_PROFILE build\n");
+  }
+  else if(b.received != 0)
+  {
+    /* both directions run through the one USART, but RX is what went per byte */
+    printf("irqs      usart %u, rx dma %u, tx dma %u. %.1f usart + rx dma per KB received, %d before\n",
+        irq_end[0], irq_end[1], irq_end[2],
+        (irq_end[0] + irq_end[1]) * 1024.0 / b.received, IRQ_PER_KB_BEFORE);
+  }
+
+  close(fd);
+  return 0;
+}
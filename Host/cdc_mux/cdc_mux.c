@@ -0,0 +1,257 @@
+#include <string.h>
+#include "cdc_mux.h"
+
+//
+// frames are built in a local buffer and handed to the write callback
+// one at a time. input is parsed as a stream, the same way the firmware
+// parses OUT transfers.
+//
+#define CDC_MUX_PARSE_HDR       0
+#define CDC_MUX_PARSE_LEN       1
+#define CDC_MUX_PARSE_PAYLOAD   2
+
+static const uint8_t _sync_frame[CDC_MUX_HDR_SIZE + CDC_MUX_SYNC_SIZE] =
+{
+  CDC_MUX_HDR(CDC_MUX_TYPE_SYNC, CDC_MUX_SYNC_CHAN),
+  CDC_MUX_SYNC_SIZE,
+  'M', 'U', 'X', '1',
+};
+
+static int
+send_frame(cdc_mux_t* mux, uint8_t type, unsigned chan, const uint8_t* payload, uint8_t len)
+{
+  uint8_t frame[CDC_MUX_HDR_SIZE + CDC_MUX_MAX_PAYLOAD];
+
+  frame[0] = CDC_MUX_HDR(type, chan);
+  frame[1] = len;
+  memcpy(&frame[CDC_MUX_HDR_SIZE], payload, len);
+
+  return mux->write(mux->ctx, frame, CDC_MUX_HDR_SIZE + len);
+}
+
+void
+cdc_mux_init(cdc_mux_t* mux, cdc_mux_write_fn write, cdc_mux_data_fn on_data, void* ctx)
+{
+  memset(mux, 0, sizeof(*mux));
+
+  mux->write    = write;
+  mux->on_data  = on_data;
+  mux->ctx      = ctx;
+  mux->state    = CDC_MUX_PARSE_HDR;
+}
+
+int
+cdc_mux_sync(cdc_mux_t* mux)
+{
+  unsigned chan;
+
+  /* everything up to the echo belongs to the previous session */
+  mux->synced     = 0;
+  mux->sync_match = 0;
+  mux->state      = CDC_MUX_PARSE_HDR;
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    mux->tx_credit[chan]    = 0;
+    mux->serial_state[chan] = 0;
+  }
+
+  return mux->write(mux->ctx, _sync_frame, sizeof(_sync_frame));
+}
+
+int
+cdc_mux_grant(cdc_mux_t* mux, unsigned chan, uint16_t bytes)
+{
+  uint8_t payload[CDC_MUX_CREDIT_SIZE];
+
+  if(chan >= CDC_MUX_NUM_CHANNELS || bytes == 0)
+  {
+    return 0;
+  }
+
+  payload[0] = (uint8_t)(bytes);
+  payload[1] = (uint8_t)(bytes >> 8);
+  return send_frame(mux, CDC_MUX_TYPE_CREDIT, chan, payload, sizeof(payload));
+}
+
+int
+cdc_mux_set_line_coding(cdc_mux_t* mux, unsigned chan, uint32_t baud,
+                        uint8_t stop_bits, uint8_t parity, uint8_t data_bits)
+{
+  uint8_t payload[CDC_MUX_LINE_CODING_SIZE];
+
+  if(chan >= CDC_MUX_NUM_CHANNELS)
+  {
+    return -1;
+  }
+
+  payload[0] = (uint8_t)(baud);
+  payload[1] = (uint8_t)(baud >> 8);
+  payload[2] = (uint8_t)(baud >> 16);
+  payload[3] = (uint8_t)(baud >> 24);
+  payload[4] = stop_bits;
+  payload[5] = parity;
+  payload[6] = data_bits;
+  return send_frame(mux, CDC_MUX_TYPE_LINE_CODING, chan, payload, sizeof(payload));
+}
+
+size_t
+cdc_mux_write(cdc_mux_t* mux, unsigned chan, const uint8_t* buf, size_t len)
+{
+  size_t  done = 0;
+  size_t  n;
+
+  if(chan >= CDC_MUX_NUM_CHANNELS)
+  {
+    return 0;
+  }
+
+  if(len > mux->tx_credit[chan])
+  {
+    len = mux->tx_credit[chan];
+  }
+
+  while(done < len)
+  {
+    n = len - done;
+    if(n > CDC_MUX_MAX_PAYLOAD)
+    {
+      n = CDC_MUX_MAX_PAYLOAD;
+    }
+
+    if(send_frame(mux, CDC_MUX_TYPE_DATA, chan, &buf[done], (uint8_t)n) < 0)
+    {
+      break;
+    }
+    mux->tx_credit[chan] -= n;
+    done += n;
+  }
+  return done;
+}
+
+size_t
+cdc_mux_tx_credit(cdc_mux_t* mux, unsigned chan)
+{
+  return chan < CDC_MUX_NUM_CHANNELS ? mux->tx_credit[chan] : 0;
+}
+
+uint16_t
+cdc_mux_serial_state(cdc_mux_t* mux, unsigned chan)
+{
+  uint16_t state;
+
+  if(chan >= CDC_MUX_NUM_CHANNELS)
+  {
+    return 0;
+  }
+
+  state = mux->serial_state[chan];
+  mux->serial_state[chan] = 0;
+  return state;
+}
+
+static void
+frame_done(cdc_mux_t* mux)
+{
+  unsigned chan = CDC_MUX_HDR_CHAN(mux->hdr);
+
+  if(chan >= CDC_MUX_NUM_CHANNELS)
+  {
+    return;
+  }
+
+  if(CDC_MUX_HDR_TYPE(mux->hdr) == CDC_MUX_TYPE_CREDIT && mux->len == CDC_MUX_CREDIT_SIZE)
+  {
+    mux->tx_credit[chan] += (uint32_t)(mux->ctl[0] | (mux->ctl[1] << 8));
+  }
+  else if(CDC_MUX_HDR_TYPE(mux->hdr) == CDC_MUX_TYPE_SERIAL_STATE &&
+          mux->len == CDC_MUX_SERIAL_STATE_SIZE)
+  {
+    mux->serial_state[chan] |= (uint16_t)(mux->ctl[0] | (mux->ctl[1] << 8));
+  }
+}
+
+void
+cdc_mux_input(cdc_mux_t* mux, const uint8_t* buf, size_t len)
+{
+  size_t    n;
+  unsigned  chan;
+
+  /* hunt for the SYNC echo. a mismatch restarts the match at this byte */
+  while(!mux->synced && len != 0)
+  {
+    if(*buf == _sync_frame[mux->sync_match])
+    {
+      mux->sync_match++;
+    }
+    else
+    {
+      mux->sync_match = (*buf == _sync_frame[0]) ? 1 : 0;
+    }
+    buf++;
+    len--;
+
+    if(mux->sync_match == sizeof(_sync_frame))
+    {
+      mux->synced = 1;
+    }
+  }
+
+  while(len != 0)
+  {
+    switch(mux->state)
+    {
+    case CDC_MUX_PARSE_HDR:
+      mux->hdr    = *buf++;
+      len--;
+      mux->state  = CDC_MUX_PARSE_LEN;
+      break;
+
+    case CDC_MUX_PARSE_LEN:
+      mux->len    = *buf++;
+      len--;
+      mux->pos    = 0;
+      if(mux->len == 0)
+      {
+        frame_done(mux);
+        mux->state = CDC_MUX_PARSE_HDR;
+      }
+      else
+      {
+        mux->state = CDC_MUX_PARSE_PAYLOAD;
+      }
+      break;
+
+    case CDC_MUX_PARSE_PAYLOAD:
+      n = mux->len - mux->pos;
+      if(n > len)
+      {
+        n = len;
+      }
+
+      chan = CDC_MUX_HDR_CHAN(mux->hdr);
+      if(CDC_MUX_HDR_TYPE(mux->hdr) == CDC_MUX_TYPE_DATA)
+      {
+        if(chan < CDC_MUX_NUM_CHANNELS && mux->on_data != NULL)
+        {
+          mux->on_data(mux->ctx, chan, buf, n);
+        }
+      }
+      else if(mux->pos < sizeof(mux->ctl))
+      {
+        memcpy(&mux->ctl[mux->pos], buf,
+            (mux->pos + n > sizeof(mux->ctl)) ? sizeof(mux->ctl) - mux->pos : n);
+      }
+
+      buf       += n;
+      len       -= n;
+      mux->pos  += n;
+      if(mux->pos == mux->len)
+      {
+        frame_done(mux);
+        mux->state = CDC_MUX_PARSE_HDR;
+      }
+      break;
+    }
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef __CDC_MUX_H
+#define __CDC_MUX_H
+
+//
+// host side of the multiplexed mode (USBD_CDC_MUX).
+//
+// transport agnostic. the caller opens the CDC tty (or a libusb bulk
+// pair), hands a write callback in and feeds whatever it reads from the
+// pipe to cdc_mux_input(). demultiplexed serial data comes back through
+// the data callback.
+//
+// typical session
+//   cdc_mux_init(&mux, pipe_write, on_data, ctx);
+//   cdc_mux_sync(&mux);
+//   cdc_mux_grant(&mux, chan, room);          for every channel read from
+//   loop:
+//     n = read(fd, buf, sizeof(buf));
+//     cdc_mux_input(&mux, buf, n);            calls on_data, grant again
+//     cdc_mux_write(&mux, chan, data, len);   bounded by device credit
+//
+// cdc_mux_serial_state() returns the UART error bits (CDC SERIAL_STATE
+// layout) the device has reported for a channel since the last call.
+//
+// cdc_mux_write() and cdc_mux_tx_credit() only know of credit the device
+// has returned so far. nothing is sent to a channel before the device's
+// initial grant that follows its SYNC echo.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cdc_mux_proto.h"
+
+typedef int   (*cdc_mux_write_fn)(void* ctx, const uint8_t* buf, size_t len);
+typedef void  (*cdc_mux_data_fn)(void* ctx, unsigned chan, const uint8_t* buf, size_t len);
+
+typedef struct
+{
+  cdc_mux_write_fn  write;
+  cdc_mux_data_fn   on_data;
+  void*             ctx;
+
+  int               synced;       /* SYNC echo seen. input before it is noise */
+  unsigned          sync_match;   /* bytes of the SYNC echo matched so far    */
+
+  uint32_t          tx_credit[CDC_MUX_NUM_CHANNELS];
+  uint16_t          serial_state[CDC_MUX_NUM_CHANNELS];
+
+  /* input frame parser */
+  int               state;
+  uint8_t           hdr;
+  uint8_t           len;
+  uint8_t           pos;
+  uint8_t           ctl[CDC_MUX_CREDIT_SIZE];
+} cdc_mux_t;
+
+extern void   cdc_mux_init(cdc_mux_t* mux, cdc_mux_write_fn write, cdc_mux_data_fn on_data, void* ctx);
+extern int    cdc_mux_sync(cdc_mux_t* mux);
+extern int    cdc_mux_grant(cdc_mux_t* mux, unsigned chan, uint16_t bytes);
+extern int    cdc_mux_set_line_coding(cdc_mux_t* mux, unsigned chan, uint32_t baud,
+                                      uint8_t stop_bits, uint8_t parity, uint8_t data_bits);
+extern size_t cdc_mux_write(cdc_mux_t* mux, unsigned chan, const uint8_t* buf, size_t len);
+extern size_t cdc_mux_tx_credit(cdc_mux_t* mux, unsigned chan);
+extern uint16_t cdc_mux_serial_state(cdc_mux_t* mux, unsigned chan);
+extern void   cdc_mux_input(cdc_mux_t* mux, const uint8_t* buf, size_t len);
+
+#endif /* __CDC_MUX_H */
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hal_stub.h"
+#include "host_cmsis.h"
+#include "gpio.h"
+#include "work.h"
+#include "usbd_def.h"
+
+host_uart_t           host_uart[HOST_PORTS];
+USART_TypeDef         host_usart[HOST_PORTS];
+DMA_Channel_TypeDef   host_dma_rx[HOST_PORTS];
+DMA_Channel_TypeDef   host_dma_tx[HOST_PORTS];
+uint32_t              host_tick;
+uint32_t              host_work_posted;
+
+uint32_t              host_primask;
+uint64_t              host_irq_pending;
+uint64_t              host_irq_held;
+SCB_Type              host_scb;
+
+static DMA_HandleTypeDef  _hdma_rx[HOST_PORTS];
+static DMA_HandleTypeDef  _hdma_tx[HOST_PORTS];
+
+UART_HandleTypeDef    huart1;
+UART_HandleTypeDef    huart2;
+UART_HandleTypeDef    huart3;
+USBD_HandleTypeDef    hUsbDeviceFS;
+
+static UART_HandleTypeDef* const _huart[HOST_PORTS] = { &huart1, &huart2, &huart3 };
+
+void
+host_reset(void)
+{
+  int i;
+
+  memset(host_uart, 0, sizeof(host_uart));
+  memset(host_usart, 0, sizeof(host_usart));
+  memset(host_dma_rx, 0, sizeof(host_dma_rx));
+  memset(host_dma_tx, 0, sizeof(host_dma_tx));
+  memset(&hUsbDeviceFS, 0, sizeof(hUsbDeviceFS));
+  host_tick = 0;
+  host_work_posted = 0;
+  host_primask = 0;
+  host_irq_pending = 0;
+  host_irq_held = 0;
+
+  for(i = 0; i < HOST_PORTS; i++)
+  {
+    memset(_huart[i], 0, sizeof(UART_HandleTypeDef));
+    _hdma_rx[i].Instance = &host_dma_rx[i];
+    _hdma_tx[i].Instance = &host_dma_tx[i];
+    _huart[i]->Instance = &host_usart[i];
+    _huart[i]->hdmarx = &_hdma_rx[i];
+    _huart[i]->hdmatx = &_hdma_tx[i];
+    host_uart[i].cts = 1;
+  }
+}
+
+int
+host_port(UART_HandleTypeDef* huart)
+{
+  int i;
+
+  for(i = 0; i < HOST_PORTS; i++)
+  {
+    if(_huart[i] == huart)
+    {
+      return i;
+    }
+  }
+  abort();
+}
+
+//
+// what the RX DMA channel does with bytes off the line: they go to the
+// ring at the position its counter gives, and the counter moves on
+//
+void
+host_uart_rx(UART_HandleTypeDef* huart, const uint8_t* data, int len)
+{
+  host_uart_t*          u = &host_uart[host_port(huart)];
+  DMA_Channel_TypeDef*  dma = huart->hdmarx->Instance;
+  int                   i;
+
+  for(i = 0; i < len; i++)
+  {
+    u->rx_buf[u->rx_size - dma->CNDTR] = data[i];
+    dma->CNDTR = (dma->CNDTR == 1) ? u->rx_size : dma->CNDTR - 1;
+  }
+}
+
+HAL_StatusTypeDef
+HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+  host_uart_t*  u = &host_uart[host_port(huart)];
+
+  /* MspInit, as in usart.c */
+  if(huart->State == HAL_UART_STATE_RESET)
+  {
+    u->irq_on = !usart_irq_held(huart);
+  }
+
+  u->inits++;
+  u->init_masked = (host_primask != 0);
+  u->init_held   = u->held && (host_irq_held & ((uint64_t)1 << USB_LP_CAN1_RX0_IRQn)) != 0;
+  huart->State = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef
+HAL_UART_DeInit(UART_HandleTypeDef *huart)
+{
+  host_uart[host_port(huart)].deinits++;
+  host_uart[host_port(huart)].irq_on = 0;
+  huart->Instance->CR1 = 0;
+  huart->Instance->CR3 = 0;
+  huart->hdmarx->Instance->CNDTR = 0;
+  huart->hdmatx->Instance->CNDTR = 0;
+  huart->State = HAL_UART_STATE_RESET;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef
+HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  host_uart_t*  u = &host_uart[host_port(huart)];
+
+  u->rx_irq_on = u->irq_on;
+  u->rx_buf = pData;
+  u->rx_size = Size;
+  huart->hdmarx->Instance->CNDTR = Size;
+  SET_BIT(huart->Instance->CR3, USART_CR3_DMAR);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef
+HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  host_uart_t*  u = &host_uart[host_port(huart)];
+
+  u->tx_buf = pData;
+  u->tx_size = Size;
+  u->tx_starts++;
+  huart->hdmatx->Instance->CNDTR = Size;
+  SET_BIT(huart->Instance->CR3, USART_CR3_DMAT);
+  return HAL_OK;
+}
+
+void
+HAL_UART_IRQHandler(UART_HandleTypeDef *huart)
+{
+}
+
+uint32_t
+HAL_GetTick(void)
+{
+  return host_tick;
+}
+
+void
+usart_set_baudrate(UART_HandleTypeDef* huart, uint32_t baudrate)
+{
+  huart->Init.BaudRate = baudrate;
+}
+
+void
+usart_irq_hold(UART_HandleTypeDef* huart, uint8_t hold)
+{
+  host_uart_t*  u = &host_uart[host_port(huart)];
+
+  u->held = hold;
+  u->irq_on = !hold && huart->State != HAL_UART_STATE_RESET;
+}
+
+uint8_t
+usart_irq_held(UART_HandleTypeDef* huart)
+{
+  return host_uart[host_port(huart)].held;
+}
+
+void
+usart_irq_count(UART_HandleTypeDef* huart, uint32_t count[3])
+{
+  count[0] = 0;
+  count[1] = 0;
+  count[2] = 0;
+}
+
+void
+usart_tx_break(UART_HandleTypeDef* huart, uint8_t on)
+{
+  host_uart[host_port(huart)].brk = on;
+}
+
+void
+gpio_cdc_control_lines(uint8_t port, uint8_t dtr, uint8_t rts)
+{
+  host_uart[port].rts = rts;
+}
+
+void
+gpio_cdc_rts(uint8_t port, uint8_t rts)
+{
+  host_uart[port].rts = rts;
+}
+
+uint8_t
+gpio_cdc_cts(uint8_t port)
+{
+  return host_uart[port].cts;
+}
+
+uint8_t
+gpio_cdc_cts_port(uint16_t pin)
+{
+  return HOST_PORTS;
+}
+
+void
+work_post(work_id_t id)
+{
+  host_work_posted |= 1 << id;
+}
+
+void
+work_post_in(work_id_t id, uint16_t ms)
+{
+  host_work_posted |= 1 << id;
+}
+
+void
+_Error_Handler(char* file, int line)
+{
+  printf("%s:%d: Error_Handler\n", file, line);
+  abort();
+}
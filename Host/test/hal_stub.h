@@ -0,0 +1,44 @@
+#ifndef __HAL_STUB_H
+#define __HAL_STUB_H
+
+//
+// HAL UART, USART, GPIO and work queue stand-ins for host tests of
+// usbd_cdc_if.c. the UART handles point at fake USART and DMA channel
+// registers, which the module reads and writes as it would on target
+//
+#include "stm32f1xx_hal.h"
+#include "usart.h"
+
+#define HOST_PORTS      3
+
+typedef struct
+{
+  uint8_t*  rx_buf;       /* circular RX DMA ring      */
+  uint16_t  rx_size;
+  uint8_t*  tx_buf;       /* last UART TX DMA chunk    */
+  uint16_t  tx_size;
+  int       tx_starts;    /* HAL_UART_Transmit_DMA     */
+  int       inits;        /* HAL_UART_Init             */
+  int       deinits;      /* HAL_UART_DeInit           */
+  uint8_t   brk;          /* usart_tx_break            */
+  uint8_t   rts;          /* gpio_cdc_rts, 1 asserted  */
+  uint8_t   cts;          /* gpio_cdc_cts, 1 ready     */
+  uint8_t   held;         /* usart_irq_hold            */
+  uint8_t   irq_on;       /* USART NVIC line enabled   */
+  uint8_t   rx_irq_on;    /* that, at RX DMA start     */
+  uint8_t   init_masked;  /* PRIMASK at the last Init  */
+  uint8_t   init_held;    /* USB and port held then    */
+} host_uart_t;
+
+extern host_uart_t          host_uart[HOST_PORTS];
+extern USART_TypeDef        host_usart[HOST_PORTS];
+extern DMA_Channel_TypeDef  host_dma_rx[HOST_PORTS];
+extern DMA_Channel_TypeDef  host_dma_tx[HOST_PORTS];
+extern uint32_t             host_tick;
+extern uint32_t             host_work_posted;
+
+extern void host_reset(void);
+extern int  host_port(UART_HandleTypeDef* huart);
+extern void host_uart_rx(UART_HandleTypeDef* huart, const uint8_t* data, int len);
+
+#endif /* __HAL_STUB_H */
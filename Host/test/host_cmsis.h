@@ -0,0 +1,32 @@
+#ifndef __HOST_CMSIS_H
+#define __HOST_CMSIS_H
+
+//
+// host stand-ins for the Cortex-M3 core access of firmware modules that
+// a test includes as source. include it after the firmware headers and
+// before the module's .c file, whose calls then land here instead of in
+// the asm of cmsis_gcc.h and the core peripherals
+//
+#include "stm32f1xx_hal.h"
+
+extern uint32_t   host_primask;
+extern uint64_t   host_irq_pending;   /* bit per IRQn, NVIC_SetPendingIRQ */
+extern uint64_t   host_irq_held;      /* bit per IRQn, NVIC_DisableIRQ    */
+extern SCB_Type   host_scb;
+
+#define __get_PRIMASK()           (host_primask)
+#define __set_PRIMASK(m)          (host_primask = (m))
+#define __disable_irq()           (host_primask = 1)
+#define __enable_irq()            (host_primask = 0)
+#define __WFI()                   do { } while(0)
+#define __DSB()                   do { } while(0)
+#define __ISB()                   do { } while(0)
+
+#define NVIC_SetPendingIRQ(irq)   (host_irq_pending |= (uint64_t)1 << (irq))
+#define NVIC_DisableIRQ(irq)      (host_irq_held |= (uint64_t)1 << (irq))
+#define NVIC_EnableIRQ(irq)       (host_irq_held &= ~((uint64_t)1 << (irq)))
+
+#undef SCB
+#define SCB                       (&host_scb)
+
+#endif /* __HOST_CMSIS_H */
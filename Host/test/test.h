@@ -0,0 +1,42 @@
+#ifndef __TEST_H
+#define __TEST_H
+
+//
+// checks for the host tests. each test is a program of its own, its
+// main() runs the cases and returns test_result()
+//
+#include <stdio.h>
+
+static int  test_failures;
+
+#define CHECK(cond)                                                     \
+  do                                                                    \
+  {                                                                     \
+    if(!(cond))                                                         \
+    {                                                                   \
+      printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);                 \
+      test_failures++;                                                  \
+    }                                                                   \
+  } while(0)
+
+#define CHECK_EQ(a, b)                                                  \
+  do                                                                    \
+  {                                                                     \
+    long  _a = (long)(a);                                               \
+    long  _b = (long)(b);                                               \
+    if(_a != _b)                                                        \
+    {                                                                   \
+      printf("%s:%d: %s == %s, %ld != %ld\n", __FILE__, __LINE__,       \
+          #a, #b, _a, _b);                                              \
+      test_failures++;                                                  \
+    }                                                                   \
+  } while(0)
+
+static inline int
+test_result(const char* name)
+{
+  printf("%-20s %s\n", name, test_failures == 0 ? "ok" : "FAILED");
+  return test_failures != 0;
+}
+
+#endif /* __TEST_H */
@@ -0,0 +1,114 @@
+//
+// SEND_BREAK on port 0, replayed through usbd_cdc_if.c. a timed break
+// is counted down by SOF, which only comes while the class asks for it
+//
+#include <string.h>
+#include "usbd_cdc_if.h"
+#include "usbd_ll_stub.h"
+#include "hal_stub.h"
+#include "host_cmsis.h"
+#include "test.h"
+
+#include "../../Src/usbd_cdc_if.c"
+
+static void
+connect(void)
+{
+  host_reset();
+  ll_log_clear();
+  ll_sof_enabled = 0;
+
+  hUsbDeviceFS.dev_speed = USBD_SPEED_FULL;
+  USBD_CDC_RegisterInterface(&hUsbDeviceFS, &USBD_Interface_fops_FS);
+  USBD_CDC.Init(&hUsbDeviceFS, 0);
+  usbd_cdc_if_poll();
+  CHECK_EQ(host_uart[0].inits, 1);
+}
+
+static void
+send_break(uint16_t ms)
+{
+  USBD_SetupReqTypedef  req;
+
+  memset(&req, 0, sizeof(req));
+  req.bRequest = CDC_SEND_BREAK;
+  req.wValue   = ms;
+  CDC_Control_FS(CDC_SEND_BREAK, (uint8_t*)&req, 0, USBD_CDC_Instance_0);
+}
+
+/* ms until the line is released, SOF only while enabled. -1 if it isn't */
+static int
+run_break(int limit)
+{
+  int ms;
+
+  for(ms = 0; ms < limit; ms++)
+  {
+    if(!host_uart[0].brk)
+    {
+      return ms;
+    }
+    host_tick++;
+    if(ll_sof_enabled)
+    {
+      CDC_SOF_FS();
+    }
+  }
+  return -1;
+}
+
+static void
+check_timed(void)
+{
+  int ms;
+
+  connect();
+
+  send_break(100);
+  CHECK_EQ(host_uart[0].brk, 1);
+  CHECK_EQ(ll_sof_enabled, 1);
+
+  ms = run_break(200);
+  CHECK(ms >= 100 && ms <= 101);
+}
+
+static void
+check_forever_then_timed(void)
+{
+  int ms;
+
+  connect();
+
+  /* lasts until SEND_BREAK 0. nothing to time */
+  send_break(BREAK_FOREVER);
+  CHECK_EQ(host_uart[0].brk, 1);
+  CHECK_EQ(run_break(50), -1);
+  CHECK_EQ(ll_sof_enabled, 0);
+
+  /* then a duration. it ends from here */
+  send_break(100);
+  CHECK_EQ(host_uart[0].brk, 1);
+  ms = run_break(200);
+  CHECK(ms >= 100 && ms <= 101);
+}
+
+static void
+check_forever_then_off(void)
+{
+  connect();
+
+  send_break(BREAK_FOREVER);
+  CHECK_EQ(run_break(10), -1);
+  send_break(0);
+  CHECK_EQ(host_uart[0].brk, 0);
+}
+
+int
+main(void)
+{
+  check_timed();
+  check_forever_then_timed();
+  check_forever_then_off();
+
+  return test_result("break");
+}
@@ -0,0 +1,150 @@
+//
+// walks the composite configuration descriptors built by
+// CDC_ACM_FUNCTION_DESC. built once per configuration in the Makefile:
+// 1, 2 and 3 ports, and 2 ports with the vendor interface
+//
+#include <string.h>
+#include "usbd_cdc.h"
+#if (USBD_VENDOR_BULK == 1)
+#include "usbd_vendor.h"
+#endif
+#include "test.h"
+
+#define DESC_IAD        0x0b
+#define DESC_CS_IF      0x24
+#define CS_UNION        0x06
+#define CS_CALL_MGMT    0x01
+
+static void
+check_config(uint8_t* desc, uint16_t length, uint8_t type, uint16_t bulk_mps)
+{
+  uint8_t   interfaces[8];
+  int       num_if = 0;
+  int       num_ep = 0;
+  int       func = -1;
+  int       if_no = -1;
+  uint16_t  pos;
+  int       i;
+
+  CHECK_EQ(desc[0], 9);
+  CHECK_EQ(desc[1], type);
+  CHECK_EQ(desc[2] | (desc[3] << 8), length);
+  CHECK_EQ(desc[4], USBD_CDC_NUM_PORTS * 2 + USBD_VENDOR_BULK);
+
+  for(pos = desc[0]; pos < length; pos += desc[pos])
+  {
+    uint8_t*  d = &desc[pos];
+
+    CHECK(d[0] >= 2);
+    CHECK(pos + d[0] <= length);
+    if(d[0] < 2)
+    {
+      return;
+    }
+
+    switch(d[1])
+    {
+    case DESC_IAD:
+      func++;
+      CHECK_EQ(d[2], func * 2);
+      CHECK_EQ(d[3], 2);
+      CHECK_EQ(d[4], 0x02);
+      CHECK_EQ(d[5], 0x02);
+      break;
+
+    case USB_DESC_TYPE_INTERFACE:
+      if_no = d[2];
+      CHECK(num_if < sizeof(interfaces));
+      interfaces[num_if++] = if_no;
+      if(if_no < USBD_CDC_NUM_PORTS * 2)
+      {
+        /* control interface then data interface of the current function */
+        CHECK_EQ(if_no, func * 2 + (num_if - 1) % 2);
+        CHECK_EQ(d[4], (if_no & 1) ? 2 : 1);
+        CHECK_EQ(d[5], (if_no & 1) ? 0x0a : 0x02);
+      }
+      else
+      {
+        CHECK_EQ(USBD_VENDOR_BULK, 1);
+        CHECK_EQ(if_no, USBD_CDC_NUM_PORTS * 2);
+        CHECK_EQ(d[4], 2);
+        CHECK_EQ(d[5], 0xff);
+      }
+      break;
+
+    case DESC_CS_IF:
+      if(d[2] == CS_UNION)
+      {
+        CHECK_EQ(d[3], func * 2);
+        CHECK_EQ(d[4], func * 2 + 1);
+      }
+      else if(d[2] == CS_CALL_MGMT)
+      {
+        CHECK_EQ(d[4], func * 2 + 1);
+      }
+      break;
+
+    case USB_DESC_TYPE_ENDPOINT:
+      num_ep++;
+      if(if_no >= USBD_CDC_NUM_PORTS * 2)
+      {
+        /* vendor bulk pair on the first endpoint after the CDC ports */
+        CHECK_EQ(d[2] & 0x7f, 1 + USBD_CDC_NUM_PORTS * 2);
+        CHECK_EQ(d[3], 0x02);
+      }
+      else if((if_no & 1) == 0)
+      {
+        CHECK_EQ(d[2], 0x82 + func * 2);
+        CHECK_EQ(d[3], 0x03);
+        CHECK_EQ(d[4] | (d[5] << 8), 8);
+      }
+      else
+      {
+        /* OUT before IN */
+        CHECK_EQ(d[2], ((d[2] & 0x80) ? 0x81 : 0x01) + func * 2);
+        CHECK_EQ(d[2] & 0x80, (num_ep % 3 == 0) ? 0x80 : 0);
+        CHECK_EQ(d[3], 0x02);
+        CHECK_EQ(d[4] | (d[5] << 8), bulk_mps);
+      }
+      break;
+
+    default:
+      CHECK(0);
+      break;
+    }
+  }
+
+  CHECK_EQ(pos, length);
+  CHECK_EQ(func, USBD_CDC_NUM_PORTS - 1);
+  CHECK_EQ(num_if, desc[4]);
+  CHECK_EQ(num_ep, USBD_CDC_NUM_PORTS * 3 + USBD_VENDOR_BULK * 2);
+  for(i = 0; i < num_if; i++)
+  {
+    CHECK_EQ(interfaces[i], i);
+  }
+}
+
+int
+main(void)
+{
+  char      name[32];
+  uint16_t  length;
+  uint8_t*  desc;
+  uint16_t  expect = 9 + 66 * USBD_CDC_NUM_PORTS + 23 * USBD_VENDOR_BULK;
+
+  desc = USBD_CDC.GetFSConfigDescriptor(&length);
+  CHECK_EQ(length, expect);
+  check_config(desc, length, USB_DESC_TYPE_CONFIGURATION, 64);
+
+  desc = USBD_CDC.GetHSConfigDescriptor(&length);
+  CHECK_EQ(length, expect);
+  check_config(desc, length, USB_DESC_TYPE_CONFIGURATION, 512);
+
+  desc = USBD_CDC.GetOtherSpeedConfigDescriptor(&length);
+  CHECK_EQ(length, expect);
+  check_config(desc, length, USB_DESC_TYPE_OTHER_SPEED_CONFIGURATION, 16);
+
+  snprintf(name, sizeof(name), "cdc_desc %d%s", USBD_CDC_NUM_PORTS,
+      USBD_VENDOR_BULK ? " vendor" : "");
+  return test_result(name);
+}
@@ -0,0 +1,123 @@
+//
+// USBD_CDC_TransmitPacket/USBD_CDC_DataIn: a bulk IN transfer that ends
+// on a full packet is terminated with a ZLP, and only then handed back
+// to the interface. any other length is handed back right away
+//
+#include <string.h>
+#include "usbd_cdc.h"
+#include "usbd_ll_stub.h"
+#include "test.h"
+
+static USBD_HandleTypeDef   _dev;
+static uint8_t              _buf[512];
+static uint8_t              _rx[CDC_DATA_FS_OUT_PACKET_SIZE];
+static int                  _tx_cplt;
+
+static int8_t itf_init(void)    { return USBD_OK; }
+static int8_t itf_deinit(void)  { return USBD_OK; }
+static int8_t itf_sof(void)     { return USBD_OK; }
+
+static int8_t
+itf_control(uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance instance)
+{
+  return USBD_OK;
+}
+
+static int8_t
+itf_receive(uint8_t* pbuf, uint32_t* len, USBD_CDC_Instance instance)
+{
+  return USBD_OK;
+}
+
+static int8_t
+itf_tx_cplt(uint8_t* pbuf, uint32_t* len, USBD_CDC_Instance instance)
+{
+  _tx_cplt++;
+  return USBD_OK;
+}
+
+static USBD_CDC_ItfTypeDef  _itf =
+{
+  itf_init,
+  itf_deinit,
+  itf_control,
+  itf_receive,
+  itf_tx_cplt,
+  itf_sof,
+};
+
+static void
+setup(void)
+{
+  USBD_CDC_Instance instance;
+
+  memset(&_dev, 0, sizeof(_dev));
+  _dev.dev_speed = USBD_SPEED_FULL;
+
+  USBD_CDC_RegisterInterface(&_dev, &_itf);
+
+  /* interface sets its buffers before the class is initialized */
+  _dev.pClassData = USBD_static_malloc(sizeof(USBD_CDC_HandleTypeDef));
+  for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
+  {
+    USBD_CDC_SetRxBuffer(&_dev, _rx, sizeof(_rx), instance);
+  }
+  USBD_CDC.Init(&_dev, 0);
+}
+
+static void
+check_transfer(uint16_t len, int zlp)
+{
+  USBD_CDC_Instance instance = USBD_CDC_Instance_MAX - 1;
+
+  ll_log_clear();
+  _tx_cplt = 0;
+
+  USBD_CDC_SetTxBuffer(&_dev, _buf, len, instance);
+  CHECK_EQ(USBD_CDC_TransmitPacket(&_dev, instance), USBD_OK);
+  CHECK_EQ(ll_log_count, 1);
+  CHECK_EQ(ll_log[0].ep, CDC_IN_EP(instance));
+  CHECK_EQ(ll_log[0].len, len);
+
+  /* busy until the whole transfer is done */
+  CHECK_EQ(USBD_CDC_TransmitPacket(&_dev, instance), USBD_BUSY);
+
+  USBD_CDC.DataIn(&_dev, CDC_IN_EP(instance) & 0x7f);
+
+  if(zlp)
+  {
+    CHECK_EQ(ll_log_count, 2);
+    CHECK_EQ(ll_log[1].ep, CDC_IN_EP(instance));
+    CHECK_EQ(ll_log[1].len, 0);
+    CHECK_EQ(_tx_cplt, 0);
+
+    USBD_CDC.DataIn(&_dev, CDC_IN_EP(instance) & 0x7f);
+  }
+
+  /* no ZLP after the ZLP, nor after a short packet */
+  CHECK_EQ(ll_log_count, zlp ? 2 : 1);
+  CHECK_EQ(_tx_cplt, 1);
+  CHECK_EQ(USBD_CDC_TransmitPacket(&_dev, instance), USBD_OK);
+  USBD_CDC.DataIn(&_dev, CDC_IN_EP(instance) & 0x7f);
+  if(zlp)
+  {
+    USBD_CDC.DataIn(&_dev, CDC_IN_EP(instance) & 0x7f);
+  }
+}
+
+int
+main(void)
+{
+  setup();
+
+  check_transfer(1, 0);
+  check_transfer(63, 0);
+  check_transfer(64, 1);
+  check_transfer(65, 0);
+  check_transfer(127, 0);
+  check_transfer(128, 1);
+  check_transfer(129, 0);
+  check_transfer(512, 1);
+
+  return test_result("cdc_zlp");
+}
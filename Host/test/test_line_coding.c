@@ -0,0 +1,142 @@
+//
+// SET_LINE_CODING with a new frame format on port 0, replayed through
+// usbd_cdc_if.c. the UART is re-initialized once the RX ring has gone
+// to host, or after CDC_UART_DRAIN_MS, but never under an IN
+// transfer that is still reading from the ring
+//
+#include <string.h>
+#include "usbd_cdc_if.h"
+#include "usbd_ll_stub.h"
+#include "hal_stub.h"
+#include "host_cmsis.h"
+#include "test.h"
+
+#include "../../Src/usbd_cdc_if.c"
+
+static void
+connect(void)
+{
+  host_reset();
+  ll_log_clear();
+  LineCoding[0].paritytype = 0;
+
+  hUsbDeviceFS.dev_speed = USBD_SPEED_FULL;
+  USBD_CDC_RegisterInterface(&hUsbDeviceFS, &USBD_Interface_fops_FS);
+  USBD_CDC.Init(&hUsbDeviceFS, 0);
+  usbd_cdc_if_poll();
+  CHECK_EQ(host_uart[0].inits, 1);
+}
+
+/* bytes off the line, then the line goes idle */
+static void
+uart_rx(const char* data, int len)
+{
+  host_uart_rx(&huart1, (const uint8_t*)data, len);
+  host_usart[0].SR |= USART_SR_IDLE;
+  usbd_cdc_if_uart_irq(&huart1);
+  host_usart[0].SR &= ~USART_SR_IDLE;
+  usbd_cdc_if_usb_irq();
+}
+
+/* 115200 even parity. a frame format change */
+static void
+set_even_parity(void)
+{
+  uint8_t coding[7] = { 0x00, 0xc2, 0x01, 0x00, 0, 2, 8 };
+
+  CDC_Control_FS(CDC_SET_LINE_CODING, coding, sizeof(coding), USBD_CDC_Instance_0);
+  CHECK_EQ(_uart_setup[0].pending, CDC_UART_SETUP_FULL);
+}
+
+/* the IN transfers logged since the last call */
+static int
+in_transfers(void)
+{
+  int n = 0;
+  int i;
+
+  for(i = 0; i < ll_log_count && i < LL_LOG_SIZE; i++)
+  {
+    if(ll_log[i].op == LL_OP_TRANSMIT && ll_log[i].ep == CDC_IN_EP(0))
+    {
+      n++;
+    }
+  }
+  ll_log_clear();
+  return n;
+}
+
+static void
+check_drained(void)
+{
+  connect();
+
+  uart_rx("hello", 5);
+  CHECK_EQ(in_transfers(), 1);
+  USBD_CDC.DataIn(&hUsbDeviceFS, CDC_IN_EP(0) & 0x7f);
+
+  set_even_parity();
+  usbd_cdc_if_poll();
+  CHECK_EQ(host_uart[0].inits, 2);
+  CHECK_EQ(huart1.Init.Parity, UART_PARITY_EVEN);
+  CHECK_EQ(_uart_setup[0].pending, CDC_UART_SETUP_NONE);
+}
+
+static void
+check_expired_in_flight(void)
+{
+  uint8_t*  buf;
+
+  connect();
+
+  /* host doesn't take this one before the drain runs out */
+  uart_rx("hello", 5);
+  CHECK_EQ(in_transfers(), 1);
+  buf = hUsbDeviceFS.pClassData != NULL ?
+      ((USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData)->TxBuffer[0] : NULL;
+  CHECK(buf == &UserTxBufferFS[0][0]);
+
+  set_even_parity();
+  usbd_cdc_if_poll();
+  CHECK_EQ(host_uart[0].inits, 1);
+
+  host_tick += CDC_UART_DRAIN_MS;
+  usbd_cdc_if_poll();
+  CHECK_EQ(host_uart[0].inits, 1);
+  CHECK_EQ(_uart_setup[0].pending, CDC_UART_SETUP_SWITCH);
+  CHECK_EQ(_tx_in_flight[0], 5);
+
+  /* the ring is given up. nothing new goes to host from it */
+  uart_rx("world", 5);
+  host_tick++;
+  CDC_SOF_FS();
+  usbd_cdc_if_poll();
+  CHECK_EQ(in_transfers(), 0);
+  CHECK_EQ(host_uart[0].inits, 1);
+  CHECK(memcmp(buf, "hello", 5) == 0);
+
+  /* host has read it. the switch goes ahead, from an empty ring */
+  USBD_CDC.DataIn(&hUsbDeviceFS, CDC_IN_EP(0) & 0x7f);
+  CHECK(host_work_posted & (1 << WORK_CDC_POLL));
+  CHECK_EQ(in_transfers(), 0);
+  usbd_cdc_if_poll();
+  CHECK_EQ(host_uart[0].inits, 2);
+  CHECK_EQ(huart1.Init.Parity, UART_PARITY_EVEN);
+  CHECK_EQ(_uart_setup[0].pending, CDC_UART_SETUP_NONE);
+  CHECK_EQ(UserTxBufPtrOut[0], 0);
+  CHECK_EQ(UserTxBufPtrIn[0], 0);
+  CHECK_EQ(_tx_in_flight[0], 0);
+
+  /* and the port carries on at the new format */
+  uart_rx("again", 5);
+  CHECK_EQ(in_transfers(), 1);
+}
+
+int
+main(void)
+{
+  check_drained();
+  check_expired_in_flight();
+
+  return test_result("line_coding");
+}
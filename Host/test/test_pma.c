@@ -0,0 +1,201 @@
+//
+// USB_WritePMA/USB_ReadPMA against a simulated F103 packet memory, where
+// each 16-bit PMA word sits in the low half of a 32-bit slot at
+// USBx + 0x400. every buffer alignment and length from 0 to 70 bytes
+// has to round-trip without touching a byte past the end
+//
+// the copies are also timed against the byte loop they replaced. these
+// are host figures, they only show the relative cost of the loops and
+// are not Cortex-M3 cycles
+//
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "stm32f1xx_hal.h"
+#include "test.h"
+
+#define PMA_OFFSET      0x400
+#define PMA_BYTES       512
+#define PMA_ADDR        0x40
+#define MAX_LEN         70
+#define GUARD           0xa5
+#define BENCH_PACKETS   2000000
+
+static uint8_t*     _usb;
+static uint16_t*    _pma;
+
+//
+// the routines as shipped by ST, kept as the reference for the timing
+//
+static void
+ref_write_pma(USB_TypeDef* USBx, uint8_t* pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
+{
+  uint32_t n = (wNBytes + 1) >> 1;
+  uint32_t i, temp1, temp2;
+  __IO uint16_t *pdwVal;
+
+  pdwVal = (__IO uint16_t *)(wPMABufAddr * 2 + (uint32_t)USBx + 0x400);
+  for (i = n; i != 0; i--)
+  {
+    temp1 = (uint16_t) * pbUsrBuf;
+    pbUsrBuf++;
+    temp2 = temp1 | (uint16_t) * pbUsrBuf << 8;
+    *pdwVal++ = temp2;
+    pdwVal++;
+    pbUsrBuf++;
+  }
+}
+
+static void
+ref_read_pma(USB_TypeDef* USBx, uint8_t* pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
+{
+  uint32_t n = (wNBytes + 1) >> 1;
+  uint32_t i;
+  __IO uint32_t *pdwVal;
+
+  pdwVal = (__IO uint32_t *)(wPMABufAddr * 2 + (uint32_t)USBx + 0x400);
+  for (i = n; i != 0; i--)
+  {
+    *(__IO uint16_t*)pbUsrBuf++ = *pdwVal++;
+    pbUsrBuf++;
+  }
+}
+
+static void
+setup(void)
+{
+  //
+  // the routines turn the register base into a 32 bit address
+  //
+  _usb = mmap(NULL, 4096, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if(_usb == MAP_FAILED)
+  {
+    perror("mmap");
+    exit(1);
+  }
+  _pma = (uint16_t*)(_usb + PMA_OFFSET);
+}
+
+static uint16_t*
+pma_word(uint16_t addr, int n)
+{
+  return &_pma[(addr / 2 + n) * 2];
+}
+
+static void
+check_write(int align, int len)
+{
+  uint8_t   src[MAX_LEN + 8] __attribute__((aligned(4)));
+  uint8_t*  p = src + align;
+  int       i;
+
+  for(i = 0; i < len; i++)
+  {
+    p[i] = (uint8_t)(i * 7 + align + 1);
+  }
+  memset(_pma, GUARD, PMA_BYTES * 2);
+
+  USB_WritePMA((USB_TypeDef*)_usb, p, PMA_ADDR, len);
+
+  for(i = 0; i < len; i++)
+  {
+    uint16_t w = *pma_word(PMA_ADDR, i / 2);
+    CHECK_EQ((i & 1) ? (w >> 8) : (w & 0xff), p[i]);
+  }
+  /* the upper half of every slot is not PMA and stays untouched */
+  for(i = 0; i < (len + 1) / 2; i++)
+  {
+    CHECK_EQ(pma_word(PMA_ADDR, i)[1], GUARD * 0x101);
+  }
+  CHECK_EQ(*pma_word(PMA_ADDR, (len + 1) / 2), GUARD * 0x101);
+  CHECK_EQ(*pma_word(PMA_ADDR, -1), GUARD * 0x101);
+}
+
+static void
+check_read(int align, int len)
+{
+  uint8_t   dst[MAX_LEN + 8] __attribute__((aligned(4)));
+  uint8_t*  p = dst + align;
+  int       i;
+
+  memset(_pma, 0, PMA_BYTES * 2);
+  for(i = 0; i < (len + 1) / 2 + 1; i++)
+  {
+    pma_word(PMA_ADDR, i)[0] = (uint16_t)(i * 0x0203 + 0x0101);
+    pma_word(PMA_ADDR, i)[1] = 0xdead;
+  }
+  memset(dst, GUARD, sizeof(dst));
+
+  USB_ReadPMA((USB_TypeDef*)_usb, p, PMA_ADDR, len);
+
+  for(i = 0; i < len; i++)
+  {
+    uint16_t w = *pma_word(PMA_ADDR, i / 2);
+    CHECK_EQ(p[i], (i & 1) ? (w >> 8) : (w & 0xff));
+  }
+  for(i = 0; i < align; i++)
+  {
+    CHECK_EQ(dst[i], GUARD);
+  }
+  for(i = align + len; i < sizeof(dst); i++)
+  {
+    CHECK_EQ(dst[i], GUARD);
+  }
+}
+
+static double
+bench(void (*copy)(USB_TypeDef*, uint8_t*, uint16_t, uint16_t), uint8_t* buf)
+{
+  struct timespec t0, t1;
+  int             i;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(i = 0; i < BENCH_PACKETS; i++)
+  {
+    copy((USB_TypeDef*)_usb, buf, PMA_ADDR, 64);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / BENCH_PACKETS;
+}
+
+static void
+run_bench(void)
+{
+  uint8_t   buf[64 + 4] __attribute__((aligned(4)));
+
+  memset(buf, 0x55, sizeof(buf));
+  printf("pma write 64B  %6.1f ns, byte loop %6.1f ns\n",
+      bench(USB_WritePMA, buf), bench(ref_write_pma, buf));
+  printf("pma read 64B   %6.1f ns, byte loop %6.1f ns\n",
+      bench(USB_ReadPMA, buf), bench(ref_read_pma, buf));
+  printf("pma read 64B+1 %6.1f ns, byte loop %6.1f ns (odd buffer)\n",
+      bench(USB_ReadPMA, buf + 1), bench(ref_read_pma, buf + 1));
+}
+
+int
+main(int argc, char** argv)
+{
+  int align;
+  int len;
+
+  setup();
+
+  for(align = 0; align < 4; align++)
+  {
+    for(len = 0; len <= MAX_LEN; len++)
+    {
+      check_write(align, len);
+      check_read(align, len);
+    }
+  }
+
+  if(argc > 1 && strcmp(argv[1], "-b") == 0)
+  {
+    run_bench();
+  }
+
+  return test_result("pma");
+}
@@ -0,0 +1,225 @@
+//
+// work.c: work_post/work_post_in/work_run semantics, with PendSV and
+// SysTick driven by hand
+//
+#include <string.h>
+#include "stm32f1xx_hal.h"
+#include "work.h"
+#include "host_cmsis.h"
+#include "test.h"
+
+#include "../../Src/work.c"
+
+uint32_t  host_primask;
+uint64_t  host_irq_pending;
+uint64_t  host_irq_held;
+SCB_Type  host_scb;
+
+static int      _calls[WORK_MAX];
+static int      _order[8];
+static int      _order_count;
+static int      _repost;
+
+void
+HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+}
+
+static void
+note(int id)
+{
+  _calls[id]++;
+  if(_order_count < 8)
+  {
+    _order[_order_count++] = id;
+  }
+}
+
+static void
+poll_fn(void)
+{
+  note(WORK_CDC_POLL);
+  if(_repost > 0)
+  {
+    _repost--;
+    work_post(WORK_CDC_POLL);
+  }
+}
+
+static void
+led_fn(void)
+{
+  note(WORK_LED);
+  /* posts the lower id, which runs on the next pass */
+  if(_calls[WORK_LED] == 1)
+  {
+    work_post(WORK_CDC_POLL);
+  }
+}
+
+static void
+setup(void)
+{
+  memset(_calls, 0, sizeof(_calls));
+  memset(&_work_stats, 0, sizeof(_work_stats));
+  memset((void*)_work_due, 0, sizeof(_work_due));
+  _work_pending = 0;
+  _order_count = 0;
+  _repost = 0;
+  host_scb.ICSR = 0;
+  host_primask = 0;
+
+  work_init();
+  work_set(WORK_CDC_POLL, poll_fn);
+  work_set(WORK_LED, NULL);
+}
+
+static void
+tick(int ms)
+{
+  while(ms-- > 0)
+  {
+    HAL_SYSTICK_Callback();
+  }
+}
+
+static void
+check_post(void)
+{
+  setup();
+
+  /* pends PendSV and leaves the caller's mask as it was */
+  host_primask = 1;
+  work_post(WORK_CDC_POLL);
+  CHECK_EQ(host_primask, 1);
+  CHECK(host_scb.ICSR & SCB_ICSR_PENDSVSET_Msk);
+  host_primask = 0;
+
+  /* posts before the run come together */
+  work_post(WORK_CDC_POLL);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 1);
+  CHECK_EQ(_work_stats.runs[WORK_CDC_POLL], 1);
+  CHECK_EQ(host_primask, 0);
+
+  /* nothing left */
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 1);
+
+  /* work with no handler is dropped */
+  work_post(WORK_LED);
+  work_run();
+  CHECK_EQ(_calls[WORK_LED], 0);
+  CHECK_EQ(_work_pending, 0);
+}
+
+static void
+check_run(void)
+{
+  setup();
+
+  /* a handler posting itself runs again in the same work_run */
+  _repost = 2;
+  work_post(WORK_CDC_POLL);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 3);
+  CHECK_EQ(_repost, 0);
+
+  /* id order within a pass. what a handler posts comes on the next */
+  setup();
+  work_set(WORK_LED, led_fn);
+  work_post(WORK_LED);
+  work_post(WORK_CDC_POLL);
+  work_run();
+  CHECK_EQ(_order_count, 3);
+  CHECK_EQ(_order[0], WORK_CDC_POLL);
+  CHECK_EQ(_order[1], WORK_LED);
+  CHECK_EQ(_order[2], WORK_CDC_POLL);
+}
+
+static void
+check_post_in(void)
+{
+  setup();
+
+  /* 0 ms is a plain post */
+  work_post_in(WORK_CDC_POLL, 0);
+  CHECK(host_scb.ICSR & SCB_ICSR_PENDSVSET_Msk);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 1);
+
+  /* posted on the tick the time runs out, once */
+  setup();
+  work_post_in(WORK_CDC_POLL, 3);
+  tick(2);
+  CHECK_EQ(_work_pending, 0);
+  CHECK_EQ(host_scb.ICSR, 0);
+  tick(1);
+  CHECK(host_scb.ICSR & SCB_ICSR_PENDSVSET_Msk);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 1);
+  tick(10);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 1);
+  CHECK_EQ(_work_stats.ticks, 13);
+
+  /* a later timed post replaces the earlier one, shorter or longer */
+  setup();
+  work_post_in(WORK_CDC_POLL, 5);
+  work_post_in(WORK_CDC_POLL, 2);
+  tick(2);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 1);
+  tick(5);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 1);
+
+  setup();
+  work_post_in(WORK_CDC_POLL, 2);
+  tick(1);
+  work_post_in(WORK_CDC_POLL, 4);
+  tick(3);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 0);
+  tick(1);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 1);
+
+  /* a plain post doesn't cancel a timed one */
+  setup();
+  work_post_in(WORK_CDC_POLL, 2);
+  work_post(WORK_CDC_POLL);
+  work_run();
+  tick(2);
+  work_run();
+  CHECK_EQ(_calls[WORK_CDC_POLL], 2);
+}
+
+static void
+check_idle(void)
+{
+  setup();
+
+  /* woken by SysTick: that ms counts as idle */
+  host_scb.ICSR = SCB_ICSR_PENDSTSET_Msk;
+  work_idle();
+  CHECK_EQ(_work_stats.idle_ticks, 1);
+  CHECK_EQ(host_primask, 0);
+
+  /* woken by anything else */
+  host_scb.ICSR = 0;
+  work_idle();
+  CHECK_EQ(_work_stats.idle_ticks, 1);
+  CHECK(work_get_stats() == &_work_stats);
+}
+
+int
+main(void)
+{
+  check_post();
+  check_run();
+  check_post_in();
+  check_idle();
+
+  return test_result("work");
+}
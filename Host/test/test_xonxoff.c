@@ -0,0 +1,271 @@
+//
+// XON/XOFF on port 0, replayed through usbd_cdc_if.c. byte streams with
+// XON/XOFF in them go into the RX DMA ring, and the test checks what
+// reaches host over the IN endpoint and what the UART TX gate does.
+// built with USBD_CDC_XONXOFF 0x01
+//
+#include "usbd_cdc_if.h"
+#include "usbd_ll_stub.h"
+#include "hal_stub.h"
+#include "host_cmsis.h"
+#include "test.h"
+
+#include "../../Src/usbd_cdc_if.c"
+
+#if (USBD_CDC_XONXOFF != 0x01)
+#error "build with -DUSBD_CDC_XONXOFF=0x01"
+#endif
+
+static uint8_t  _in[4096];
+
+static void
+connect(void)
+{
+  host_reset();
+  ll_log_clear();
+
+  hUsbDeviceFS.dev_speed = USBD_SPEED_FULL;
+  USBD_CDC_RegisterInterface(&hUsbDeviceFS, &USBD_Interface_fops_FS);
+  USBD_CDC.Init(&hUsbDeviceFS, 0);
+
+  /* the UART is left to deferred work */
+  CHECK_EQ(host_uart[0].inits, 0);
+  CHECK(host_work_posted & (1 << WORK_CDC_POLL));
+  usbd_cdc_if_poll();
+  CHECK_EQ(host_uart[0].inits, 1);
+
+  /* set up unmasked, with only USB and the port's own interrupts held */
+  CHECK_EQ(host_uart[0].init_masked, 0);
+  CHECK_EQ(host_uart[0].init_held, 1);
+  CHECK_EQ(host_uart[0].rx_irq_on, 0);
+  CHECK_EQ(host_uart[0].held, 0);
+  CHECK_EQ(host_uart[0].irq_on, 1);
+  CHECK_EQ(host_irq_held, 0);
+}
+
+/* TXE interrupt of USART1, as long as it is enabled */
+static void
+uart_txe(void)
+{
+  host_usart[0].SR |= USART_SR_TXE;
+  usbd_cdc_if_uart_irq(&huart1);
+  usbd_cdc_if_usb_irq();
+}
+
+/* bytes off the line, then the line goes idle */
+static void
+uart_rx(const char* data, int len)
+{
+  host_uart_rx(&huart1, (const uint8_t*)data, len);
+  host_usart[0].SR |= USART_SR_IDLE;
+  usbd_cdc_if_uart_irq(&huart1);
+  host_usart[0].SR &= ~USART_SR_IDLE;
+  usbd_cdc_if_usb_irq();
+}
+
+//
+// host reads what the IN endpoint has to give. each transfer completes
+// right away, which may start the next one
+//
+static int
+host_read(void)
+{
+  int n = 0;
+  int i;
+
+  for(i = 0; i < ll_log_count && i < LL_LOG_SIZE; i++)
+  {
+    if(ll_log[i].op != LL_OP_TRANSMIT || ll_log[i].ep != CDC_IN_EP(0))
+    {
+      continue;
+    }
+    CHECK(n + ll_log[i].len <= sizeof(_in));
+    if(n + ll_log[i].len > sizeof(_in))
+    {
+      break;
+    }
+    memcpy(&_in[n], ll_log[i].buf, ll_log[i].len);
+    n += ll_log[i].len;
+    USBD_CDC.DataIn(&hUsbDeviceFS, CDC_IN_EP(0) & 0x7f);
+  }
+  ll_log_clear();
+  return n;
+}
+
+/* host sends data for the UART over the OUT endpoint */
+static void
+host_write(const char* data, uint32_t len)
+{
+  USBD_CDC_HandleTypeDef* hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+
+  memcpy(hcdc->RxBuffer[0], data, len);
+  CDC_Receive_FS(hcdc->RxBuffer[0], &len, USBD_CDC_Instance_0);
+  usbd_cdc_if_usb_irq();
+}
+
+static uint8_t
+tx_dma_on(void)
+{
+  return (host_usart[0].CR3 & USART_CR3_DMAT) != 0;
+}
+
+static uint8_t
+txe_on(void)
+{
+  return (host_usart[0].CR1 & USART_CR1_TXEIE) != 0;
+}
+
+static void
+check_connect(void)
+{
+  connect();
+
+  /* the empty ring lets the far end go. XON goes out on TXE */
+  CHECK(txe_on());
+  uart_txe();
+  CHECK_EQ(host_usart[0].DR, XON);
+  CHECK(!txe_on());
+  CHECK_EQ(host_read(), 0);
+
+  /* so is closing it */
+  USBD_CDC.DeInit(&hUsbDeviceFS, 0);
+  CHECK_EQ(host_uart[0].deinits, 1);
+  usbd_cdc_if_poll();
+  CHECK_EQ(host_uart[0].deinits, 2);
+}
+
+static void
+check_stream(void)
+{
+  int n;
+
+  connect();
+  uart_txe();
+
+  /* XOFF is taken out of the stream and stops UART TX */
+  uart_rx("ab\x13" "cd", 5);
+  n = host_read();
+  CHECK_EQ(n, 4);
+  CHECK(memcmp(_in, "abcd", 4) == 0);
+  CHECK_EQ(_xonxoff[0].xoff, 1);
+
+  host_write("hello", 5);
+  CHECK_EQ(host_uart[0].tx_starts, 0);
+  CHECK_EQ(_uart_txq[0].count, 5);
+
+  /* XON lets the queue go */
+  uart_rx("e\x11" "f", 3);
+  n = host_read();
+  CHECK_EQ(n, 2);
+  CHECK(memcmp(_in, "ef", 2) == 0);
+  CHECK_EQ(_xonxoff[0].xoff, 0);
+  CHECK_EQ(host_uart[0].tx_starts, 1);
+  CHECK_EQ(host_uart[0].tx_size, 5);
+  CHECK(host_uart[0].tx_buf != NULL && memcmp(host_uart[0].tx_buf, "hello", 5) == 0);
+  CHECK(tx_dma_on());
+
+  /* XOFF in the middle of a chunk pauses the DMA request */
+  uart_rx("\x13", 1);
+  CHECK_EQ(host_read(), 0);
+  CHECK(!tx_dma_on());
+  uart_rx("\x11", 1);
+  CHECK_EQ(host_read(), 0);
+  CHECK(tx_dma_on());
+  CHECK_EQ(host_uart[0].tx_starts, 1);
+}
+
+static void
+check_skip_full(void)
+{
+  const char  burst[] = "\x13\x11\x13\x11\x13\x11\x13\x11\x13\x11";
+  int         n;
+
+  connect();
+  uart_txe();
+
+  /* ten in one go. the first XON_MAX_SKIP are stepped over, the rest
+     reach host as data but are still honored */
+  uart_rx("x", 1);
+  uart_rx(burst, 10);
+  n = host_read();
+  CHECK_EQ(n, 1 + 10 - XON_MAX_SKIP);
+  CHECK_EQ(_in[0], 'x');
+  CHECK_EQ(_in[1], XOFF);
+  CHECK_EQ(_in[2], XON);
+  CHECK_EQ(_xonxoff[0].xoff, 0);
+  CHECK_EQ(_xonxoff[0].skip_count, 0);
+
+  /* queue is free again */
+  uart_rx("y\x13" "z", 3);
+  n = host_read();
+  CHECK_EQ(n, 2);
+  CHECK(memcmp(_in, "yz", 2) == 0);
+  CHECK_EQ(_xonxoff[0].xoff, 1);
+
+  /* a full queue in a ring that wraps */
+  uart_rx("\x11", 1);
+  host_read();
+  while(_uart_txq[0].count == 0 && UserTxBufPtrIn[0] < APP_TX_DATA_SIZE - 4)
+  {
+    uart_rx("........", 8);
+    host_read();
+  }
+  uart_rx(burst, 10);
+  n = host_read();
+  CHECK_EQ(n, 10 - XON_MAX_SKIP);
+  CHECK_EQ(_in[0], XOFF);
+  CHECK_EQ(_in[1], XON);
+  CHECK(UserTxBufPtrIn[0] < APP_TX_DATA_SIZE / 2);
+}
+
+static void
+check_watermark(void)
+{
+  char  data[64];
+  int   i;
+  int   n;
+
+  connect();
+  uart_txe();
+  for(i = 0; i < sizeof(data); i++)
+  {
+    data[i] = 'A' + i % 26;
+  }
+
+  /* host doesn't read. XOFF once the ring reaches RX_RTS_HIGH */
+  for(i = 0; i < RX_RTS_HIGH / sizeof(data); i++)
+  {
+    CHECK(!txe_on());
+    uart_rx(data, sizeof(data));
+  }
+  CHECK(txe_on());
+  CHECK_EQ(_xonxoff[0].xchar, XOFF);
+
+  /* our XOFF goes ahead of the TX queue */
+  host_write("q", 1);
+  CHECK_EQ(host_uart[0].tx_starts, 0);
+  uart_txe();
+  CHECK_EQ(host_usart[0].DR, XOFF);
+  CHECK_EQ(host_uart[0].tx_starts, 1);
+
+  /* and XON once host has taken the ring below RX_RTS_LOW */
+  n = host_read();
+  CHECK_EQ(n, RX_RTS_HIGH / sizeof(data) * sizeof(data));
+  CHECK(txe_on());
+  CHECK_EQ(_xonxoff[0].xchar, XON);
+  CHECK(!tx_dma_on());
+  uart_txe();
+  CHECK_EQ(host_usart[0].DR, XON);
+  CHECK(tx_dma_on());
+}
+
+int
+main(void)
+{
+  check_connect();
+  check_stream();
+  check_skip_full();
+  check_watermark();
+
+  return test_result("xonxoff");
+}
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include "usbd_ll_stub.h"
+
+ll_op_t   ll_log[LL_LOG_SIZE];
+int       ll_log_count;
+uint8_t   ll_sof_enabled;
+
+static uint8_t  _class_data[4096] __attribute__((aligned(8)));
+
+void
+ll_log_clear(void)
+{
+  ll_log_count = 0;
+}
+
+static void
+ll_log_op(uint8_t op, uint8_t ep, uint8_t* buf, uint16_t len)
+{
+  if(ll_log_count < LL_LOG_SIZE)
+  {
+    ll_log[ll_log_count].op  = op;
+    ll_log[ll_log_count].ep  = ep;
+    ll_log[ll_log_count].buf = buf;
+    ll_log[ll_log_count].len = len;
+  }
+  ll_log_count++;
+}
+
+USBD_StatusTypeDef
+USBD_LL_OpenEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t ep_type, uint16_t ep_mps)
+{
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef
+USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef
+USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size)
+{
+  ll_log_op(LL_OP_TRANSMIT, ep_addr, pbuf, size);
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef
+USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size)
+{
+  ll_log_op(LL_OP_RECEIVE, ep_addr, pbuf, size);
+  return USBD_OK;
+}
+
+uint32_t
+USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  return 0;
+}
+
+USBD_StatusTypeDef
+USBD_LL_NakOutEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  ll_log_op(LL_OP_NAK_OUT, ep_addr, NULL, 0);
+  return USBD_OK;
+}
+
+void
+USBD_LL_SOFInterrupt(USBD_HandleTypeDef *pdev, uint8_t enable)
+{
+  ll_sof_enabled = enable;
+}
+
+USBD_StatusTypeDef
+USBD_CtlSendData(USBD_HandleTypeDef *pdev, uint8_t *buf, uint16_t len)
+{
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef
+USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len)
+{
+  return USBD_OK;
+}
+
+void
+USBD_CtlError(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+}
+
+void*
+USBD_static_malloc(uint32_t size)
+{
+  return size <= sizeof(_class_data) ? _class_data : NULL;
+}
+
+void
+USBD_static_free(void *p)
+{
+}
@@ -0,0 +1,30 @@
+#ifndef __USBD_LL_STUB_H
+#define __USBD_LL_STUB_H
+
+//
+// USB device low level driver for the host tests. endpoint operations
+// are logged instead of going to the PCD
+//
+#include "usbd_core.h"
+
+#define LL_LOG_SIZE     64
+
+#define LL_OP_TRANSMIT  1
+#define LL_OP_RECEIVE   2
+#define LL_OP_NAK_OUT   3
+
+typedef struct
+{
+  uint8_t   op;
+  uint8_t   ep;
+  uint8_t*  buf;
+  uint16_t  len;
+} ll_op_t;
+
+extern ll_op_t  ll_log[LL_LOG_SIZE];
+extern int      ll_log_count;
+extern uint8_t  ll_sof_enabled;
+
+extern void ll_log_clear(void);
+
+#endif /* __USBD_LL_STUB_H */
@@ -0,0 +1,59 @@
+#ifndef __CDC_MUX_PROTO_H
+#define __CDC_MUX_PROTO_H
+
+#include <stdint.h>
+
+/*
+ * framing of the multiplexed mode (USBD_CDC_MUX). shared by the firmware
+ * and the host library in Host/cdc_mux, so nothing but plain C in here.
+ *
+ * the bulk pipe is a byte stream of frames. frames don't line up with USB
+ * packets, so one 64 byte packet carries data of several channels and a
+ * frame may continue in the next transfer.
+ *
+ *   byte 0     : type << 4 | channel
+ *   byte 1     : payload length, 0 .. 255
+ *   byte 2 ..  : payload
+ *
+ * DATA         : serial data of the channel.
+ * CREDIT       : uint16 little endian. the sender can take that many more
+ *                DATA bytes of the channel. nothing is sent beyond credit
+ *                in either direction, so neither side ever drops or NAKs.
+ *                device grants room in the UART TX queue, host grants
+ *                what it is able to buffer.
+ * LINE_CODING  : host to device. 7 bytes in CDC SET_LINE_CODING layout,
+ *                reconfigures the UART of the channel. data queued for
+ *                UART TX is kept and goes out with the new settings.
+ * SERIAL_STATE : device to host. uint16 little endian, the UART state
+ *                bitmap of a CDC SERIAL_STATE notification. sent when
+ *                the channel's UART has seen overrun, parity or framing
+ *                errors or a break.
+ * SYNC         : channel 0xf, CDC_MUX_SYNC_MAGIC as payload. starts a
+ *                session. device drops what it has buffered for the host,
+ *                forgets all host credit and echoes SYNC, followed by its
+ *                initial CREDIT grants. host discards everything received
+ *                before the echo.
+ */
+#define CDC_MUX_NUM_CHANNELS        3         /* USART1, USART2, USART3 */
+
+#define CDC_MUX_HDR_SIZE            2
+#define CDC_MUX_MAX_PAYLOAD         255
+
+#define CDC_MUX_TYPE_DATA           0x0
+#define CDC_MUX_TYPE_CREDIT         0x1
+#define CDC_MUX_TYPE_LINE_CODING    0x2
+#define CDC_MUX_TYPE_SERIAL_STATE   0x3
+#define CDC_MUX_TYPE_SYNC           0xf
+
+#define CDC_MUX_HDR(type, chan)     ((uint8_t)(((type) << 4) | ((chan) & 0x0f)))
+#define CDC_MUX_HDR_TYPE(hdr)       ((hdr) >> 4)
+#define CDC_MUX_HDR_CHAN(hdr)       ((hdr) & 0x0f)
+
+#define CDC_MUX_CREDIT_SIZE         2
+#define CDC_MUX_LINE_CODING_SIZE    7
+#define CDC_MUX_SERIAL_STATE_SIZE   2
+#define CDC_MUX_SYNC_CHAN           0xf
+#define CDC_MUX_SYNC_MAGIC          "MUX1"
+#define CDC_MUX_SYNC_SIZE           4
+
+#endif /* __CDC_MUX_PROTO_H */
@@ -0,0 +1,94 @@
+#ifndef __CDC_UART_H
+#define __CDC_UART_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stdint.h>
+#include "stm32f1xx_hal.h"
+#include "usbd_cdc.h"
+
+/*
+ * the UART side of a bridged port, shared by the per port front end,
+ * usbd_cdc_if.c, and the multiplexed one, usbd_cdc_mux.c.
+ *
+ * a line coding request is only recorded, in the USB interrupt.
+ * usbd_cdc_if_poll() applies it as deferred work (work.h), stepping
+ * cdc_uart_step() with interrupts masked and doing the HAL work it
+ * returns after that.
+ *
+ * a new bitrate alone is written to BRR in place once UART TX DMA is
+ * between chunks. RX DMA keeps running and both queues are kept.
+ * a new frame format needs HAL_UART_DeInit/Init, which stops both DMA
+ * channels. that waits until TX DMA is between chunks and the RX ring has
+ * gone to host. TX queue is kept either way, the RX ring is only dropped
+ * if host hasn't read it within CDC_UART_DRAIN_MS. an IN transfer
+ * already reading from it is still waited for, with nothing new started.
+ *
+ * the drain forces a flush, and a host with reads posted takes up to 19
+ * packets a frame, so the 512 byte ring is gone in 1 or 2 ms. a host that
+ * isn't reading won't get to it by waiting longer. then at most the ring,
+ * 512 bytes, is lost. the other wait is the TX chunk at the old rate, up
+ * to the whole 1 KB queue, 89 ms at 115200. on expiry its unsent rest
+ * stays queued and goes out at the new format. 50 ms is 25 times the
+ * normal drain and still short of what a tcsetattr() caller notices.
+ * it is a chosen figure, not measured. Host/bench/cdc_bench -B measures
+ * the switch on a board.
+ *
+ * CDC_Init_FS and CDC_DeInit_FS run in the USB interrupt too. they only
+ * reset the port's software state and leave the UART to the same
+ * deferred work. until it has run the port's UART events wait and
+ * nothing is started on the UART.
+ */
+#define CDC_UART_SETUP_NONE     0
+#define CDC_UART_SETUP_BAUD     1     /* bitrate only. BRR rewritten in place */
+#define CDC_UART_SETUP_FULL     2     /* frame format. UART re-initialized    */
+#define CDC_UART_SETUP_OPEN     3     /* configured. UART set up from scratch */
+#define CDC_UART_SETUP_CLOSE    4     /* unconfigured. UART de-initialized    */
+#define CDC_UART_SETUP_SWITCH   5     /* FULL, drain over. waits for IN       */
+#define CDC_UART_DRAIN_MS       50
+
+typedef struct
+{
+  __IO uint8_t  pending;      /* CDC_UART_SETUP_*                         */
+  uint32_t      tick;         /* HAL_GetTick() when a change came in      */
+} cdc_uart_setup_t;
+
+/*
+ * UART errors never stop the port. they are counted here, for the
+ * debugger, and the ones ACM has a bit for go to host as SERIAL_STATE
+ */
+typedef struct
+{
+  uint32_t  overrun;
+  uint32_t  parity;
+  uint32_t  framing;
+  uint32_t  noise;
+  uint32_t  dma;
+  uint32_t  breaks;
+} cdc_uart_err_t;
+
+/* not while CDC_Init_FS/CDC_DeInit_FS or a re-init wait for the poll */
+static inline uint8_t
+cdc_uart_up(const cdc_uart_setup_t* s)
+{
+  return s->pending < CDC_UART_SETUP_OPEN;
+}
+
+extern void     cdc_uart_line_coding(const USBD_CDC_LineCodingTypeDef* lc, UART_InitTypeDef* init);
+extern void     cdc_uart_request(cdc_uart_setup_t* s, UART_HandleTypeDef* huart,
+                                 const USBD_CDC_LineCodingTypeDef* lc);
+extern void     cdc_uart_restart(cdc_uart_setup_t* s);
+extern uint8_t  cdc_uart_step(cdc_uart_setup_t* s, UART_HandleTypeDef* huart, uint32_t bitrate,
+                              uint8_t tx_idle, uint8_t drained, uint8_t in_idle);
+extern void     cdc_uart_config(UART_HandleTypeDef* huart, const USBD_CDC_LineCodingTypeDef* lc);
+extern void     cdc_uart_rx_start(UART_HandleTypeDef* huart, uint8_t* ring, uint16_t size);
+extern uint16_t cdc_uart_error(UART_HandleTypeDef* huart, uint32_t code, cdc_uart_err_t* err,
+                               uint8_t tx_busy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CDC_UART_H */
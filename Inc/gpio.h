@@ -64,11 +64,43 @@
 
 /* USER CODE BEGIN Private defines */
 
+/*
+ * DTR and RTS of each CDC port, driven from SET_CONTROL_LINE_STATE.
+ * active low, like the DTR#/RTS# outputs of a USB UART, so an asserted
+ * line reads 0. only the pins of the USBD_CDC_NUM_PORTS ports are set up.
+ */
+#define CDC0_DTR_GPIO_Port      GPIOB
+#define CDC0_DTR_Pin            GPIO_PIN_0
+#define CDC0_RTS_GPIO_Port      GPIOB
+#define CDC0_RTS_Pin            GPIO_PIN_1
+
+#define CDC1_DTR_GPIO_Port      GPIOB
+#define CDC1_DTR_Pin            GPIO_PIN_8
+#define CDC1_RTS_GPIO_Port      GPIOB
+#define CDC1_RTS_Pin            GPIO_PIN_9
+
+#define CDC2_DTR_GPIO_Port      GPIOB
+#define CDC2_DTR_Pin            GPIO_PIN_6
+#define CDC2_RTS_GPIO_Port      GPIOB
+#define CDC2_RTS_Pin            GPIO_PIN_7
+
+/* CTS inputs, active low. only watched on ports with USBD_CDC_FLOW_CTRL */
+#define CDC0_CTS_GPIO_Port      GPIOA
+#define CDC0_CTS_Pin            GPIO_PIN_4
+#define CDC1_CTS_GPIO_Port      GPIOA
+#define CDC1_CTS_Pin            GPIO_PIN_5
+#define CDC2_CTS_GPIO_Port      GPIOA
+#define CDC2_CTS_Pin            GPIO_PIN_6
+
 /* USER CODE END Private defines */
 
 void MX_GPIO_Init(void);
 
 /* USER CODE BEGIN Prototypes */
+void gpio_cdc_control_lines(uint8_t port, uint8_t dtr, uint8_t rts);
+void gpio_cdc_rts(uint8_t port, uint8_t rts);
+uint8_t gpio_cdc_cts(uint8_t port);
+uint8_t gpio_cdc_cts_port(uint16_t pin);
 
 /* USER CODE END Prototypes */
 
@@ -0,0 +1,86 @@
+#ifndef __IRQ_H
+#define __IRQ_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include "stm32f1xx.h"
+
+/*
+ * NVIC preemption priorities, NVIC_PRIORITYGROUP_4. a lower number
+ * preempts a higher one, 0 is left free.
+ *
+ * IRQ_PRIO_UART : USART, UART DMA channels and CTS EXTI lines. these only
+ *                 capture what happened and pend the USB interrupt, the
+ *                 bridge runs in usbd_cdc_if_usb_irq() from there
+ * IRQ_PRIO_USB  : USB and with it the CDC bridge
+ * IRQ_PRIO_TICK : SysTick and TIM1
+ * IRQ_PRIO_WORK : PendSV, deferred work (work.h)
+ */
+#define IRQ_PRIO_UART       1
+#define IRQ_PRIO_USB        2
+#define IRQ_PRIO_TICK       3
+#define IRQ_PRIO_WORK       15
+
+/*
+ * measurement build. with IRQ_PROFILE 1 every handler in stm32f1xx_it.c,
+ * and the sections deferred work runs with interrupts masked, count their
+ * runs and their longest run in CPU cycles from the DWT cycle counter
+ * into irq_prof[]. a handler's time includes whatever preempted it.
+ */
+#define IRQ_PROFILE         0
+
+typedef enum
+{
+  IRQ_PROF_USB,
+  IRQ_PROF_USART1,
+  IRQ_PROF_USART2,
+  IRQ_PROF_USART3,
+  IRQ_PROF_DMA1_CH2,          /* USART3 TX */
+  IRQ_PROF_DMA1_CH3,          /* USART3 RX */
+  IRQ_PROF_DMA1_CH4,          /* USART1 TX */
+  IRQ_PROF_DMA1_CH5,          /* USART1 RX */
+  IRQ_PROF_DMA1_CH6,          /* USART2 RX */
+  IRQ_PROF_DMA1_CH7,          /* USART2 TX */
+  IRQ_PROF_EXTI4,
+  IRQ_PROF_EXTI9_5,
+  IRQ_PROF_TIM1,
+  IRQ_PROF_SYSTICK,
+  IRQ_PROF_PENDSV,
+  IRQ_PROF_MASKED,            /* longest section with interrupts masked */
+  IRQ_PROF_MAX,
+} irq_prof_id_t;
+
+typedef struct
+{
+  uint32_t  count;
+  uint32_t  max;              /* cycles */
+} irq_prof_t;
+
+#if (IRQ_PROFILE == 1)
+extern irq_prof_t irq_prof[IRQ_PROF_MAX];
+extern void irq_prof_init(void);
+
+static inline void
+irq_prof_done(irq_prof_id_t id, uint32_t cycles)
+{
+  irq_prof[id].count++;
+  if(cycles > irq_prof[id].max)
+  {
+    irq_prof[id].max = cycles;
+  }
+}
+
+#define IRQ_PROF_ENTER()      uint32_t irq_prof_start = DWT->CYCCNT
+#define IRQ_PROF_EXIT(id)     irq_prof_done(id, DWT->CYCCNT - irq_prof_start)
+#else
+#define IRQ_PROF_ENTER()
+#define IRQ_PROF_EXIT(id)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __IRQ_H */
@@ -95,7 +95,7 @@
   * @brief This is the HAL system configuration section
   */     
 #define  VDD_VALUE                    ((uint32_t)3300) /*!< Value of VDD in mv */           
-#define  TICK_INT_PRIORITY            ((uint32_t)0)    /*!< tick interrupt priority (lowest by default)  */            
+#define  TICK_INT_PRIORITY            ((uint32_t)3)    /*!< tick interrupt priority, IRQ_PRIO_TICK in irq.h */            
 #define  USE_RTOS                     0
 #define  PREFETCH_ENABLE              1
 
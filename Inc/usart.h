@@ -76,6 +76,11 @@ void MX_USART2_UART_Init(void);
 void MX_USART3_UART_Init(void);
 
 /* USER CODE BEGIN Prototypes */
+void usart_set_baudrate(UART_HandleTypeDef* huart, uint32_t baudrate);
+void usart_tx_break(UART_HandleTypeDef* huart, uint8_t on);
+void usart_irq_hold(UART_HandleTypeDef* huart, uint8_t hold);
+uint8_t usart_irq_held(UART_HandleTypeDef* huart);
+void usart_irq_count(UART_HandleTypeDef* huart, uint32_t count[3]);
 
 /* USER CODE END Prototypes */
 
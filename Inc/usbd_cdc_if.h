@@ -9,6 +9,9 @@
 
 extern USBD_CDC_ItfTypeDef  USBD_Interface_fops_FS;
 extern void usbd_cdc_if_check_tx(void);
+extern void usbd_cdc_if_uart_irq(UART_HandleTypeDef* huart);
+extern void usbd_cdc_if_usb_irq(void);
+extern void usbd_cdc_if_poll(void);
 
 #ifdef __cplusplus
 }
@@ -9,10 +9,106 @@
 #include <string.h>
 #include "stm32f1xx.h"
 #include "stm32f1xx_hal.h"
+
+/*
+ * these have to be seen before usbd_def.h, which includes this file
+ * back and defaults USB_MAX_EP0_SIZE. each option can be overridden
+ * with -D, the host tests build other configurations that way
+ */
+/*---------- -----------*/
+/* number of bridged CDC ports. 1 : USART1, 2 : adds USART2, 3 : adds USART3.
+ * a third port costs 3 endpoints and 136 bytes of PMA */
+#ifndef USBD_CDC_NUM_PORTS
+#define USBD_CDC_NUM_PORTS       2
+#endif
+/*---------- -----------*/
+/* carry USART1/2/3 multiplexed over the bulk pipe of a single CDC port
+ * instead of one port per USART. framing is in cdc_mux_proto.h */
+#ifndef USBD_CDC_MUX
+#define USBD_CDC_MUX             0
+#endif
+
+/*---------- -----------*/
+/* vendor specific interface with a raw bulk pair after the CDC ports, for
+ * bulk streams that shouldn't go through the host tty layer. its 128
+ * bytes of PMA only fit with CDC double buffering off */
+#ifndef USBD_VENDOR_BULK
+#define USBD_VENDOR_BULK         0
+#endif
+
+#if (USBD_CDC_MUX == 1) && (USBD_CDC_NUM_PORTS != 1)
+#error "USBD_CDC_MUX needs USBD_CDC_NUM_PORTS 1"
+#endif
+/*---------- -----------*/
+/* RTS/CTS flow control. bit n enables it on CDC port n. RTS then follows
+ * the RX ring instead of SET_CONTROL_LINE_STATE. pins are in gpio.h */
+#ifndef USBD_CDC_FLOW_CTRL
+#define USBD_CDC_FLOW_CTRL       0x00
+#endif
+
+#if (USBD_CDC_MUX == 1) && (USBD_CDC_FLOW_CTRL != 0)
+#error "USBD_CDC_MUX has credit based flow control only"
+#endif
+/*---------- -----------*/
+/* XON/XOFF flow control. bit n enables it on CDC port n, for targets with
+ * only TX/RX wired. XON/XOFF from the UART are honored and never reach
+ * host, the device sends its own from the RX ring */
+#ifndef USBD_CDC_XONXOFF
+#define USBD_CDC_XONXOFF         0x00
+#endif
+
+#if (USBD_CDC_MUX == 1) && (USBD_CDC_XONXOFF != 0)
+#error "USBD_CDC_MUX has credit based flow control only"
+#endif
+#if (USBD_CDC_FLOW_CTRL & USBD_CDC_XONXOFF) != 0
+#error "a port runs either RTS/CTS or XON/XOFF"
+#endif
+/*---------- -----------*/
+/* USB IN bandwidth between CDC ports. bit n of USBD_CDC_PRIO puts port n
+ * in the strict priority class, served first. the others share what is
+ * left by weight, 1 to 255. USBD_CDC_RATE_CAP caps a port to bytes per
+ * ms, 0 for no cap. one entry per port, in port order */
+#ifndef USBD_CDC_PRIO
+#define USBD_CDC_PRIO            0x00
+#endif
+#ifndef USBD_CDC_WEIGHTS
+#define USBD_CDC_WEIGHTS         { 1, 1, 1 }
+#endif
+#ifndef USBD_CDC_RATE_CAP
+#define USBD_CDC_RATE_CAP        { 0, 0, 0 }
+#endif
+
+#if (USBD_CDC_MUX == 1) && (USBD_CDC_PRIO != 0)
+#error "USBD_CDC_MUX serves its channels round robin"
+#endif
+/*---------- -----------*/
+/* CDC bulk OUT endpoints double buffered in PMA. host isn't NAKed while
+ * the previous packet is still on its way to UART */
+#ifndef USBD_CDC_OUT_DBL_BUF
+#define USBD_CDC_OUT_DBL_BUF     1
+#endif
+/*---------- -----------*/
+/* CDC bulk IN endpoints double buffered in PMA. next packet is staged
+ * while the previous one is on the wire */
+#ifndef USBD_CDC_IN_DBL_BUF
+#define USBD_CDC_IN_DBL_BUF      0
+#endif
+/*---------- -----------*/
+/* PMA budget is checked by the layout in usbd_conf.c. double buffering
+ * both directions on both ports doesn't fit */
+#if (USBD_CDC_NUM_PORTS == 3)
+/* three ports only fit in PMA with EP0 shrunk to 16 and no double buffering */
+#define USB_MAX_EP0_SIZE     16
+#elif (USBD_CDC_OUT_DBL_BUF == 1) || (USBD_CDC_IN_DBL_BUF == 1) || (USBD_VENDOR_BULK == 1)
+/* EP0 is shrunk to fit two 64 byte PMA buffers per bulk endpoint
+ * or the vendor bulk pair */
+#define USB_MAX_EP0_SIZE     32
+#endif
+
 #include "usbd_def.h"
 
 /*---------- -----------*/
-#define USBD_MAX_NUM_INTERFACES     4
+#define USBD_MAX_NUM_INTERFACES     (USBD_CDC_NUM_PORTS * 2 + USBD_VENDOR_BULK)
 /*---------- -----------*/
 #define USBD_MAX_NUM_CONFIGURATION     1
 /*---------- -----------*/
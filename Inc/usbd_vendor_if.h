@@ -0,0 +1,16 @@
+#ifndef __USBD_VENDOR_IF_H
+#define __USBD_VENDOR_IF_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include "usbd_vendor.h"
+
+extern USBD_Vendor_ItfTypeDef  USBD_Vendor_fops_FS;
+
+#ifdef __cplusplus
+}
+#endif
+  
+#endif /* __USBD_VENDOR_IF_H */
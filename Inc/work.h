@@ -0,0 +1,43 @@
+#ifndef __WORK_H
+#define __WORK_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * deferred work. interrupt handlers only capture what happened and post
+ * the work that follows from it, which then runs from PendSV at the
+ * lowest priority. with nothing to do the CPU sleeps in WFI.
+ */
+typedef enum
+{
+  WORK_CDC_POLL,      /* usbd_cdc_if_poll. UART setup and recovery        */
+  WORK_LED,           /* heartbeat                                        */
+  WORK_MAX,
+} work_id_t;
+
+typedef void (*work_fn_t)(void);
+
+typedef struct
+{
+  uint32_t  ticks;            /* SysTick ms since work_init               */
+  uint32_t  idle_ticks;       /* of those, ms that found the CPU in WFI   */
+  uint32_t  runs[WORK_MAX];
+} work_stats_t;
+
+extern void work_init(void);
+extern void work_set(work_id_t id, work_fn_t fn);
+extern void work_post(work_id_t id);
+extern void work_post_in(work_id_t id, uint16_t ms);
+extern void work_run(void);
+extern void work_idle(void);
+extern const work_stats_t* work_get_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __WORK_H */
@@ -141,6 +141,8 @@ USBD_StatusTypeDef  USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
                                            uint16_t  size);
 
 uint32_t USBD_LL_GetRxDataSize  (USBD_HandleTypeDef *pdev, uint8_t  ep_addr);  
+USBD_StatusTypeDef  USBD_LL_NakOutEP (USBD_HandleTypeDef *pdev, uint8_t ep_addr);
+void  USBD_LL_SOFInterrupt (USBD_HandleTypeDef *pdev, uint8_t enable);
 void  USBD_LL_Delay (uint32_t Delay);
 
 /**
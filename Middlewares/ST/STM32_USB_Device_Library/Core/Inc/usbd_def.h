@@ -112,7 +112,9 @@
 
 #define USB_HS_MAX_PACKET_SIZE                            512
 #define USB_FS_MAX_PACKET_SIZE                            64
+#ifndef USB_MAX_EP0_SIZE
 #define USB_MAX_EP0_SIZE                                  64
+#endif
 
 /*  Device Status */
 #define USBD_STATE_DEFAULT                                1
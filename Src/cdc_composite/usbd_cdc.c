@@ -1,6 +1,9 @@
 #include "usbd_cdc.h"
 #include "usbd_desc.h"
 #include "usbd_ctlreq.h"
+#if (USBD_VENDOR_BULK == 1)
+#include "usbd_vendor.h"
+#endif
 
 static uint8_t  USBD_CDC_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 static uint8_t  USBD_CDC_DeInit (USBD_HandleTypeDef *pdev, uint8_t cfgidx);
@@ -8,43 +11,71 @@ static uint8_t  USBD_CDC_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *
 static uint8_t  USBD_CDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t  USBD_CDC_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t  USBD_CDC_EP0_RxReady (USBD_HandleTypeDef *pdev); 
+static uint8_t  USBD_CDC_SOF (USBD_HandleTypeDef *pdev);
 static uint8_t  *USBD_CDC_GetFSCfgDesc (uint16_t *length);
 static uint8_t  *USBD_CDC_GetHSCfgDesc (uint16_t *length);
 static uint8_t  *USBD_CDC_GetOtherSpeedCfgDesc (uint16_t *length); 
 uint8_t  *USBD_CDC_GetDeviceQualifierDescriptor (uint16_t *length);
 
-static uint8_t    _cdc_in_eps[] =
-{
-  CDC0_IN_EP,
-  CDC1_IN_EP,
-};
-
-static uint8_t    _cdc_out_eps[] =
-{
-  CDC0_OUT_EP,
-  CDC1_OUT_EP,
-};
+/* RxState */
+#define CDC_RX_IDLE       0     /* OUT EP not armed. host is NAKed          */
+#define CDC_RX_ARMED      1     /* OUT EP armed on interface RxBuffer       */
+#define CDC_RX_SPILL      2     /* OUT EP armed on RxSpill and NAKed        */
 
 static inline USBD_CDC_Instance
 get_cdc_instance_from_interface(uint8_t intf)
 {
-  USBD_CDC_Instance instance;
-
-  switch(intf)
+  /* only the control interface of an instance takes class requests */
+  if((intf & 0x01) != 0 || intf >= CDC_CTRL_INTERFACE_NO(USBD_CDC_Instance_MAX))
   {
-  case CDC0_CTRL_INTERFACE_NO:
-    instance = USBD_CDC_Instance_0;
-    break;
+    return USBD_CDC_Instance_MAX;
+  }
+  return (USBD_CDC_Instance)(intf / 2);
+}
 
-  case CDC1_CTRL_INTERFACE_NO:
-    instance = USBD_CDC_Instance_1;
-    break;
+static inline USBD_CDC_Instance
+get_cdc_instance_from_data_ep(uint8_t epnum)
+{
+  /* bulk IN/OUT share the odd endpoint numbers. even ones are notification */
+  epnum &= 0x7f;
+  if((epnum & 0x01) == 0 || epnum >= CDC_OUT_EP(USBD_CDC_Instance_MAX))
+  {
+    return USBD_CDC_Instance_MAX;
+  }
+  return (USBD_CDC_Instance)(epnum / 2);
+}
 
-  default:
-    instance = USBD_CDC_Instance_MAX;
+static inline USBD_CDC_Instance
+get_cdc_instance_from_cmd_ep(uint8_t epnum)
+{
+  epnum &= 0x7f;
+  if((epnum & 0x01) != 0 || epnum < (CDC_CMD_EP(0) & 0x7f) ||
+     epnum > (CDC_CMD_EP(USBD_CDC_Instance_MAX - 1) & 0x7f))
+  {
+    return USBD_CDC_Instance_MAX;
   }
+  return (USBD_CDC_Instance)((epnum - (CDC_CMD_EP(0) & 0x7f)) / 2);
+}
 
-  return instance;
+static void
+cdc_notify_serial_state(USBD_HandleTypeDef *pdev, uint16_t state, USBD_CDC_Instance instance)
+{
+  USBD_CDC_HandleTypeDef   *hcdc = (USBD_CDC_HandleTypeDef*) pdev->pClassData;
+  uint8_t                  *buf = hcdc->Notify[instance];
+
+  buf[0] = 0xA1;                                    /* bmRequestType: class, interface, IN */
+  buf[1] = CDC_NOTIFY_SERIAL_STATE;
+  buf[2] = 0;                                       /* wValue */
+  buf[3] = 0;
+  buf[4] = CDC_CTRL_INTERFACE_NO(instance);         /* wIndex */
+  buf[5] = 0;
+  buf[6] = 2;                                       /* wLength */
+  buf[7] = 0;
+  buf[8] = LOBYTE(state);
+  buf[9] = HIBYTE(state);
+
+  hcdc->NotifyState[instance] = 1;
+  USBD_LL_Transmit(pdev, CDC_CMD_EP(instance), buf, CDC_SERIAL_STATE_SIZE);
 }
 
 /* USB Standard Device Descriptor */
@@ -72,7 +103,7 @@ USBD_ClassTypeDef  USBD_CDC =
   USBD_CDC_EP0_RxReady,
   USBD_CDC_DataIn,
   USBD_CDC_DataOut,
-  NULL,
+  USBD_CDC_SOF,
   NULL,
   NULL,     
   USBD_CDC_GetHSCfgDesc,  
@@ -81,305 +112,131 @@ USBD_ClassTypeDef  USBD_CDC =
   USBD_CDC_GetDeviceQualifierDescriptor,
 };
 
+/*
+ * one CDC ACM function (IAD + control and data interface) for instance n.
+ * interface numbers and endpoint addresses are derived from n, bulk
+ * wMaxPacketSize and notification bInterval depend on the speed.
+ * USB_CDC_FUNCTION_DESC_SIZE bytes long.
+ */
+#define CDC_ACM_FUNCTION_DESC(n, bulk_mps, cmd_interval)                        \
+  /* IAD (Interface Association Descriptor) */                                  \
+  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */ \
+  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */ \
+  CDC_CTRL_INTERFACE_NO(n),               /* bFirstInterface                    */ \
+  2,                                      /* bInterfaceCount                    */ \
+  USB_CLASS_CDC,                          /* bFunctionClass                     */ \
+  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */ \
+  0,                                      /* bFunctionProtocol                  */ \
+  0,                                      /* iFunction                          */ \
+                                                                                \
+  /* Communication Class Interface descriptor */                                \
+  0x09,                                   /* bLength: Interface Descriptor size */ \
+  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface         */ \
+  CDC_CTRL_INTERFACE_NO(n),               /* bInterfaceNumber                   */ \
+  0,                                      /* bAlternateSetting                  */ \
+  1,                                      /* bNumEndpoints                      */ \
+  USB_CLASS_CDC,                          /* bInterfaceClass                    */ \
+  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */ \
+  0x0,                                    /* bInterfaceProtocol                 */ \
+  0x0,                                    /* iInterface                         */ \
+                                                                                \
+  /* Header Functional Descriptor */                                            \
+  0x05,                                   /* bLength: Endpoint Descriptor size    */ \
+  0x24,                                   /* bDescriptorType: CS_INTERFACE        */ \
+  0x00,                                   /* bDescriptorSubtype: Header Func Desc */ \
+  0x10,                                   /* bcdCDC: spec release number          */ \
+  0x01,                                                                         \
+                                                                                \
+  /* Call Management Functional Descriptor */                                   \
+  0x05,                                   /* bFunctionLength                      */ \
+  0x24,                                   /* bDescriptorType: CS_INTERFACE        */ \
+  0x01,                                   /* bDescriptorSubtype: Call Management  */ \
+  0x00,                                   /* bmCapabilities: D0+D1                */ \
+  CDC_DATA_INTERFACE_NO(n),               /* bDataInterface:                      */ \
+                                                                                \
+  /* ACM Functional Descriptor */                                               \
+  0x04,                                   /* bFunctionLength                      */ \
+  0x24,                                   /* bDescriptorType: CS_INTERFACE        */ \
+  0x02,                                   /* bDescriptorSubtype: ACM desc         */ \
+  0x02,                                   /* bmCapabilities                       */ \
+                                                                                \
+  /* Union Functional Descriptor */                                             \
+  0x05,                                   /* bFunctionLength                      */ \
+  0x24,                                   /* bDescriptorType: CS_INTERFACE        */ \
+  0x06,                                   /* bDescriptorSubtype: Union func desc  */ \
+  CDC_CTRL_INTERFACE_NO(n),               /* bMasterInterface: Communication class */ \
+  CDC_DATA_INTERFACE_NO(n),               /* bSlaveInterface0: Data Class         */ \
+                                                                                \
+  /* Notification Endpoint Descriptor */                                        \
+  0x07,                                   /* bLength: Endpoint Descriptor size    */ \
+  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */ \
+  CDC_CMD_EP(n),                          /* bEndpointAddress                     */ \
+  0x03,                                   /* bmAttributes: Interrupt              */ \
+  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */ \
+  HIBYTE(CDC_CMD_PACKET_SIZE),                                                  \
+  (cmd_interval),                         /* bInterval:                           */ \
+                                                                                \
+  /* Data class interface descriptor */                                         \
+  0x09,                                   /* bLength: Endpoint Descriptor size      */ \
+  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */ \
+  CDC_DATA_INTERFACE_NO(n),               /* bInterfaceNumber: Number of Interface  */ \
+  0x00,                                   /* bAlternateSetting: Alternate setting   */ \
+  0x02,                                   /* bNumEndpoints: Two endpoints used      */ \
+  0x0A,                                   /* bInterfaceClass: CDC                   */ \
+  0x00,                                   /* bInterfaceSubClass:                    */ \
+  0x00,                                   /* bInterfaceProtocol:                    */ \
+  0x00,                                   /* iInterface:                            */ \
+                                                                                \
+  /* Endpoint OUT Descriptor */                                                 \
+  0x07,                                   /* bLength: Endpoint Descriptor size      */ \
+  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */ \
+  CDC_OUT_EP(n),                          /* bEndpointAddress                       */ \
+  0x02,                                   /* bmAttributes: Bulk                     */ \
+  LOBYTE(bulk_mps),                       /* wMaxPacketSize:                        */ \
+  HIBYTE(bulk_mps),                                                             \
+  0x00,                                   /* bInterval: ignore for Bulk transfer    */ \
+                                                                                \
+  /* Endpoint IN Descriptor */                                                  \
+  0x07,                                   /* bLength: Endpoint Descriptor size      */ \
+  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */ \
+  CDC_IN_EP(n),                           /* bEndpointAddress                       */ \
+  0x02,                                   /* bmAttributes: Bulk                     */ \
+  LOBYTE(bulk_mps),                       /* wMaxPacketSize:                        */ \
+  HIBYTE(bulk_mps),                                                             \
+  0x00                                    /* bInterval: ignore for Bulk transfer    */
+
+/*
+ * USBD_CDC_NUM_PORTS functions back to back. the preprocessor can't loop,
+ * so each count is spelled out once here
+ */
+#define CDC_ACM_FUNCTIONS_1(mps, intv)    CDC_ACM_FUNCTION_DESC(0, mps, intv)
+#define CDC_ACM_FUNCTIONS_2(mps, intv)    CDC_ACM_FUNCTIONS_1(mps, intv), CDC_ACM_FUNCTION_DESC(1, mps, intv)
+#define CDC_ACM_FUNCTIONS_3(mps, intv)    CDC_ACM_FUNCTIONS_2(mps, intv), CDC_ACM_FUNCTION_DESC(2, mps, intv)
+#define CDC_ACM_FUNCTIONS__(n, mps, intv) CDC_ACM_FUNCTIONS_##n(mps, intv)
+#define CDC_ACM_FUNCTIONS_(n, mps, intv)  CDC_ACM_FUNCTIONS__(n, mps, intv)
+#define CDC_ACM_FUNCTIONS(mps, intv)      CDC_ACM_FUNCTIONS_(USBD_CDC_NUM_PORTS, mps, intv)
+
 /* USB CDC device Configuration Descriptor */
 __ALIGN_BEGIN uint8_t USBD_CDC_CfgHSDesc[USB_CDC_COMP_CONFIG_DESC_SIZE] __ALIGN_END =
 {
   /* Configuration Descriptor */
   0x09,                             /* bLength: Configuration Descriptor size   */
   USB_DESC_TYPE_CONFIGURATION,      /* bDescriptorType: Configuration           */
-  USB_CDC_COMP_CONFIG_DESC_SIZE,    /* wTotalLength:no of returned bytes        */
-  0x00,
-  0x04,                             /* bNumInterfaces: 4 interfaces for 2 CDC   */
+  LOBYTE(USB_CDC_COMP_CONFIG_DESC_SIZE),  /* wTotalLength:no of returned bytes  */
+  HIBYTE(USB_CDC_COMP_CONFIG_DESC_SIZE),
+  USBD_MAX_NUM_INTERFACES,          /* bNumInterfaces: 2 per CDC + vendor       */
   0x01,                             /* bConfigurationValue: Configuration value */
   0x00,                             /* iConfiguration: Index of string descriptor
                                        describing the configuration */
   0xC0,                             /* bmAttributes: self powered */
   0x32,                             /* MaxPower 0 mA */
-  
-  /*---------------------------------------------------------------------------*/
-  /* CDC0 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 0 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC0_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-  
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC0_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-  
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC0_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-  
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-  
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC0_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC0_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC0_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0x10,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC0_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-  
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC0_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC0_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*---------------------------------------------------------------------------*/
-  /* CDC1 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 1 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC1_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-  
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC1_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-  
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC1_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-  
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-  
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC1_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC1_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC1_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0x10,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC1_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC1_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC1_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-  
-#if 0
-  /*---------------------------------------------------------------------------*/
-  /* CDC2 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 2 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC2_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-  
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC2_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-  
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC2_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-  
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-  
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC2_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC2_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC2_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0x10,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC2_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-  
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC2_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC2_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_HS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
+
+  /* notification EP polled every 1 ms, so breaks and errors show up fast */
+  CDC_ACM_FUNCTIONS(CDC_DATA_HS_MAX_PACKET_SIZE, 0x04),
+#if (USBD_VENDOR_BULK == 1)
+  USBD_VENDOR_DESC(VENDOR_HS_MAX_PACKET_SIZE),
 #endif
-} ;
+};
 
 
 /* USB CDC device Configuration Descriptor */
@@ -388,594 +245,37 @@ __ALIGN_BEGIN uint8_t USBD_CDC_CfgFSDesc[USB_CDC_COMP_CONFIG_DESC_SIZE] __ALIGN_
   /* Configuration Descriptor */
   0x09,                             /* bLength: Configuration Descriptor size   */
   USB_DESC_TYPE_CONFIGURATION,      /* bDescriptorType: Configuration           */
-  USB_CDC_COMP_CONFIG_DESC_SIZE,    /* wTotalLength:no of returned bytes        */
-  0x00,
-  0x04,                             /* bNumInterfaces: 6 interfaces for 3 CDC   */
+  LOBYTE(USB_CDC_COMP_CONFIG_DESC_SIZE),  /* wTotalLength:no of returned bytes  */
+  HIBYTE(USB_CDC_COMP_CONFIG_DESC_SIZE),
+  USBD_MAX_NUM_INTERFACES,          /* bNumInterfaces: 2 per CDC + vendor       */
   0x01,                             /* bConfigurationValue: Configuration value */
   0x00,                             /* iConfiguration: Index of string descriptor
                                        describing the configuration */
   0xC0,                             /* bmAttributes: self powered */
   0x32,                             /* MaxPower 0 mA */
-  
-  /*---------------------------------------------------------------------------*/
-  /* CDC0 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 0 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC0_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC0_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-  
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC0_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC0_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC0_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC0_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0x10,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC0_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC0_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC0_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*---------------------------------------------------------------------------*/
-  /* CDC1 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 1 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC1_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC1_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-  
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC1_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC1_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC1_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC1_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0x10,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC1_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC1_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC1_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-#if 0
-  /*---------------------------------------------------------------------------*/
-  /* CDC2 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 2 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC2_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC2_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-  
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC2_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC2_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC2_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC2_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0x10,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC2_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC2_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC2_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),    /* wMaxPacketSize:                        */
-  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
+
+  /* notification EP polled every frame */
+  CDC_ACM_FUNCTIONS(CDC_DATA_FS_MAX_PACKET_SIZE, 0x01),
+#if (USBD_VENDOR_BULK == 1)
+  USBD_VENDOR_DESC(VENDOR_FS_MAX_PACKET_SIZE),
 #endif
-} ;
+};
 
 __ALIGN_BEGIN uint8_t USBD_CDC_OtherSpeedCfgDesc[USB_CDC_COMP_CONFIG_DESC_SIZE] __ALIGN_END =
 { 
   0x09,   /* bLength: Configuation Descriptor size */
   USB_DESC_TYPE_OTHER_SPEED_CONFIGURATION,   
-  USB_CDC_COMP_CONFIG_DESC_SIZE,
-  0x00,
-  0x04,   /* bNumInterfaces: 2 interfaces */
+  LOBYTE(USB_CDC_COMP_CONFIG_DESC_SIZE),
+  HIBYTE(USB_CDC_COMP_CONFIG_DESC_SIZE),
+  USBD_MAX_NUM_INTERFACES,  /* bNumInterfaces: 2 per CDC + vendor */
   0x01,   /* bConfigurationValue: */
   0x04,   /* iConfiguration: */
   0xC0,   /* bmAttributes: */
   0x32,   /* MaxPower 100 mA */  
 
-  /*---------------------------------------------------------------------------*/
-  /* CDC0 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 0 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC0_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC0_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-  
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC0_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC0_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC0_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC0_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0xff,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC0_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC0_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  16,                                     /* wMaxPacketSize:                        */
-  0x00,
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC0_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  16,                                     /* wMaxPacketSize:                        */
-  0x00,
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*---------------------------------------------------------------------------*/
-  /* CDC1 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 1 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC1_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC1_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-  
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC1_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC1_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC1_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC1_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0xff,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC1_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC1_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  16,                                     /* wMaxPacketSize:                        */
-  0x00,
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC1_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  16,                                     /* wMaxPacketSize:                        */
-  0x00,
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-#if 0
-  /*---------------------------------------------------------------------------*/
-  /* CDC2 Interface Descriptor */
-  /* IAD (Interface Association Descriptor) for CDC 2 */
-  /*---------------------------------------------------------------------------*/
-  USB_INTERFACE_ASSOCIATION_DESCSIZE,     /* bLength: Interface Descriptor size */
-  USB_INTERFACE_ASSOCIATION_DESCRIPTOR,   /* bDescriptorType                    */
-  CDC2_CTRL_INTERFACE_NO,                 /* bFirstInterface                    */
-  2,                                      /* bInterfaceCount                    */
-  USB_CLASS_CDC,                          /* bFunctionClass                     */
-  USB_CLASS_CDC_ACM,                      /* bFunctionSubClass                  */
-  0,                                      /* bFunctionProtocol                  */
-  0,                                      /* iFunction                          */
-
-  /*---------------------------------------------------------------------------*/
-  /* Communication Class Interface descriptor */
-  0x09,                                   /* bLength: Interface Descriptor size */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface */
-  CDC2_CTRL_INTERFACE_NO,                 /* bInterfaceNumber                   */
-  0,                                      /* bAlternateSetting                  */
-  1,                                      /* bNumEndpoints                      */
-  USB_CLASS_CDC,                          /* bInterfaceClass                    */
-  USB_CLASS_CDC_ACM,                      /* bInterfaceSubClass                 */
-  0x0,                                    /* bInterfaceProtocol                 */
-  0x0,                                    /* iInterface                         */
-  
-  /* Header Functional Descriptor */
-  0x05,                                   /* bLength: Endpoint Descriptor size    */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x00,                                   /* bDescriptorSubtype: Header Func Desc */
-  0x10,                                   /* bcdCDC: spec release number          */
-  0x01,
-
-  /* Call Management Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x01,                                   /* bDescriptorSubtype: Call Management
-                                             Func Desc                            */
-  0x00,                                   /* bmCapabilities: D0+D1                */
-  CDC2_DATA_INTERFACE_NO,                 /* bDataInterface:                      */
-
-  /* ACM Functional Descriptor */
-  0x04,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x02,                                   /* bDescriptorSubtype: Abstract Control
-                                             Management desc                      */
-  0x02,                                   /* bmCapabilities                       */
-
-  /* Union Functional Descriptor */
-  0x05,                                   /* bFunctionLength                      */
-  0x24,                                   /* bDescriptorType: CS_INTERFACE        */
-  0x06,                                   /* bDescriptorSubtype: Union func desc  */
-  CDC2_CTRL_INTERFACE_NO,                 /* bMasterInterface:
-                                             Communication class interface        */
-  CDC2_DATA_INTERFACE_NO,                 /* bSlaveInterface0:
-                                             Data Class Interface                 */
-  /* Endpoint 2 Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size    */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint            */
-  CDC2_CMD_EP,                            /* bEndpointAddress                     */
-  0x03,                                   /* bmAttributes: Interrupt              */
-  LOBYTE(CDC_CMD_PACKET_SIZE),            /* wMaxPacketSize:                      */
-  HIBYTE(CDC_CMD_PACKET_SIZE),
-  0xff,                                   /* bInterval:                           */ 
-  
-  /*---------------------------------------------------------------------------*/
-  /* Data class interface descriptor */
-  0x09,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType:                       */
-  CDC2_DATA_INTERFACE_NO,                 /* bInterfaceNumber: Number of Interface  */
-  0x00,                                   /* bAlternateSetting: Alternate setting   */
-  0x02,                                   /* bNumEndpoints: Two endpoints used      */
-  0x0A,                                   /* bInterfaceClass: CDC                   */
-  0x00,                                   /* bInterfaceSubClass:                    */
-  0x00,                                   /* bInterfaceProtocol:                    */
-  0x00,                                   /* iInterface:                            */
-
-  /* Endpoint OUT Descriptor */
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC2_OUT_EP,                            /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  16,                                     /* wMaxPacketSize:                        */
-  0x00,
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
-
-  /*Endpoint IN Descriptor*/
-  0x07,                                   /* bLength: Endpoint Descriptor size      */
-  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint              */
-  CDC2_IN_EP,                             /* bEndpointAddress                       */
-  0x02,                                   /* bmAttributes: Bulk                     */
-  16,                                     /* wMaxPacketSize:                        */
-  0x00,
-  0x00,                                   /* bInterval: ignore for Bulk transfer    */
+  CDC_ACM_FUNCTIONS(16, 0xff),
+#if (USBD_VENDOR_BULK == 1)
+  USBD_VENDOR_DESC(16),
 #endif
 };
 
@@ -999,39 +299,31 @@ USBD_CDC_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
   uint8_t ret = 0;
   USBD_CDC_HandleTypeDef   *hcdc;
+  USBD_CDC_Instance instance;
+  uint16_t in_size, out_size;
 
   if(pdev->dev_speed == USBD_SPEED_HIGH  ) 
   {  
-    /* Open EP IN */
-    USBD_LL_OpenEP(pdev, CDC0_IN_EP, USBD_EP_TYPE_BULK, CDC_DATA_HS_IN_PACKET_SIZE);
-
-    /* Open EP OUT */
-    USBD_LL_OpenEP(pdev, CDC0_OUT_EP, USBD_EP_TYPE_BULK, CDC_DATA_HS_OUT_PACKET_SIZE);
-
-    /* Open EP IN */
-    USBD_LL_OpenEP(pdev, CDC1_IN_EP, USBD_EP_TYPE_BULK, CDC_DATA_HS_IN_PACKET_SIZE);
-
-    /* Open EP OUT */
-    USBD_LL_OpenEP(pdev, CDC1_OUT_EP, USBD_EP_TYPE_BULK, CDC_DATA_HS_OUT_PACKET_SIZE);
+    in_size   = CDC_DATA_HS_IN_PACKET_SIZE;
+    out_size  = CDC_DATA_HS_OUT_PACKET_SIZE;
   }
   else
   {
-    /* Open EP IN */
-    USBD_LL_OpenEP(pdev, CDC0_IN_EP, USBD_EP_TYPE_BULK, CDC_DATA_FS_IN_PACKET_SIZE);
-
-    /* Open EP OUT */
-    USBD_LL_OpenEP(pdev, CDC0_OUT_EP, USBD_EP_TYPE_BULK, CDC_DATA_FS_OUT_PACKET_SIZE);
+    in_size   = CDC_DATA_FS_IN_PACKET_SIZE;
+    out_size  = CDC_DATA_FS_OUT_PACKET_SIZE;
+  }
 
+  for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
+  {
     /* Open EP IN */
-    USBD_LL_OpenEP(pdev, CDC1_IN_EP, USBD_EP_TYPE_BULK, CDC_DATA_FS_IN_PACKET_SIZE);
+    USBD_LL_OpenEP(pdev, CDC_IN_EP(instance), USBD_EP_TYPE_BULK, in_size);
 
     /* Open EP OUT */
-    USBD_LL_OpenEP(pdev, CDC1_OUT_EP, USBD_EP_TYPE_BULK, CDC_DATA_FS_OUT_PACKET_SIZE);
-  }
+    USBD_LL_OpenEP(pdev, CDC_OUT_EP(instance), USBD_EP_TYPE_BULK, out_size);
 
-  /* Open Command IN EP */
-  USBD_LL_OpenEP(pdev, CDC0_CMD_EP, USBD_EP_TYPE_INTR, CDC_CMD_PACKET_SIZE);
-  USBD_LL_OpenEP(pdev, CDC1_CMD_EP, USBD_EP_TYPE_INTR, CDC_CMD_PACKET_SIZE);
+    /* Open Command IN EP */
+    USBD_LL_OpenEP(pdev, CDC_CMD_EP(instance), USBD_EP_TYPE_INTR, CDC_CMD_PACKET_SIZE);
+  }
 
   pdev->pClassData = USBD_malloc(sizeof (USBD_CDC_HandleTypeDef));
 
@@ -1046,25 +338,27 @@ USBD_CDC_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     /* Init  physical Interface components */
     ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->Init();
 
-    /* Init Xfer states */
-    hcdc->TxState[0] =0;
-    hcdc->TxState[1] =0;
-
-    hcdc->RxState[0] =0;
-    hcdc->RxState[1] =0;
-
-    if(pdev->dev_speed == USBD_SPEED_HIGH  ) 
-    {      
-      /* Prepare Out endpoint to receive next packet */
-      USBD_LL_PrepareReceive(pdev, CDC0_OUT_EP, hcdc->RxBuffer[0], CDC_DATA_HS_OUT_PACKET_SIZE);
-      USBD_LL_PrepareReceive(pdev, CDC1_OUT_EP, hcdc->RxBuffer[1], CDC_DATA_HS_OUT_PACKET_SIZE);
-    }
-    else
+    for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
     {
-      /* Prepare Out endpoint to receive next packet */
-      USBD_LL_PrepareReceive(pdev, CDC0_OUT_EP, hcdc->RxBuffer[0], CDC_DATA_FS_OUT_PACKET_SIZE);
-      USBD_LL_PrepareReceive(pdev, CDC1_OUT_EP, hcdc->RxBuffer[1], CDC_DATA_FS_OUT_PACKET_SIZE);
+      /* Init Xfer states */
+      hcdc->TxState[instance] = 0;
+      hcdc->TxZLP[instance]   = 0;
+      hcdc->RxState[instance] = CDC_RX_ARMED;
+      hcdc->NotifyState[instance]   = 0;
+      hcdc->NotifyQueued[instance]  = 0;
+
+#if (USBD_CDC_OUT_DBL_BUF == 1)
+      hcdc->RxSpillLength[instance] = 0;
+#endif
+
+      /* Prepare Out endpoint to receive next transfer */
+      USBD_LL_PrepareReceive(pdev, CDC_OUT_EP(instance),
+          hcdc->RxBuffer[instance], hcdc->RxSize[instance]);
     }
+
+#if (USBD_VENDOR_BULK == 1)
+    USBD_Vendor_Init(pdev);
+#endif
   }
   return ret;
 }
@@ -1080,18 +374,23 @@ static uint8_t
 USBD_CDC_DeInit (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
   uint8_t ret = 0;
+  USBD_CDC_Instance instance;
+
+  for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
+  {
+    /* Close EP IN */
+    USBD_LL_CloseEP(pdev, CDC_IN_EP(instance));
 
-  /* Open EP IN */
-  USBD_LL_CloseEP(pdev, CDC0_IN_EP);
-  USBD_LL_CloseEP(pdev, CDC1_IN_EP);
+    /* Close EP OUT */
+    USBD_LL_CloseEP(pdev, CDC_OUT_EP(instance));
 
-  /* Open EP OUT */
-  USBD_LL_CloseEP(pdev, CDC0_OUT_EP);
-  USBD_LL_CloseEP(pdev, CDC1_OUT_EP);
+    /* Close Command IN EP */
+    USBD_LL_CloseEP(pdev, CDC_CMD_EP(instance));
+  }
 
-  /* Open Command IN EP */
-  USBD_LL_CloseEP(pdev, CDC0_CMD_EP);
-  USBD_LL_CloseEP(pdev, CDC1_CMD_EP);
+#if (USBD_VENDOR_BULK == 1)
+  USBD_Vendor_DeInit(pdev);
+#endif
 
   /* DeInit  physical Interface components */
   if(pdev->pClassData != NULL)
@@ -1121,6 +420,14 @@ USBD_CDC_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
   switch (req->bmRequest & USB_REQ_TYPE_MASK)
   {
   case USB_REQ_TYPE_CLASS :
+#if (USBD_VENDOR_BULK == 1)
+    if(LOBYTE(req->wIndex) == VENDOR_INTERFACE_NO)
+    {
+      /* vendor interface has no class requests */
+      USBD_CtlError(pdev, req);
+      break;
+    }
+#endif
     instance = get_cdc_instance_from_interface(req->wIndex);
     if(instance == USBD_CDC_Instance_MAX)
     {
@@ -1162,6 +469,19 @@ USBD_CDC_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
     case USB_REQ_SET_INTERFACE :
       break;
     }
+    break;
+
+  case USB_REQ_TYPE_VENDOR:
+    instance = get_cdc_instance_from_interface(req->wIndex);
+    if(instance == USBD_CDC_Instance_MAX || req->bRequest != CDC_GET_IRQ_COUNT ||
+       (req->bmRequest & 0x80) == 0 || req->wLength == 0)
+    {
+      USBD_CtlError(pdev, req);
+      break;
+    }
+    ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->Control(req->bRequest, (uint8_t *)hcdc->data, req->wLength, instance);
+    USBD_CtlSendData (pdev, (uint8_t *)hcdc->data, MIN(req->wLength, CDC_IRQ_COUNT_SIZE));
+    break;
 
   default: 
     break;
@@ -1180,19 +500,49 @@ static uint8_t
 USBD_CDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
   USBD_CDC_HandleTypeDef   *hcdc = (USBD_CDC_HandleTypeDef*) pdev->pClassData;
+  USBD_CDC_Instance         instance;
 
   if(pdev->pClassData != NULL)
   {
-    switch((epnum | 0x80))
+#if (USBD_VENDOR_BULK == 1)
+    if((epnum & 0x7f) == VENDOR_EP_NUM)
     {
-    case CDC0_IN_EP:
-      hcdc->TxState[0] = 0;
-      break;
+      USBD_Vendor_DataIn(pdev);
+      return USBD_OK;
+    }
+#endif
 
-    case CDC1_IN_EP:
-      hcdc->TxState[1] = 0;
-      break;
+    instance = get_cdc_instance_from_cmd_ep(epnum);
+    if(instance != USBD_CDC_Instance_MAX)
+    {
+      hcdc->NotifyState[instance] = 0;
+      if(hcdc->NotifyQueued[instance])
+      {
+        hcdc->NotifyQueued[instance] = 0;
+        cdc_notify_serial_state(pdev, hcdc->NotifyPending[instance], instance);
+      }
+      return USBD_OK;
     }
+
+    instance = get_cdc_instance_from_data_ep(epnum);
+    if(instance == USBD_CDC_Instance_MAX)
+    {
+      return USBD_OK;
+    }
+
+    if(hcdc->TxZLP[instance])
+    {
+      /* last packet was full sized. terminate the transfer with a ZLP */
+      hcdc->TxZLP[instance] = 0;
+      USBD_LL_Transmit(pdev, CDC_IN_EP(instance), NULL, 0);
+      return USBD_OK;
+    }
+
+    hcdc->TxState[instance] = 0;
+
+    /* let the interface queue its next segment right away */
+    ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->TransmitCplt(hcdc->TxBuffer[instance],
+        &hcdc->TxLength[instance], instance);
     return USBD_OK;
   }
   else
@@ -1201,6 +551,34 @@ USBD_CDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
   }
 }
 
+#if (USBD_CDC_OUT_DBL_BUF == 1)
+/**
+  * @brief  cdc_rx_hold_off
+  *         hardware doesn't NAK a double buffered OUT EP after reception and
+  *         its other PMA buffer may already hold the next packet. if the
+  *         interface didn't give us a new buffer, catch that packet in
+  *         RxSpill and NAK everything after it.
+  * @param  pdev: device instance
+  * @param  instance: CDC instance
+  * @retval None
+  */
+static void
+cdc_rx_hold_off(USBD_HandleTypeDef *pdev, USBD_CDC_Instance instance)
+{
+  USBD_CDC_HandleTypeDef   *hcdc = (USBD_CDC_HandleTypeDef*) pdev->pClassData;
+
+  if(hcdc->RxState[instance] != CDC_RX_IDLE || hcdc->RxSpillLength[instance] != 0)
+  {
+    return;
+  }
+
+  hcdc->RxState[instance] = CDC_RX_SPILL;
+  USBD_LL_PrepareReceive(pdev, CDC_OUT_EP(instance),
+      (uint8_t*)hcdc->RxSpill[instance], CDC_DATA_FS_OUT_PACKET_SIZE);
+  USBD_LL_NakOutEP(pdev, CDC_OUT_EP(instance));
+}
+#endif
+
 /**
   * @brief  USBD_CDC_DataOut
   *         Data received on non-control Out endpoint
@@ -1212,25 +590,44 @@ static uint8_t
 USBD_CDC_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
 {      
   USBD_CDC_HandleTypeDef   *hcdc = (USBD_CDC_HandleTypeDef*) pdev->pClassData;
+  USBD_CDC_Instance         instance;
 
   /* USB data will be immediately processed, this allow next USB traffic being 
      NAKed till the end of the application Xfer */
   if(pdev->pClassData != NULL)
   {
-    switch(epnum)
+#if (USBD_VENDOR_BULK == 1)
+    if((epnum & 0x7f) == VENDOR_EP_NUM)
     {
-    case CDC0_OUT_EP:
-      hcdc->RxLength[0] = USBD_LL_GetRxDataSize (pdev, epnum);
-      ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->Receive(hcdc->RxBuffer[0], &hcdc->RxLength[0], USBD_CDC_Instance_0);
-      break;
+      USBD_Vendor_DataOut(pdev);
+      return USBD_OK;
+    }
+#endif
 
-    case CDC1_OUT_EP:
-      hcdc->RxLength[1] = USBD_LL_GetRxDataSize (pdev, epnum);
-      ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->Receive(hcdc->RxBuffer[1], &hcdc->RxLength[1], USBD_CDC_Instance_1);
+    instance = get_cdc_instance_from_data_ep(epnum);
+    if(instance == USBD_CDC_Instance_MAX)
+    {
+      return USBD_OK;
+    }
 
-      break;
+#if (USBD_CDC_OUT_DBL_BUF == 1)
+    if(hcdc->RxState[instance] == CDC_RX_SPILL)
+    {
+      /* park it till the interface asks for the next packet */
+      hcdc->RxSpillLength[instance] = USBD_LL_GetRxDataSize (pdev, epnum);
+      hcdc->RxState[instance] = CDC_RX_IDLE;
+      USBD_LL_NakOutEP(pdev, epnum);
+      return USBD_OK;
     }
+#endif
 
+    hcdc->RxState[instance] = CDC_RX_IDLE;
+    hcdc->RxLength[instance] = USBD_LL_GetRxDataSize (pdev, epnum);
+    ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->Receive(hcdc->RxBuffer[instance], &hcdc->RxLength[instance], instance);
+
+#if (USBD_CDC_OUT_DBL_BUF == 1)
+    cdc_rx_hold_off(pdev, instance);
+#endif
     return USBD_OK;
   }
   else
@@ -1268,6 +665,23 @@ USBD_CDC_EP0_RxReady (USBD_HandleTypeDef *pdev)
   return USBD_OK;
 }
 
+/**
+  * @brief  USBD_CDC_SOF
+  *         start of frame. IN scheduling of the interface runs from here,
+  *         early in the frame, for as long as it keeps SOF enabled
+  * @param  pdev: device instance
+  * @retval status
+  */
+static uint8_t
+USBD_CDC_SOF (USBD_HandleTypeDef *pdev)
+{
+  if(pdev->pClassData != NULL && pdev->pUserData != NULL)
+  {
+    ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->SOF();
+  }
+  return USBD_OK;
+}
+
 /**
   * @brief  USBD_CDC_GetFSCfgDesc 
   *         Return configuration descriptor
@@ -1364,17 +778,21 @@ USBD_CDC_SetTxBuffer(USBD_HandleTypeDef   *pdev, uint8_t  *pbuff, uint16_t lengt
 
 /**
   * @brief  USBD_CDC_SetRxBuffer
+  *         a buffer larger than a packet takes a multi packet transfer,
+  *         which ends on a short packet or when size bytes are received.
   * @param  pdev: device instance
   * @param  pbuff: Rx Buffer
+  * @param  size: Rx Buffer size, multiple of the OUT packet size
   * @retval status
   */
 uint8_t
-USBD_CDC_SetRxBuffer (USBD_HandleTypeDef   *pdev, uint8_t  *pbuff,
+USBD_CDC_SetRxBuffer (USBD_HandleTypeDef   *pdev, uint8_t  *pbuff, uint32_t size,
     USBD_CDC_Instance instance)
 {
   USBD_CDC_HandleTypeDef   *hcdc = (USBD_CDC_HandleTypeDef*) pdev->pClassData;
 
   hcdc->RxBuffer[instance] = pbuff;
+  hcdc->RxSize[instance] = size;
 
   return USBD_OK;
 }
@@ -1398,8 +816,23 @@ USBD_CDC_TransmitPacket(USBD_HandleTypeDef *pdev, USBD_CDC_Instance instance)
       /* Tx Transfer in progress */
       hcdc->TxState[instance] = 1;
 
+      /*
+       * host can't tell a transfer that ends on a full packet from one
+       * that continues. such a transfer is followed by a ZLP from DataIn
+       */
+      if(pdev->dev_speed == USBD_SPEED_HIGH)
+      {
+        hcdc->TxZLP[instance] = (hcdc->TxLength[instance] != 0) &&
+          ((hcdc->TxLength[instance] % CDC_DATA_HS_IN_PACKET_SIZE) == 0);
+      }
+      else
+      {
+        hcdc->TxZLP[instance] = (hcdc->TxLength[instance] != 0) &&
+          ((hcdc->TxLength[instance] % CDC_DATA_FS_IN_PACKET_SIZE) == 0);
+      }
+
       /* Transmit next packet */
-      USBD_LL_Transmit(pdev, _cdc_in_eps[instance], hcdc->TxBuffer[instance],
+      USBD_LL_Transmit(pdev, CDC_IN_EP(instance), hcdc->TxBuffer[instance],
           hcdc->TxLength[instance]);
 
       return USBD_OK;
@@ -1416,6 +849,59 @@ USBD_CDC_TransmitPacket(USBD_HandleTypeDef *pdev, USBD_CDC_Instance instance)
 }
 
 
+/**
+  * @brief  USBD_CDC_SetSOF
+  *         ask for the interface SOF callback or stop it. with nothing
+  *         buffered the interface turns it off and the device takes no
+  *         interrupt per frame
+  * @param  pdev: device instance
+  * @param  enable: 1 to get SOF, 0 to stop it
+  * @retval status
+  */
+uint8_t
+USBD_CDC_SetSOF(USBD_HandleTypeDef *pdev, uint8_t enable)
+{
+  USBD_LL_SOFInterrupt(pdev, enable);
+  return USBD_OK;
+}
+
+/**
+  * @brief  USBD_CDC_SerialState
+  *         send a SERIAL_STATE notification. while the previous one is
+  *         still in flight the bits are merged and sent after it, so no
+  *         one shot event is lost
+  * @param  pdev: device instance
+  * @param  state: UART state bitmap, CDC_SERIAL_STATE_xxx
+  * @retval status
+  */
+uint8_t
+USBD_CDC_SerialState(USBD_HandleTypeDef *pdev, uint16_t state, USBD_CDC_Instance instance)
+{
+  USBD_CDC_HandleTypeDef   *hcdc = (USBD_CDC_HandleTypeDef*) pdev->pClassData;
+
+  if(pdev->pClassData == NULL)
+  {
+    return USBD_FAIL;
+  }
+
+  if(hcdc->NotifyState[instance] != 0)
+  {
+    if(hcdc->NotifyQueued[instance])
+    {
+      hcdc->NotifyPending[instance] |= state;
+    }
+    else
+    {
+      hcdc->NotifyPending[instance] = state;
+      hcdc->NotifyQueued[instance]  = 1;
+    }
+    return USBD_OK;
+  }
+
+  cdc_notify_serial_state(pdev, state, instance);
+  return USBD_OK;
+}
+
 /**
   * @brief  USBD_CDC_ReceivePacket
   *         prepare OUT Endpoint for reception
@@ -1430,18 +916,27 @@ USBD_CDC_ReceivePacket(USBD_HandleTypeDef *pdev, USBD_CDC_Instance instance)
   /* Suspend or Resume USB Out process */
   if(pdev->pClassData != NULL)
   {
-    if(pdev->dev_speed == USBD_SPEED_HIGH  ) 
-    {      
-      /* Prepare Out endpoint to receive next packet */
-      USBD_LL_PrepareReceive(pdev, _cdc_out_eps[instance],
-          hcdc->RxBuffer[instance], CDC_DATA_HS_OUT_PACKET_SIZE);
-    }
-    else
+#if (USBD_CDC_OUT_DBL_BUF == 1)
+    if(hcdc->RxSpillLength[instance] != 0)
     {
-      /* Prepare Out endpoint to receive next packet */
-      USBD_LL_PrepareReceive(pdev, _cdc_out_eps[instance],
-          hcdc->RxBuffer[instance], CDC_DATA_FS_OUT_PACKET_SIZE);
+      /* hand the parked packet over first, in the buffer just given to us */
+      hcdc->RxLength[instance] = hcdc->RxSpillLength[instance];
+      hcdc->RxSpillLength[instance] = 0;
+      hcdc->RxState[instance] = CDC_RX_IDLE;
+
+      memcpy(hcdc->RxBuffer[instance], hcdc->RxSpill[instance], hcdc->RxLength[instance]);
+      ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->Receive(hcdc->RxBuffer[instance], &hcdc->RxLength[instance], instance);
+
+      cdc_rx_hold_off(pdev, instance);
+      return USBD_OK;
     }
+#endif
+
+    hcdc->RxState[instance] = CDC_RX_ARMED;
+
+    /* Prepare Out endpoint to receive next transfer */
+    USBD_LL_PrepareReceive(pdev, CDC_OUT_EP(instance),
+        hcdc->RxBuffer[instance], hcdc->RxSize[instance]);
     return USBD_OK;
   }
   else
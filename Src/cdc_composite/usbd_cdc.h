@@ -7,30 +7,47 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include  "usbd_ioreq.h"
+#if (USBD_VENDOR_BULK == 1)
+#include  "usbd_vendor.h"
+#endif
 
-#define CDC0_IN_EP                                  0x81  /* EP1 for data IN for CDC0       */
-#define CDC0_OUT_EP                                 0x01  /* EP1 for data OUT  for CDC0     */
-#define CDC0_CMD_EP                                 0x82  /* EP2 for CDC commands for CDC0  */
-
-#define CDC1_IN_EP                                  0x83  /* EP1 for data IN for CDC1       */
-#define CDC1_OUT_EP                                 0x03  /* EP1 for data OUT for CDC1      */
-#define CDC1_CMD_EP                                 0x84  /* EP2 for CDC commands for CDC1  */
+/*
+ * CDC instance n takes control interface 2n and data interface 2n + 1,
+ * bulk OUT/IN on EP(2n + 1) and the notification IN on EP(2n + 2)
+ */
+#define CDC_IN_EP(n)                                (0x81 + (n) * 2)
+#define CDC_OUT_EP(n)                               (0x01 + (n) * 2)
+#define CDC_CMD_EP(n)                               (0x82 + (n) * 2)
+#define CDC_CTRL_INTERFACE_NO(n)                    ((n) * 2)
+#define CDC_DATA_INTERFACE_NO(n)                    ((n) * 2 + 1)
+
+#define CDC0_IN_EP                                  CDC_IN_EP(0)
+#define CDC0_OUT_EP                                 CDC_OUT_EP(0)
+#define CDC0_CMD_EP                                 CDC_CMD_EP(0)
+
+#if (USBD_CDC_NUM_PORTS >= 2)
+#define CDC1_IN_EP                                  CDC_IN_EP(1)
+#define CDC1_OUT_EP                                 CDC_OUT_EP(1)
+#define CDC1_CMD_EP                                 CDC_CMD_EP(1)
+#endif
 
-#if 0
-#define CDC2_IN_EP                                  0x85  /* EP1 for data IN for CDC2       */
-#define CDC2_OUT_EP                                 0x05  /* EP1 for data OUT for CDC2      */
-#define CDC2_CMD_EP                                 0x86  /* EP2 for CDC commands for CDC2  */
+#if (USBD_CDC_NUM_PORTS == 3)
+#define CDC2_IN_EP                                  CDC_IN_EP(2)
+#define CDC2_OUT_EP                                 CDC_OUT_EP(2)
+#define CDC2_CMD_EP                                 CDC_CMD_EP(2)
 #endif
 
-#define CDC0_CTRL_INTERFACE_NO                      0
-#define CDC0_DATA_INTERFACE_NO                      1
+#define CDC0_CTRL_INTERFACE_NO                      CDC_CTRL_INTERFACE_NO(0)
+#define CDC0_DATA_INTERFACE_NO                      CDC_DATA_INTERFACE_NO(0)
 
-#define CDC1_CTRL_INTERFACE_NO                      2
-#define CDC1_DATA_INTERFACE_NO                      3
+#if (USBD_CDC_NUM_PORTS >= 2)
+#define CDC1_CTRL_INTERFACE_NO                      CDC_CTRL_INTERFACE_NO(1)
+#define CDC1_DATA_INTERFACE_NO                      CDC_DATA_INTERFACE_NO(1)
+#endif
 
-#if 0
-#define CDC2_CTRL_INTERFACE_NO                      4
-#define CDC2_DATA_INTERFACE_NO                      5
+#if (USBD_CDC_NUM_PORTS == 3)
+#define CDC2_CTRL_INTERFACE_NO                      CDC_CTRL_INTERFACE_NO(2)
+#define CDC2_DATA_INTERFACE_NO                      CDC_DATA_INTERFACE_NO(2)
 #endif
 
 /* CDC Endpoints parameters: you can fine tune these values depending on the needed baudrates and performance. */
@@ -39,8 +56,16 @@
 #define CDC_CMD_PACKET_SIZE                         8     /* Control Endpoint Packet size */ 
 
 #define USB_CDC_CONFIG_DESC_SIZ                     67
-//#define USB_CDC_COMP_CONFIG_DESC_SIZE               207
-#define USB_CDC_COMP_CONFIG_DESC_SIZE               141
+#define USB_CDC_CONFIG_HDR_DESC_SIZE                9
+#define USB_CDC_FUNCTION_DESC_SIZE                  66    /* IAD + control and data interface */
+#if (USBD_VENDOR_BULK == 1)
+#define USB_CDC_COMP_CONFIG_DESC_SIZE               (USB_CDC_CONFIG_HDR_DESC_SIZE + \
+                                                     USB_CDC_FUNCTION_DESC_SIZE * USBD_CDC_NUM_PORTS + \
+                                                     USB_VENDOR_DESC_SIZE)
+#else
+#define USB_CDC_COMP_CONFIG_DESC_SIZE               (USB_CDC_CONFIG_HDR_DESC_SIZE + \
+                                                     USB_CDC_FUNCTION_DESC_SIZE * USBD_CDC_NUM_PORTS)
+#endif
 #define CDC_DATA_HS_IN_PACKET_SIZE                  CDC_DATA_HS_MAX_PACKET_SIZE
 #define CDC_DATA_HS_OUT_PACKET_SIZE                 CDC_DATA_HS_MAX_PACKET_SIZE
 
@@ -60,6 +85,31 @@
 #define CDC_SET_CONTROL_LINE_STATE                  0x22
 #define CDC_SEND_BREAK                              0x23
 
+/* vendor extension, not in the CDC spec. IN flush policy of the port:
+ * latency timer in ms, flags and minimum fill in bytes, little endian */
+#define CDC_SET_LATENCY_TIMER                       0x90
+#define CDC_GET_LATENCY_TIMER                       0x91
+#define CDC_LATENCY_TIMER_SIZE                      4
+#define CDC_LATENCY_ADAPTIVE                        0x01
+
+/* vendor request, bmRequestType 0xC1 so usbfs passes it to an interface
+ * cdc_acm holds. runs of the port's USART, RX DMA and TX DMA handlers,
+ * 32 bit little endian each. all 0 unless built with IRQ_PROFILE 1 */
+#define CDC_GET_IRQ_COUNT                           0x92
+#define CDC_IRQ_COUNT_SIZE                          12
+
+/* notification on the interrupt EP. 8 byte header followed by the UART state bitmap */
+#define CDC_NOTIFY_SERIAL_STATE                     0x20
+#define CDC_SERIAL_STATE_SIZE                       10
+
+#define CDC_SERIAL_STATE_DCD                        0x0001    /* bRxCarrier                 */
+#define CDC_SERIAL_STATE_DSR                        0x0002    /* bTxCarrier                 */
+#define CDC_SERIAL_STATE_BREAK                      0x0004    /* the rest are one shot events */
+#define CDC_SERIAL_STATE_RING                       0x0008
+#define CDC_SERIAL_STATE_FRAMING                    0x0010
+#define CDC_SERIAL_STATE_PARITY                     0x0020
+#define CDC_SERIAL_STATE_OVERRUN                    0x0040
+
 #define USB_INTERFACE_ASSOCIATION_DESCSIZE          8
 #define USB_INTERFACE_ASSOCIATION_DESCRIPTOR        11
 #define USB_CLASS_CDC                               2
@@ -68,8 +118,12 @@
 typedef enum
 {
   USBD_CDC_Instance_0,
+#if (USBD_CDC_NUM_PORTS >= 2)
   USBD_CDC_Instance_1,
-  //USBD_CDC_Instance_2,
+#endif
+#if (USBD_CDC_NUM_PORTS == 3)
+  USBD_CDC_Instance_2,
+#endif
   USBD_CDC_Instance_MAX,
 } USBD_CDC_Instance;
 
@@ -87,6 +141,8 @@ typedef struct _USBD_CDC_Itf
   int8_t (* DeInit)        (void);
   int8_t (* Control)       (uint8_t, uint8_t * , uint16_t, USBD_CDC_Instance instance);   
   int8_t (* Receive)       (uint8_t *, uint32_t *, USBD_CDC_Instance instance);  
+  int8_t (* TransmitCplt)  (uint8_t *, uint32_t *, USBD_CDC_Instance instance);
+  int8_t (* SOF)           (void);    /* once per frame, while asked for with USBD_CDC_SetSOF */
 
 }USBD_CDC_ItfTypeDef;
 
@@ -101,9 +157,25 @@ typedef struct
   uint8_t  *TxBuffer[USBD_CDC_Instance_MAX];   
   uint32_t RxLength[USBD_CDC_Instance_MAX];
   uint32_t TxLength[USBD_CDC_Instance_MAX];   
+  uint32_t RxSize[USBD_CDC_Instance_MAX];           /* OUT transfer length RxBuffer takes. multiple of packet size */
   
   __IO uint32_t TxState[USBD_CDC_Instance_MAX];     
+  __IO uint32_t TxZLP[USBD_CDC_Instance_MAX];       /* transfer ended on a full packet. ZLP pending */
   __IO uint32_t RxState[USBD_CDC_Instance_MAX];    
+
+  /* SERIAL_STATE on the interrupt EP. a state raised while one is still
+   * in flight is merged into NotifyPending and follows it */
+  uint8_t  Notify[USBD_CDC_Instance_MAX][CDC_SERIAL_STATE_SIZE];
+  __IO uint32_t NotifyState[USBD_CDC_Instance_MAX];
+  __IO uint32_t NotifyQueued[USBD_CDC_Instance_MAX];
+  uint16_t NotifyPending[USBD_CDC_Instance_MAX];
+
+#if (USBD_CDC_OUT_DBL_BUF == 1)
+  /* catches the one packet a double buffered OUT EP can still take after
+   * the interface stopped handing out buffers */
+  uint32_t RxSpill[USBD_CDC_Instance_MAX][CDC_DATA_FS_OUT_PACKET_SIZE/4];
+  uint32_t RxSpillLength[USBD_CDC_Instance_MAX];
+#endif
 }
 USBD_CDC_HandleTypeDef; 
 
@@ -112,9 +184,11 @@ extern USBD_ClassTypeDef  USBD_CDC;
 
 uint8_t  USBD_CDC_RegisterInterface  (USBD_HandleTypeDef   *pdev, USBD_CDC_ItfTypeDef *fops);
 uint8_t  USBD_CDC_SetTxBuffer        (USBD_HandleTypeDef   *pdev, uint8_t  *pbuff, uint16_t length, USBD_CDC_Instance instance);
-uint8_t  USBD_CDC_SetRxBuffer        (USBD_HandleTypeDef   *pdev, uint8_t  *pbuff, USBD_CDC_Instance instance); 
+uint8_t  USBD_CDC_SetRxBuffer        (USBD_HandleTypeDef   *pdev, uint8_t  *pbuff, uint32_t size, USBD_CDC_Instance instance);
 uint8_t  USBD_CDC_ReceivePacket      (USBD_HandleTypeDef *pdev, USBD_CDC_Instance instance);
 uint8_t  USBD_CDC_TransmitPacket     (USBD_HandleTypeDef *pdev, USBD_CDC_Instance instance);
+uint8_t  USBD_CDC_SerialState        (USBD_HandleTypeDef *pdev, uint16_t state, USBD_CDC_Instance instance);
+uint8_t  USBD_CDC_SetSOF             (USBD_HandleTypeDef *pdev, uint8_t enable);
 
 #ifdef __cplusplus
 }
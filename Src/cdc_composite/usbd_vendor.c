@@ -0,0 +1,170 @@
+/* Includes ------------------------------------------------------------------*/
+#include "usbd_vendor.h"
+#include "usbd_ctlreq.h"
+
+#if (USBD_VENDOR_BULK == 1)
+
+/*
+ * single vendor interface. pClassData belongs to the CDC class, so the
+ * handle lives here.
+ */
+static USBD_Vendor_HandleTypeDef   _vendor;
+
+static inline uint16_t
+vendor_mps(USBD_HandleTypeDef *pdev)
+{
+  return (pdev->dev_speed == USBD_SPEED_HIGH) ? VENDOR_HS_MAX_PACKET_SIZE :
+                                                VENDOR_FS_MAX_PACKET_SIZE;
+}
+
+/**
+  * @brief  USBD_Vendor_Init
+  *         open the bulk pair and let the interface arm its first OUT
+  * @param  pdev: device instance
+  * @retval None
+  */
+void
+USBD_Vendor_Init (USBD_HandleTypeDef *pdev)
+{
+  USBD_LL_OpenEP(pdev, VENDOR_IN_EP, USBD_EP_TYPE_BULK, vendor_mps(pdev));
+  USBD_LL_OpenEP(pdev, VENDOR_OUT_EP, USBD_EP_TYPE_BULK, vendor_mps(pdev));
+
+  _vendor.TxState = 0;
+  _vendor.TxZLP   = 0;
+  _vendor.RxState = 0;
+
+  if(_vendor.fops != NULL)
+  {
+    _vendor.fops->Init();
+  }
+}
+
+/**
+  * @brief  USBD_Vendor_DeInit
+  *         close the bulk pair
+  * @param  pdev: device instance
+  * @retval None
+  */
+void
+USBD_Vendor_DeInit (USBD_HandleTypeDef *pdev)
+{
+  USBD_LL_CloseEP(pdev, VENDOR_IN_EP);
+  USBD_LL_CloseEP(pdev, VENDOR_OUT_EP);
+
+  if(_vendor.fops != NULL)
+  {
+    _vendor.fops->DeInit();
+  }
+}
+
+/**
+  * @brief  USBD_Vendor_DataIn
+  *         IN transfer done. terminate it with a ZLP if it ended on a full
+  *         packet, otherwise hand the buffer back to the interface
+  * @param  pdev: device instance
+  * @retval None
+  */
+void
+USBD_Vendor_DataIn (USBD_HandleTypeDef *pdev)
+{
+  if(_vendor.TxZLP)
+  {
+    _vendor.TxZLP = 0;
+    USBD_LL_Transmit(pdev, VENDOR_IN_EP, NULL, 0);
+    return;
+  }
+
+  _vendor.TxState = 0;
+
+  if(_vendor.fops != NULL)
+  {
+    _vendor.fops->TransmitCplt(_vendor.TxBuffer, _vendor.TxLength);
+  }
+}
+
+/**
+  * @brief  USBD_Vendor_DataOut
+  *         OUT transfer done. EP stays NAKed until the interface arms
+  *         the next one with USBD_Vendor_Receive
+  * @param  pdev: device instance
+  * @retval None
+  */
+void
+USBD_Vendor_DataOut (USBD_HandleTypeDef *pdev)
+{
+  _vendor.RxState = 0;
+
+  if(_vendor.fops != NULL)
+  {
+    _vendor.fops->Receive(_vendor.RxBuffer, USBD_LL_GetRxDataSize(pdev, VENDOR_OUT_EP));
+  }
+}
+
+/**
+  * @brief  USBD_Vendor_RegisterInterface
+  * @param  pdev: device instance
+  * @param  fops: vendor interface callback
+  * @retval status
+  */
+uint8_t
+USBD_Vendor_RegisterInterface (USBD_HandleTypeDef *pdev, USBD_Vendor_ItfTypeDef *fops)
+{
+  if(fops == NULL)
+  {
+    return USBD_FAIL;
+  }
+  _vendor.fops = fops;
+  return USBD_OK;
+}
+
+/**
+  * @brief  USBD_Vendor_Transmit
+  *         start an IN transfer of any length. the buffer is owned by the
+  *         endpoint until TransmitCplt
+  * @param  pdev: device instance
+  * @param  pbuff: Tx Buffer
+  * @param  length: transfer length
+  * @retval status
+  */
+uint8_t
+USBD_Vendor_Transmit (USBD_HandleTypeDef *pdev, uint8_t *pbuff, uint32_t length)
+{
+  if(_vendor.TxState != 0)
+  {
+    return USBD_BUSY;
+  }
+
+  _vendor.TxState   = 1;
+  _vendor.TxBuffer  = pbuff;
+  _vendor.TxLength  = length;
+  _vendor.TxZLP     = (length != 0) && ((length % vendor_mps(pdev)) == 0);
+
+  USBD_LL_Transmit(pdev, VENDOR_IN_EP, pbuff, length);
+  return USBD_OK;
+}
+
+/**
+  * @brief  USBD_Vendor_Receive
+  *         arm an OUT transfer of up to size bytes. it completes on a short
+  *         packet or when size is reached
+  * @param  pdev: device instance
+  * @param  pbuff: Rx Buffer
+  * @param  size: buffer size. multiple of the packet size
+  * @retval status
+  */
+uint8_t
+USBD_Vendor_Receive (USBD_HandleTypeDef *pdev, uint8_t *pbuff, uint32_t size)
+{
+  if(_vendor.RxState != 0)
+  {
+    return USBD_BUSY;
+  }
+
+  _vendor.RxState   = 1;
+  _vendor.RxBuffer  = pbuff;
+
+  USBD_LL_PrepareReceive(pdev, VENDOR_OUT_EP, pbuff, size);
+  return USBD_OK;
+}
+
+#endif /* USBD_VENDOR_BULK */
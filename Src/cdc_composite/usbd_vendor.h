@@ -0,0 +1,94 @@
+#ifndef __USB_VENDOR_H
+#define __USB_VENDOR_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include  "usbd_ioreq.h"
+
+/*
+ * vendor specific interface with a raw bulk pair (USBD_VENDOR_BULK).
+ * it follows the CDC functions in the composite configuration and is
+ * served by the CDC class, which hands its endpoints and descriptor
+ * over to this module. there is no ACM semantics on it at all, host
+ * talks to it through libusb or WinUSB.
+ */
+#define VENDOR_INTERFACE_NO                         (USBD_CDC_NUM_PORTS * 2)
+#define VENDOR_EP_NUM                               (1 + USBD_CDC_NUM_PORTS * 2)
+#define VENDOR_IN_EP                                (0x80 | VENDOR_EP_NUM)
+#define VENDOR_OUT_EP                               VENDOR_EP_NUM
+
+#define VENDOR_HS_MAX_PACKET_SIZE                   512
+#define VENDOR_FS_MAX_PACKET_SIZE                   64
+
+#define USB_CLASS_VENDOR_SPECIFIC                   0xFF
+
+#define USB_VENDOR_DESC_SIZE                        23    /* interface + 2 bulk endpoints */
+
+/* vendor interface descriptor, appended to the configuration descriptor */
+#define USBD_VENDOR_DESC(bulk_mps)                                              \
+  0x09,                                   /* bLength: Interface Descriptor size */ \
+  USB_DESC_TYPE_INTERFACE,                /* bDescriptorType: Interface         */ \
+  VENDOR_INTERFACE_NO,                    /* bInterfaceNumber                   */ \
+  0x00,                                   /* bAlternateSetting                  */ \
+  0x02,                                   /* bNumEndpoints                      */ \
+  USB_CLASS_VENDOR_SPECIFIC,              /* bInterfaceClass                    */ \
+  0x00,                                   /* bInterfaceSubClass                 */ \
+  0x00,                                   /* bInterfaceProtocol                 */ \
+  0x00,                                   /* iInterface                         */ \
+                                                                                \
+  /* Endpoint OUT Descriptor */                                                 \
+  0x07,                                   /* bLength: Endpoint Descriptor size  */ \
+  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint          */ \
+  VENDOR_OUT_EP,                          /* bEndpointAddress                   */ \
+  0x02,                                   /* bmAttributes: Bulk                 */ \
+  LOBYTE(bulk_mps),                       /* wMaxPacketSize:                    */ \
+  HIBYTE(bulk_mps),                                                             \
+  0x00,                                   /* bInterval: ignore for Bulk transfer */ \
+                                                                                \
+  /* Endpoint IN Descriptor */                                                  \
+  0x07,                                   /* bLength: Endpoint Descriptor size  */ \
+  USB_DESC_TYPE_ENDPOINT,                 /* bDescriptorType: Endpoint          */ \
+  VENDOR_IN_EP,                           /* bEndpointAddress                   */ \
+  0x02,                                   /* bmAttributes: Bulk                 */ \
+  LOBYTE(bulk_mps),                       /* wMaxPacketSize:                    */ \
+  HIBYTE(bulk_mps),                                                             \
+  0x00                                    /* bInterval: ignore for Bulk transfer */
+
+typedef struct _USBD_Vendor_Itf
+{
+  int8_t (* Init)          (void);
+  int8_t (* DeInit)        (void);
+  int8_t (* Receive)       (uint8_t *, uint32_t);
+  int8_t (* TransmitCplt)  (uint8_t *, uint32_t);
+}USBD_Vendor_ItfTypeDef;
+
+typedef struct
+{
+  USBD_Vendor_ItfTypeDef  *fops;
+  uint8_t                 *RxBuffer;
+  uint8_t                 *TxBuffer;
+  uint32_t                TxLength;
+  __IO uint32_t           TxState;
+  __IO uint32_t           TxZLP;      /* transfer ended on a full packet. ZLP pending */
+  __IO uint32_t           RxState;    /* OUT EP armed                                  */
+}
+USBD_Vendor_HandleTypeDef;
+
+/* called by the CDC class */
+void     USBD_Vendor_Init            (USBD_HandleTypeDef *pdev);
+void     USBD_Vendor_DeInit          (USBD_HandleTypeDef *pdev);
+void     USBD_Vendor_DataIn          (USBD_HandleTypeDef *pdev);
+void     USBD_Vendor_DataOut         (USBD_HandleTypeDef *pdev);
+
+uint8_t  USBD_Vendor_RegisterInterface  (USBD_HandleTypeDef *pdev, USBD_Vendor_ItfTypeDef *fops);
+uint8_t  USBD_Vendor_Transmit           (USBD_HandleTypeDef *pdev, uint8_t *pbuff, uint32_t length);
+uint8_t  USBD_Vendor_Receive            (USBD_HandleTypeDef *pdev, uint8_t *pbuff, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __USB_VENDOR_H */
@@ -0,0 +1,248 @@
+#include "cdc_uart.h"
+#include "usart.h"
+
+//
+// what both front ends do to their USARTs. the state around it, rings,
+// queues and events, stays with the front end. the callers mask
+// interrupts or hold the port's as the functions below say.
+//
+
+void
+cdc_uart_line_coding(const USBD_CDC_LineCodingTypeDef* lc, UART_InitTypeDef* init)
+{
+  switch (lc->format)
+  {
+    case 2:
+      init->StopBits = UART_STOPBITS_2;
+      break;
+    default :
+      init->StopBits = UART_STOPBITS_1;
+      break;
+  }
+
+  switch (lc->paritytype)
+  {
+    case 1:
+      init->Parity = UART_PARITY_ODD;
+      break;
+    case 2:
+      init->Parity = UART_PARITY_EVEN;
+      break;
+    default :
+      init->Parity = UART_PARITY_NONE;
+      break;
+  }
+
+  /* only 8 data bits, with the parity bit on top if there is one */
+  if(lc->datatype == 0x08 && init->Parity != UART_PARITY_NONE)
+  {
+    init->WordLength = UART_WORDLENGTH_9B;
+  }
+  else
+  {
+    init->WordLength = UART_WORDLENGTH_8B;
+  }
+
+  init->BaudRate = lc->bitrate;
+}
+
+//
+// a line coding request, in the USB interrupt. a port not set up yet
+// takes lc as it is then, a later request replaces a pending one
+//
+void
+cdc_uart_request(cdc_uart_setup_t* s, UART_HandleTypeDef* huart,
+                 const USBD_CDC_LineCodingTypeDef* lc)
+{
+  UART_InitTypeDef  init = huart->Init;
+  uint8_t           change;
+
+  if(!cdc_uart_up(s))
+  {
+    return;
+  }
+
+  cdc_uart_line_coding(lc, &init);
+
+  if(init.StopBits != huart->Init.StopBits ||
+     init.Parity != huart->Init.Parity ||
+     init.WordLength != huart->Init.WordLength)
+  {
+    change = CDC_UART_SETUP_FULL;
+  }
+  else if(init.BaudRate != huart->Init.BaudRate)
+  {
+    change = CDC_UART_SETUP_BAUD;
+  }
+  else
+  {
+    change = CDC_UART_SETUP_NONE;
+  }
+
+  if(change != CDC_UART_SETUP_NONE && s->pending == CDC_UART_SETUP_NONE)
+  {
+    s->tick = HAL_GetTick();
+  }
+  s->pending = change;
+}
+
+//
+// a DMA channel has stopped. re-initialized at the next poll, without
+// waiting for the drain
+//
+void
+cdc_uart_restart(cdc_uart_setup_t* s)
+{
+  s->pending = CDC_UART_SETUP_FULL;
+  s->tick = HAL_GetTick() - CDC_UART_DRAIN_MS;
+}
+
+//
+// one poll of a pending setup, with interrupts masked. tx_idle is UART TX
+// DMA between chunks, drained the RX ring gone to host and in_idle no IN
+// transfer reading from the ring. returns what is left for the caller to
+// do unmasked: FULL or OPEN set the UART up, CLOSE de-initializes it.
+// before FULL and CLOSE the caller takes back the TX DMA chunk in flight.
+//
+uint8_t
+cdc_uart_step(cdc_uart_setup_t* s, UART_HandleTypeDef* huart, uint32_t bitrate,
+              uint8_t tx_idle, uint8_t drained, uint8_t in_idle)
+{
+  uint8_t expired = (HAL_GetTick() - s->tick) >= CDC_UART_DRAIN_MS;
+  uint8_t setup = CDC_UART_SETUP_NONE;
+
+  switch(s->pending)
+  {
+  case CDC_UART_SETUP_BAUD:
+    /* between chunks nothing is left on the wire at the old rate */
+    if(tx_idle || expired)
+    {
+      s->pending = CDC_UART_SETUP_NONE;
+      usart_set_baudrate(huart, bitrate);
+    }
+    break;
+
+  case CDC_UART_SETUP_FULL:
+    if((tx_idle && drained) || expired)
+    {
+      s->pending = CDC_UART_SETUP_SWITCH;
+    }
+    break;
+
+  case CDC_UART_SETUP_OPEN:
+    s->pending = CDC_UART_SETUP_NONE;
+    setup = CDC_UART_SETUP_OPEN;
+    break;
+
+  case CDC_UART_SETUP_CLOSE:
+    s->pending = CDC_UART_SETUP_NONE;
+    setup = CDC_UART_SETUP_CLOSE;
+    break;
+
+  default:
+    break;
+  }
+
+  /* host may still be reading the ring packet by packet till then */
+  if(s->pending == CDC_UART_SETUP_SWITCH && in_idle)
+  {
+    s->pending = CDC_UART_SETUP_NONE;
+    setup = CDC_UART_SETUP_FULL;
+  }
+
+  return setup;
+}
+
+//
+// UART set up again from lc, with the USB interrupt and the port's own
+// held. RX is left to cdc_uart_rx_start()
+//
+void
+cdc_uart_config(UART_HandleTypeDef* huart, const USBD_CDC_LineCodingTypeDef* lc)
+{
+  if(HAL_UART_DeInit(huart) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  cdc_uart_line_coding(lc, &huart->Init);
+  huart->Init.HwFlowCtl  = UART_HWCONTROL_NONE;
+  huart->Init.Mode       = UART_MODE_TX_RX;
+
+  if(HAL_UART_Init(huart) != HAL_OK)
+  {
+    Error_Handler();
+  }
+}
+
+//
+// the whole ring is handed to a circular DMA channel. new data is
+// published on DMA half/full transfer and on USART IDLE, so there is no
+// per-byte interrupt. parity, framing, noise and overrun go to
+// HAL_UART_ErrorCallback
+//
+void
+cdc_uart_rx_start(UART_HandleTypeDef* huart, uint8_t* ring, uint16_t size)
+{
+  HAL_UART_Receive_DMA(huart, ring, size);
+  __HAL_UART_CLEAR_IDLEFLAG(huart);
+  __HAL_UART_ENABLE_IT(huart, UART_IT_IDLE);
+  __HAL_UART_ENABLE_IT(huart, UART_IT_PE);
+  __HAL_UART_ENABLE_IT(huart, UART_IT_ERR);
+}
+
+//
+// HAL_UART_ErrorCallback's count of code, huart->ErrorCode as it was.
+// returns the SERIAL_STATE bits for it. tx_busy is UART TX DMA running
+//
+uint16_t
+cdc_uart_error(UART_HandleTypeDef* huart, uint32_t code, cdc_uart_err_t* err,
+               uint8_t tx_busy)
+{
+  uint16_t  state = 0;
+
+  /* HAL never clears it and would report it again on every interrupt */
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+
+  if(code & HAL_UART_ERROR_ORE)
+  {
+    err->overrun++;
+    state |= CDC_SERIAL_STATE_OVERRUN;
+  }
+  if(code & HAL_UART_ERROR_PE)
+  {
+    err->parity++;
+    state |= CDC_SERIAL_STATE_PARITY;
+  }
+  if(code & HAL_UART_ERROR_FE)
+  {
+    /* a break is an all zero frame, parity included, with no stop bit */
+    if((huart->Instance->DR & 0x1ff) == 0)
+    {
+      err->breaks++;
+      state = (state & ~CDC_SERIAL_STATE_PARITY) | CDC_SERIAL_STATE_BREAK;
+    }
+    else
+    {
+      err->framing++;
+      state |= CDC_SERIAL_STATE_FRAMING;
+    }
+  }
+  if(code & HAL_UART_ERROR_NE)
+  {
+    err->noise++;
+  }
+
+  if(code & HAL_UART_ERROR_DMA)
+  {
+    err->dma++;
+    state |= CDC_SERIAL_STATE_OVERRUN;
+  }
+  else
+  {
+    /* HAL has dropped the handle to READY. both DMA are still going though */
+    huart->State = tx_busy ? HAL_UART_STATE_BUSY_TX_RX : HAL_UART_STATE_BUSY_RX;
+  }
+
+  return state;
+}
@@ -1,4 +1,5 @@
 #include "dma.h"
+#include "irq.h"
 /** 
   * Enable DMA controller clock
   */
@@ -10,15 +11,27 @@ MX_DMA_Init(void)
 
   /* DMA interrupt init */
   /* DMA1_Channel2_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, IRQ_PRIO_UART, 0);
   HAL_NVIC_EnableIRQ(DMA1_Channel2_IRQn);
 
+  /* DMA1_Channel3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel3_IRQn, IRQ_PRIO_UART, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel3_IRQn);
+
   /* DMA1_Channel4_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, IRQ_PRIO_UART, 0);
   HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
 
+  /* DMA1_Channel5_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, IRQ_PRIO_UART, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+
+  /* DMA1_Channel6_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel6_IRQn, IRQ_PRIO_UART, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel6_IRQn);
+
   /* DMA1_Channel7_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(DMA1_Channel7_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(DMA1_Channel7_IRQn, IRQ_PRIO_UART, 0);
   HAL_NVIC_EnableIRQ(DMA1_Channel7_IRQn);
 
 }
@@ -1,4 +1,50 @@
 #include "gpio.h"
+#include "usbd_conf.h"
+#include "irq.h"
+
+typedef struct
+{
+  GPIO_TypeDef*   port;
+  uint16_t        pin;
+} cdc_line_pin_t;
+
+/* only the lines of ports that exist are set up. PB6/PB7 and PA6 of the
+   third port stay free for other uses in a one or two port build */
+#define CDC_LINE_PORTS    USBD_CDC_NUM_PORTS
+
+static const cdc_line_pin_t _cdc_dtr[CDC_LINE_PORTS] =
+{
+  { CDC0_DTR_GPIO_Port, CDC0_DTR_Pin },
+#if (USBD_CDC_NUM_PORTS >= 2)
+  { CDC1_DTR_GPIO_Port, CDC1_DTR_Pin },
+#endif
+#if (USBD_CDC_NUM_PORTS == 3)
+  { CDC2_DTR_GPIO_Port, CDC2_DTR_Pin },
+#endif
+};
+
+static const cdc_line_pin_t _cdc_rts[CDC_LINE_PORTS] =
+{
+  { CDC0_RTS_GPIO_Port, CDC0_RTS_Pin },
+#if (USBD_CDC_NUM_PORTS >= 2)
+  { CDC1_RTS_GPIO_Port, CDC1_RTS_Pin },
+#endif
+#if (USBD_CDC_NUM_PORTS == 3)
+  { CDC2_RTS_GPIO_Port, CDC2_RTS_Pin },
+#endif
+};
+
+static const cdc_line_pin_t _cdc_cts[CDC_LINE_PORTS] =
+{
+  { CDC0_CTS_GPIO_Port, CDC0_CTS_Pin },
+#if (USBD_CDC_NUM_PORTS >= 2)
+  { CDC1_CTS_GPIO_Port, CDC1_CTS_Pin },
+#endif
+#if (USBD_CDC_NUM_PORTS == 3)
+  { CDC2_CTS_GPIO_Port, CDC2_CTS_Pin },
+#endif
+};
+
 /** Configure pins as 
         * Analog 
         * Input 
@@ -11,6 +57,7 @@ MX_GPIO_Init(void)
 {
 
   GPIO_InitTypeDef GPIO_InitStruct;
+  uint8_t          port;
 
   /* GPIO Ports Clock Enable */
   __HAL_RCC_GPIOC_CLK_ENABLE();
@@ -27,4 +74,96 @@ MX_GPIO_Init(void)
   GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
   HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
 
+  /* CDC DTR/RTS outputs, de-asserted */
+  for(port = 0; port < CDC_LINE_PORTS; port++)
+  {
+    HAL_GPIO_WritePin(_cdc_dtr[port].port, _cdc_dtr[port].pin, GPIO_PIN_SET);
+    HAL_GPIO_WritePin(_cdc_rts[port].port, _cdc_rts[port].pin, GPIO_PIN_SET);
+
+    GPIO_InitStruct.Pin = _cdc_dtr[port].pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(_cdc_dtr[port].port, &GPIO_InitStruct);
+
+    GPIO_InitStruct.Pin = _cdc_rts[port].pin;
+    HAL_GPIO_Init(_cdc_rts[port].port, &GPIO_InitStruct);
+
+    /* CTS pulled up, so an open input holds transmission off */
+    GPIO_InitStruct.Pin = _cdc_cts[port].pin;
+    if((USBD_CDC_FLOW_CTRL >> port) & 0x01)
+    {
+      GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING_FALLING;
+    }
+    else
+    {
+      GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+    }
+    GPIO_InitStruct.Pull = GPIO_PULLUP;
+    HAL_GPIO_Init(_cdc_cts[port].port, &GPIO_InitStruct);
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+  }
+
+#if (USBD_CDC_FLOW_CTRL != 0)
+  /* EXTI interrupt init*/
+  HAL_NVIC_SetPriority(EXTI4_IRQn, IRQ_PRIO_UART, 0);
+  HAL_NVIC_EnableIRQ(EXTI4_IRQn);
+
+  HAL_NVIC_SetPriority(EXTI9_5_IRQn, IRQ_PRIO_UART, 0);
+  HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
+#endif
+}
+
+//
+// called from the USB interrupt while SET_CONTROL_LINE_STATE is decoded.
+// a single BSRR store per line, so both edges are down within a few
+// instructions of each other. BSRR sets with the low half and resets
+// with the high half.
+//
+void
+gpio_cdc_control_lines(uint8_t port, uint8_t dtr, uint8_t rts)
+{
+  if(port >= CDC_LINE_PORTS)
+  {
+    return;
+  }
+
+  _cdc_dtr[port].port->BSRR = dtr ? ((uint32_t)_cdc_dtr[port].pin << 16) : _cdc_dtr[port].pin;
+  _cdc_rts[port].port->BSRR = rts ? ((uint32_t)_cdc_rts[port].pin << 16) : _cdc_rts[port].pin;
+}
+
+void
+gpio_cdc_rts(uint8_t port, uint8_t rts)
+{
+  if(port >= CDC_LINE_PORTS)
+  {
+    return;
+  }
+  _cdc_rts[port].port->BSRR = rts ? ((uint32_t)_cdc_rts[port].pin << 16) : _cdc_rts[port].pin;
+}
+
+/* 1 when the far end is ready to take data */
+uint8_t
+gpio_cdc_cts(uint8_t port)
+{
+  if(port >= CDC_LINE_PORTS)
+  {
+    return 1;
+  }
+  return (_cdc_cts[port].port->IDR & _cdc_cts[port].pin) == 0;
+}
+
+/* port of the CTS input on an EXTI pin. CDC_LINE_PORTS if there is none */
+uint8_t
+gpio_cdc_cts_port(uint16_t pin)
+{
+  uint8_t port;
+
+  for(port = 0; port < CDC_LINE_PORTS; port++)
+  {
+    if(_cdc_cts[port].pin == pin)
+    {
+      break;
+    }
+  }
+  return port;
 }
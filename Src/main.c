@@ -4,19 +4,36 @@
 #include "tim.h"
 #include "usart.h"
 #include "usb_device.h"
+#include "usbd_cdc_if.h"
 #include "gpio.h"
+#include "work.h"
+#include "irq.h"
 
 void SystemClock_Config(void);
 
+static void
+led_toggle(void)
+{
+  HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_13);
+  work_post_in(WORK_LED, 100);
+}
+
 int
 main(void)
 {
-  uint32_t  tick_start;
-
   HAL_Init();
 
   SystemClock_Config();
 
+#if (IRQ_PROFILE == 1)
+  irq_prof_init();
+#endif
+
+  /* interrupt handlers post work as soon as the peripherals are up */
+  work_init();
+  work_set(WORK_CDC_POLL, usbd_cdc_if_poll);
+  work_set(WORK_LED, led_toggle);
+
   MX_GPIO_Init();
   MX_DMA_Init();
 
@@ -27,15 +44,12 @@ main(void)
   MX_USB_DEVICE_Init();
   MX_TIM1_Init();
 
-  tick_start = HAL_GetTick();
+  work_post(WORK_LED);
 
+  /* everything runs from interrupts and PendSV */
   while (1)
   {
-    if((HAL_GetTick() - tick_start) >= 100)
-    {
-      tick_start = HAL_GetTick();
-      HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_13);
-    }
+    work_idle();
   }
 }
 
@@ -93,7 +107,7 @@ SystemClock_Config(void)
   HAL_SYSTICK_CLKSourceConfig(SYSTICK_CLKSOURCE_HCLK);
 
   /* SysTick_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(SysTick_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(SysTick_IRQn, IRQ_PRIO_TICK, 0);
 }
 
 /**
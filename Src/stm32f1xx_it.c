@@ -1,6 +1,9 @@
 #include "stm32f1xx_hal.h"
 #include "stm32f1xx.h"
 #include "stm32f1xx_it.h"
+#include "usbd_cdc_if.h"
+#include "work.h"
+#include "irq.h"
 
 /* External variables --------------------------------------------------------*/
 extern PCD_HandleTypeDef hpcd_USB_FS;
@@ -8,10 +11,26 @@ extern TIM_HandleTypeDef htim1;
 extern DMA_HandleTypeDef hdma_usart1_tx;
 extern DMA_HandleTypeDef hdma_usart2_tx;
 extern DMA_HandleTypeDef hdma_usart3_tx;
+extern DMA_HandleTypeDef hdma_usart1_rx;
+extern DMA_HandleTypeDef hdma_usart2_rx;
+extern DMA_HandleTypeDef hdma_usart3_rx;
 extern UART_HandleTypeDef huart1;
 extern UART_HandleTypeDef huart2;
 extern UART_HandleTypeDef huart3;
 
+#if (IRQ_PROFILE == 1)
+irq_prof_t irq_prof[IRQ_PROF_MAX];
+
+/* DWT cycle counter. stops in sleep, which is idle time anyway */
+void
+irq_prof_init(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+#endif
+
 /******************************************************************************/
 /*            Cortex-M3 Processor Interruption and Exception Handlers         */ 
 /******************************************************************************/
@@ -82,6 +101,9 @@ void DebugMon_Handler(void)
 */
 void PendSV_Handler(void)
 {
+  IRQ_PROF_ENTER();
+  work_run();
+  IRQ_PROF_EXIT(IRQ_PROF_PENDSV);
 }
 
 /**
@@ -89,8 +111,10 @@ void PendSV_Handler(void)
 */
 void SysTick_Handler(void)
 {
+  IRQ_PROF_ENTER();
   HAL_IncTick();
   HAL_SYSTICK_IRQHandler();
+  IRQ_PROF_EXIT(IRQ_PROF_SYSTICK);
 }
 
 /******************************************************************************/
@@ -100,12 +124,34 @@ void SysTick_Handler(void)
 /* please refer to the startup file (startup_stm32f1xx.s).                    */
 /******************************************************************************/
 
+/**
+* @brief This function handles EXTI line4 interrupt.
+*/
+void EXTI4_IRQHandler(void)
+{
+  IRQ_PROF_ENTER();
+  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_4);
+  IRQ_PROF_EXIT(IRQ_PROF_EXTI4);
+}
+
 /**
 * @brief This function handles DMA1 channel2 global interrupt.
 */
 void DMA1_Channel2_IRQHandler(void)
 {
+  IRQ_PROF_ENTER();
   HAL_DMA_IRQHandler(&hdma_usart3_tx);
+  IRQ_PROF_EXIT(IRQ_PROF_DMA1_CH2);
+}
+
+/**
+* @brief This function handles DMA1 channel3 global interrupt.
+*/
+void DMA1_Channel3_IRQHandler(void)
+{
+  IRQ_PROF_ENTER();
+  HAL_DMA_IRQHandler(&hdma_usart3_rx);
+  IRQ_PROF_EXIT(IRQ_PROF_DMA1_CH3);
 }
 
 /**
@@ -113,7 +159,29 @@ void DMA1_Channel2_IRQHandler(void)
 */
 void DMA1_Channel4_IRQHandler(void)
 {
+  IRQ_PROF_ENTER();
   HAL_DMA_IRQHandler(&hdma_usart1_tx);
+  IRQ_PROF_EXIT(IRQ_PROF_DMA1_CH4);
+}
+
+/**
+* @brief This function handles DMA1 channel5 global interrupt.
+*/
+void DMA1_Channel5_IRQHandler(void)
+{
+  IRQ_PROF_ENTER();
+  HAL_DMA_IRQHandler(&hdma_usart1_rx);
+  IRQ_PROF_EXIT(IRQ_PROF_DMA1_CH5);
+}
+
+/**
+* @brief This function handles DMA1 channel6 global interrupt.
+*/
+void DMA1_Channel6_IRQHandler(void)
+{
+  IRQ_PROF_ENTER();
+  HAL_DMA_IRQHandler(&hdma_usart2_rx);
+  IRQ_PROF_EXIT(IRQ_PROF_DMA1_CH6);
 }
 
 /**
@@ -121,7 +189,9 @@ void DMA1_Channel4_IRQHandler(void)
 */
 void DMA1_Channel7_IRQHandler(void)
 {
+  IRQ_PROF_ENTER();
   HAL_DMA_IRQHandler(&hdma_usart2_tx);
+  IRQ_PROF_EXIT(IRQ_PROF_DMA1_CH7);
 }
 
 /**
@@ -129,7 +199,22 @@ void DMA1_Channel7_IRQHandler(void)
 */
 void USB_LP_CAN1_RX0_IRQHandler(void)
 {
+  IRQ_PROF_ENTER();
+  /* UART events first. what they queue goes out with this interrupt */
+  usbd_cdc_if_usb_irq();
   HAL_PCD_IRQHandler(&hpcd_USB_FS);
+  IRQ_PROF_EXIT(IRQ_PROF_USB);
+}
+
+/**
+* @brief This function handles EXTI line[9:5] interrupts.
+*/
+void EXTI9_5_IRQHandler(void)
+{
+  IRQ_PROF_ENTER();
+  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_5);
+  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_6);
+  IRQ_PROF_EXIT(IRQ_PROF_EXTI9_5);
 }
 
 /**
@@ -137,7 +222,9 @@ void USB_LP_CAN1_RX0_IRQHandler(void)
 */
 void TIM1_UP_IRQHandler(void)
 {
+  IRQ_PROF_ENTER();
   HAL_TIM_IRQHandler(&htim1);
+  IRQ_PROF_EXIT(IRQ_PROF_TIM1);
 }
 
 /**
@@ -145,7 +232,10 @@ void TIM1_UP_IRQHandler(void)
 */
 void USART1_IRQHandler(void)
 {
+  IRQ_PROF_ENTER();
+  usbd_cdc_if_uart_irq(&huart1);
   HAL_UART_IRQHandler(&huart1);
+  IRQ_PROF_EXIT(IRQ_PROF_USART1);
 }
 
 /**
@@ -153,7 +243,10 @@ void USART1_IRQHandler(void)
 */
 void USART2_IRQHandler(void)
 {
+  IRQ_PROF_ENTER();
+  usbd_cdc_if_uart_irq(&huart2);
   HAL_UART_IRQHandler(&huart2);
+  IRQ_PROF_EXIT(IRQ_PROF_USART2);
 }
 
 /**
@@ -161,5 +254,10 @@ void USART2_IRQHandler(void)
 */
 void USART3_IRQHandler(void)
 {
+  IRQ_PROF_ENTER();
+#if (USBD_CDC_NUM_PORTS == 3) || (USBD_CDC_MUX == 1)
+  usbd_cdc_if_uart_irq(&huart3);
+#endif
   HAL_UART_IRQHandler(&huart3);
+  IRQ_PROF_EXIT(IRQ_PROF_USART3);
 }
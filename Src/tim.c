@@ -1,4 +1,5 @@
 #include "tim.h"
+#include "irq.h"
 
 TIM_HandleTypeDef htim1;
 
@@ -45,7 +46,7 @@ HAL_TIM_Base_MspInit(TIM_HandleTypeDef* tim_baseHandle)
   {
     __HAL_RCC_TIM1_CLK_ENABLE();
 
-    HAL_NVIC_SetPriority(TIM1_UP_IRQn, 0, 0);
+    HAL_NVIC_SetPriority(TIM1_UP_IRQn, IRQ_PRIO_TICK, 0);
     HAL_NVIC_EnableIRQ(TIM1_UP_IRQn);
   }
 }
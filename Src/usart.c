@@ -2,6 +2,7 @@
 
 #include "gpio.h"
 #include "dma.h"
+#include "irq.h"
 
 UART_HandleTypeDef huart1;
 UART_HandleTypeDef huart2;
@@ -9,6 +10,11 @@ UART_HandleTypeDef huart3;
 DMA_HandleTypeDef hdma_usart1_tx;
 DMA_HandleTypeDef hdma_usart2_tx;
 DMA_HandleTypeDef hdma_usart3_tx;
+DMA_HandleTypeDef hdma_usart1_rx;
+DMA_HandleTypeDef hdma_usart2_rx;
+DMA_HandleTypeDef hdma_usart3_rx;
+
+static uint8_t    _usart_irq_held;    /* bit per USART, usart_irq_hold() */
 
 /* USART1 init function */
 
@@ -108,9 +114,28 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
 
     __HAL_LINKDMA(uartHandle,hdmatx,hdma_usart1_tx);
 
-    /* USART1 interrupt Init */
-    HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
-    HAL_NVIC_EnableIRQ(USART1_IRQn);
+    /* USART1_RX Init */
+    hdma_usart1_rx.Instance = DMA1_Channel5;
+    hdma_usart1_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart1_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart1_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart1_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart1_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart1_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    if (HAL_DMA_Init(&hdma_usart1_rx) != HAL_OK)
+    {
+      _Error_Handler(__FILE__, __LINE__);
+    }
+
+    __HAL_LINKDMA(uartHandle,hdmarx,hdma_usart1_rx);
+
+    /* USART1 interrupt Init. a held one is enabled when it is let go */
+    HAL_NVIC_SetPriority(USART1_IRQn, IRQ_PRIO_UART, 0);
+    if(!usart_irq_held(uartHandle))
+    {
+      HAL_NVIC_EnableIRQ(USART1_IRQn);
+    }
   }
   else if(uartHandle->Instance==USART2)
   {
@@ -148,9 +173,28 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
 
     __HAL_LINKDMA(uartHandle,hdmatx,hdma_usart2_tx);
 
+    /* USART2_RX Init */
+    hdma_usart2_rx.Instance = DMA1_Channel6;
+    hdma_usart2_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart2_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart2_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart2_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart2_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart2_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart2_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    if (HAL_DMA_Init(&hdma_usart2_rx) != HAL_OK)
+    {
+      _Error_Handler(__FILE__, __LINE__);
+    }
+
+    __HAL_LINKDMA(uartHandle,hdmarx,hdma_usart2_rx);
+
     /* USART2 interrupt Init */
-    HAL_NVIC_SetPriority(USART2_IRQn, 0, 0);
-    HAL_NVIC_EnableIRQ(USART2_IRQn);
+    HAL_NVIC_SetPriority(USART2_IRQn, IRQ_PRIO_UART, 0);
+    if(!usart_irq_held(uartHandle))
+    {
+      HAL_NVIC_EnableIRQ(USART2_IRQn);
+    }
   }
   else if(uartHandle->Instance==USART3)
   {
@@ -188,9 +232,28 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
 
     __HAL_LINKDMA(uartHandle,hdmatx,hdma_usart3_tx);
 
+    /* USART3_RX Init */
+    hdma_usart3_rx.Instance = DMA1_Channel3;
+    hdma_usart3_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart3_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart3_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart3_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart3_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart3_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart3_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    if (HAL_DMA_Init(&hdma_usart3_rx) != HAL_OK)
+    {
+      _Error_Handler(__FILE__, __LINE__);
+    }
+
+    __HAL_LINKDMA(uartHandle,hdmarx,hdma_usart3_rx);
+
     /* USART3 interrupt Init */
-    HAL_NVIC_SetPriority(USART3_IRQn, 0, 0);
-    HAL_NVIC_EnableIRQ(USART3_IRQn);
+    HAL_NVIC_SetPriority(USART3_IRQn, IRQ_PRIO_UART, 0);
+    if(!usart_irq_held(uartHandle))
+    {
+      HAL_NVIC_EnableIRQ(USART3_IRQn);
+    }
   }
 }
 
@@ -210,6 +273,7 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* uartHandle)
 
     /* USART1 DMA DeInit */
     HAL_DMA_DeInit(uartHandle->hdmatx);
+    HAL_DMA_DeInit(uartHandle->hdmarx);
 
     /* USART1 interrupt Deinit */
     HAL_NVIC_DisableIRQ(USART1_IRQn);
@@ -227,6 +291,7 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* uartHandle)
 
     /* USART2 DMA DeInit */
     HAL_DMA_DeInit(uartHandle->hdmatx);
+    HAL_DMA_DeInit(uartHandle->hdmarx);
 
     /* USART2 interrupt Deinit */
     HAL_NVIC_DisableIRQ(USART2_IRQn);
@@ -244,8 +309,182 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* uartHandle)
 
     /* USART3 DMA DeInit */
     HAL_DMA_DeInit(uartHandle->hdmatx);
+    HAL_DMA_DeInit(uartHandle->hdmarx);
 
     /* USART3 interrupt Deinit */
     HAL_NVIC_DisableIRQ(USART3_IRQn);
   }
 } 
+
+/*
+ * change the bitrate of a running UART by rewriting BRR only. DMA and
+ * interrupts set up through HAL stay as they are. a frame being shifted
+ * out at that moment is garbled, so callers pick a TX idle point.
+ */
+void
+usart_set_baudrate(UART_HandleTypeDef* huart, uint32_t baudrate)
+{
+  uint32_t pclk;
+
+  /* same clock selection as HAL UART_SetConfig */
+  if(huart->Instance == USART1)
+  {
+    pclk = HAL_RCC_GetPCLK2Freq();
+  }
+  else
+  {
+    pclk = HAL_RCC_GetPCLK1Freq();
+  }
+
+  huart->Init.BaudRate  = baudrate;
+  huart->Instance->BRR  = UART_BRR_SAMPLING16(pclk, baudrate);
+}
+
+/*
+ * hold the TX line low (break) or hand it back to the USART. the pin is
+ * switched over to a GPIO output for it, as USART_CR1_SBK only ever sends
+ * a single break character.
+ */
+void
+usart_tx_break(UART_HandleTypeDef* huart, uint8_t on)
+{
+  GPIO_InitTypeDef  GPIO_InitStruct;
+  GPIO_TypeDef*     port;
+
+  if(huart->Instance == USART1)
+  {
+    port = GPIOA;
+    GPIO_InitStruct.Pin = GPIO_PIN_9;
+  }
+  else if(huart->Instance == USART2)
+  {
+    port = GPIOA;
+    GPIO_InitStruct.Pin = GPIO_PIN_2;
+  }
+  else
+  {
+    port = GPIOB;
+    GPIO_InitStruct.Pin = GPIO_PIN_10;
+  }
+
+  if(on)
+  {
+    HAL_GPIO_WritePin(port, GPIO_InitStruct.Pin, GPIO_PIN_RESET);
+    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  }
+  else
+  {
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  }
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(port, &GPIO_InitStruct);
+}
+
+/*
+ * disable the interrupts of a USART and its two DMA channels, or enable
+ * them again, so the UART can be set up without masking everything else.
+ * HAL_UART_Init in between leaves a held USART's interrupt off, and a
+ * USART left de-initialized keeps it off, as MspDeInit did.
+ */
+void
+usart_irq_hold(UART_HandleTypeDef* huart, uint8_t hold)
+{
+  IRQn_Type irq[3];
+  uint8_t   bit;
+  uint8_t   i;
+
+  if(huart->Instance == USART1)
+  {
+    bit    = 0x01;
+    irq[0] = USART1_IRQn;
+    irq[1] = DMA1_Channel4_IRQn;
+    irq[2] = DMA1_Channel5_IRQn;
+  }
+  else if(huart->Instance == USART2)
+  {
+    bit    = 0x02;
+    irq[0] = USART2_IRQn;
+    irq[1] = DMA1_Channel6_IRQn;
+    irq[2] = DMA1_Channel7_IRQn;
+  }
+  else
+  {
+    bit    = 0x04;
+    irq[0] = USART3_IRQn;
+    irq[1] = DMA1_Channel2_IRQn;
+    irq[2] = DMA1_Channel3_IRQn;
+  }
+
+  if(hold)
+  {
+    _usart_irq_held |= bit;
+  }
+  else
+  {
+    _usart_irq_held &= ~bit;
+  }
+
+  for(i = 0; i < 3; i++)
+  {
+    if(hold)
+    {
+      HAL_NVIC_DisableIRQ(irq[i]);
+    }
+    else if(i != 0 || huart->State != HAL_UART_STATE_RESET)
+    {
+      HAL_NVIC_EnableIRQ(irq[i]);
+    }
+  }
+
+  /* none of them is taken past this point */
+  __DSB();
+  __ISB();
+}
+
+uint8_t
+usart_irq_held(UART_HandleTypeDef* huart)
+{
+  if(huart->Instance == USART1)
+  {
+    return (_usart_irq_held & 0x01) != 0;
+  }
+  else if(huart->Instance == USART2)
+  {
+    return (_usart_irq_held & 0x02) != 0;
+  }
+  return (_usart_irq_held & 0x04) != 0;
+}
+
+/*
+ * runs of the USART's interrupt handler and of its RX and TX DMA
+ * channels', from irq_prof[]. 0 unless built with IRQ_PROFILE 1
+ */
+void
+usart_irq_count(UART_HandleTypeDef* huart, uint32_t count[3])
+{
+#if (IRQ_PROFILE == 1)
+  if(huart->Instance == USART1)
+  {
+    count[0] = irq_prof[IRQ_PROF_USART1].count;
+    count[1] = irq_prof[IRQ_PROF_DMA1_CH5].count;
+    count[2] = irq_prof[IRQ_PROF_DMA1_CH4].count;
+  }
+  else if(huart->Instance == USART2)
+  {
+    count[0] = irq_prof[IRQ_PROF_USART2].count;
+    count[1] = irq_prof[IRQ_PROF_DMA1_CH6].count;
+    count[2] = irq_prof[IRQ_PROF_DMA1_CH7].count;
+  }
+  else
+  {
+    count[0] = irq_prof[IRQ_PROF_USART3].count;
+    count[1] = irq_prof[IRQ_PROF_DMA1_CH3].count;
+    count[2] = irq_prof[IRQ_PROF_DMA1_CH2].count;
+  }
+#else
+  count[0] = 0;
+  count[1] = 0;
+  count[2] = 0;
+#endif
+}
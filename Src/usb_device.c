@@ -3,6 +3,9 @@
 #include "usbd_desc.h"
 #include "usbd_cdc.h"
 #include "usbd_cdc_if.h"
+#if (USBD_VENDOR_BULK == 1)
+#include "usbd_vendor_if.h"
+#endif
 
 /* USB Device Core handle declaration */
 USBD_HandleTypeDef hUsbDeviceFS;
@@ -17,6 +20,10 @@ void MX_USB_DEVICE_Init(void)
 
   USBD_CDC_RegisterInterface(&hUsbDeviceFS, &USBD_Interface_fops_FS);
 
+#if (USBD_VENDOR_BULK == 1)
+  USBD_Vendor_RegisterInterface(&hUsbDeviceFS, &USBD_Vendor_fops_FS);
+#endif
+
   USBD_Start(&hUsbDeviceFS);
 
 }
@@ -1,14 +1,120 @@
 #include "usbd_cdc_if.h"
 #include "usart.h"
-#include "tim.h"
+#include "cdc_uart.h"
 #include "gpio.h"
-
-#define APP_RX_DATA_SIZE  32
-#define APP_TX_DATA_SIZE  32
+#include "work.h"
+#include "irq.h"
+
+#if (USBD_CDC_MUX == 0)
+
+//
+// APP_TX_DATA_SIZE   : UART RX -> USB IN. circular DMA ring, transmitted in place
+// UART_TX_QUEUE_SIZE : USB OUT -> UART TX byte queue. OUT transfers land in it
+//                      directly and UART TX DMA drains it
+// USB_OUT_XFER_SIZE  : largest multi packet OUT transfer armed on the queue
+//
+#define APP_TX_DATA_SIZE    512
+#define UART_TX_QUEUE_SIZE  1024
+#define USB_OUT_XFER_SIZE   512
+
+//
+// SET_LINE_CODING only records the request. the EP0 handler never touches
+// the UART, usbd_cdc_if_poll() applies it as deferred work (work.h) with
+// the state machine in cdc_uart.c, which describes how the switch waits.
+//
+
+//
+// SEND_BREAK holds the TX line low for the requested number of ms, timed
+// by SOF. a break waits for the UART TX DMA chunk in flight to
+// go out and the TX queue is held back until it is over. a duration of
+// 0xffff lasts until SEND_BREAK 0.
+//
+#define BREAK_OFF             0
+#define BREAK_PENDING         1     /* waiting for UART TX DMA to finish    */
+#define BREAK_ON              2
+#define BREAK_FOREVER         0xffff
+
+//
+// RTS/CTS on the ports in USBD_CDC_FLOW_CTRL.
+// RTS is de-asserted once the RX ring holds RX_RTS_HIGH bytes not yet
+// acknowledged by host, and asserted again below RX_RTS_LOW. it is checked
+// on every RX DMA event, IN completion and SOF, which leaves a frame
+// at 1 Mbaud plus what the far end sends after RTS goes in the last
+// quarter of the ring.
+// CTS gates the UART TX DMA request. the USART stops after the frame it
+// is shifting and the chunk carries on from there once CTS is back.
+//
+#define RX_RTS_HIGH           (APP_TX_DATA_SIZE * 3 / 4)
+#define RX_RTS_LOW            (APP_TX_DATA_SIZE / 4)
+
+#define flow_ctrl_on(instance)  ((USBD_CDC_FLOW_CTRL >> (instance)) & 0x01)
+
+//
+// XON/XOFF on the ports in USBD_CDC_XONXOFF.
+// the device sends XOFF/XON on the same RX ring watermarks as RTS. the
+// character goes out ahead of the TX queue: TX DMA requests are held off
+// and the USART TXE interrupt writes it in between two queued bytes.
+// XON/XOFF received from the UART are spotted as the RX DMA publishes
+// new data. XOFF holds off the UART TX DMA request like CTS does.
+// the characters stay where DMA put them in the ring. their positions are
+// queued and the IN path cuts its transfers around them, so nothing is
+// copied. if more than XON_MAX_SKIP of them wait for host at once the
+// rest is still honored but goes to host as data.
+// SOF publishes RX on these ports too while UART TX DMA is running, so
+// an XOFF in the middle of a stream is seen within a frame.
+//
+#define XON                   0x11
+#define XOFF                  0x13
+#define XON_MAX_SKIP          8
+
+#define xonxoff_on(instance)  ((USBD_CDC_XONXOFF >> (instance)) & 0x01)
+
+//
+// IN flush policy, set per port by CDC_SET_LATENCY_TIMER.
+// what the RX ring holds goes to host as soon as min_fill bytes are
+// waiting, or once the oldest has waited latency frames of 1 ms.
+// the default of 1 byte sends everything right away, as it is published.
+// in adaptive mode min_fill is ignored. the timer starts at 1 ms and is
+// doubled up to latency for as long as each flush finds a full packet
+// waiting, and halved when it doesn't. the line going idle flushes
+// right away and drops the timer back to 1 ms.
+//
+#define IN_LATENCY_DEFAULT    1
+#define IN_MIN_FILL_DEFAULT   1
+#define IN_MIN_FILL_MAX       (APP_TX_DATA_SIZE / 2)
+
+//
+// IN bandwidth between the ports, set up in usbd_conf.h.
+// every SOF serves the ports in USBD_CDC_PRIO first and the rest after
+// them, each class from a port that moves on by one every frame.
+// the strict class is only held back by its rate cap. the others share
+// what it has left of a frame's bulk IN, SCHED_FRAME_BYTES, by deficit
+// round robin: each SOF a port with data waiting is credited its
+// weight's share, and its IN transfers are cut to the credit it has.
+// credit beyond two frames' worth, or a packet, is dropped. the
+// credit is only enforced and charged while the bus is contended, that
+// is more than one of those ports had data waiting at the last SOF or
+// the strict class sent anything in the last frame. a port alone on
+// the bus gets all of it.
+// the rate cap is a token bucket of SCHED_BURST_MS worth of rate, at
+// least a packet, refilled from the ms tick.
+// UART DMA of the strict class runs a level above the others. within
+// a level DMA1 serves the lower channel first.
+//
+#define SCHED_FRAME_BYTES     (19 * CDC_DATA_FS_IN_PACKET_SIZE)   /* bulk packets in a FS frame */
+#define SCHED_BURST_MS        8
+
+#define sched_prio(instance)  ((USBD_CDC_PRIO >> (instance)) & 0x01)
+
+//
+// the per port timing above all runs from SOF, early in each USB frame.
+// SOF is only taken while some port has data in its RX ring, a timed
+// break or, with XON/XOFF, UART TX running. anything that starts one of
+// those turns it on and CDC_SOF_FS turns it off once they are all over.
+//
 
 static void ComPort_Config(USBD_CDC_Instance instance);
 
-uint8_t UserRxBufferFS[USBD_CDC_Instance_MAX][APP_RX_DATA_SIZE];
 uint8_t UserTxBufferFS[USBD_CDC_Instance_MAX][APP_TX_DATA_SIZE];
 
 USBD_CDC_LineCodingTypeDef LineCoding[USBD_CDC_Instance_MAX] =
@@ -19,32 +125,134 @@ USBD_CDC_LineCodingTypeDef LineCoding[USBD_CDC_Instance_MAX] =
     0x00,   /* parity - none*/
     0x08    /* nb. of bits 8*/
   },
+#if (USBD_CDC_NUM_PORTS >= 2)
+  {
+    115200, /* baud rate*/
+    0x00,   /* stop bits-1*/
+    0x00,   /* parity - none*/
+    0x08    /* nb. of bits 8*/
+  },
+#endif
+#if (USBD_CDC_NUM_PORTS == 3)
   {
     115200, /* baud rate*/
     0x00,   /* stop bits-1*/
     0x00,   /* parity - none*/
     0x08    /* nb. of bits 8*/
   },
+#endif
 };
 
-uint32_t UserTxBufPtrIn[USBD_CDC_Instance_MAX] = { 0, 0,};
-uint32_t UserTxBufPtrOut[USBD_CDC_Instance_MAX] = { 0, 0};
+uint32_t UserTxBufPtrIn[USBD_CDC_Instance_MAX] = { 0, };
+uint32_t UserTxBufPtrOut[USBD_CDC_Instance_MAX] = { 0, };
+
+/* bytes starting at UserTxBufPtrOut that are currently owned by the IN endpoint */
+static uint32_t _tx_in_flight[USBD_CDC_Instance_MAX] = { 0, };
+
+typedef struct
+{
+  uint8_t   buf[UART_TX_QUEUE_SIZE];
+  uint32_t  head;         /* written by USB OUT                           */
+  uint32_t  tail;         /* read by UART TX DMA                          */
+  uint32_t  end;          /* data wraps here. short of the buffer end if
+                             a whole packet didn't fit there any more     */
+  uint32_t  count;        /* bytes queued, including the in flight ones   */
+  uint32_t  in_flight;    /* bytes from tail owned by UART TX DMA         */
+  uint8_t   rx_armed;     /* OUT EP armed on the queue at head            */
+} uart_tx_queue_t;
+
+static uart_tx_queue_t    _uart_txq[USBD_CDC_Instance_MAX];
 
 static volatile uint8_t   _usb_connected = 0;
 
+/* UART errors, for the debugger */
+static cdc_uart_err_t     _uart_err[USBD_CDC_Instance_MAX];
+
+static volatile uint8_t   _break_state[USBD_CDC_Instance_MAX] = { 0, };
+static uint16_t           _break_ms[USBD_CDC_Instance_MAX];   /* ms left */
+
+static uint8_t            _rx_held[USBD_CDC_Instance_MAX];    /* RTS de-asserted or XOFF sent by the ring */
+
+typedef struct
+{
+  uint16_t          skip[XON_MAX_SKIP]; /* ring positions of received XON/XOFF  */
+  uint8_t           skip_head;
+  uint8_t           skip_tail;
+  uint8_t           skip_count;
+  uint8_t           xoff;               /* far end has sent XOFF                */
+  volatile uint8_t  xchar;              /* XON/XOFF waiting for TXE. 0 if none  */
+} xonxoff_t;
+
+static xonxoff_t          _xonxoff[USBD_CDC_Instance_MAX];
+
+typedef struct
+{
+  uint8_t   latency;      /* ms                                           */
+  uint8_t   flags;        /* CDC_LATENCY_ADAPTIVE                         */
+  uint16_t  min_fill;     /* bytes                                        */
+  uint8_t   timer;        /* ms, adaptive mode's current latency          */
+  uint8_t   age;          /* ms the ring has waited with no IN transfer   */
+  uint8_t   flush;        /* send what there is at the next chance        */
+} in_policy_t;
+
+static in_policy_t        _in_policy[USBD_CDC_Instance_MAX];
+
+typedef struct
+{
+  uint8_t   weight;
+  uint16_t  rate;         /* bytes per ms. 0 for no cap                   */
+  int32_t   deficit;      /* bytes the port may send while contended      */
+  uint32_t  tokens;       /* rate cap bucket, bytes                       */
+  uint32_t  tick;         /* ms the bucket was last filled at             */
+} sched_t;
+
+static const uint8_t      _sched_weight[3] = USBD_CDC_WEIGHTS;
+static const uint16_t     _sched_rate[3] = USBD_CDC_RATE_CAP;
+
+static sched_t            _sched[USBD_CDC_Instance_MAX];
+static uint32_t           _sched_prio_bytes;  /* strict class, this frame */
+static uint8_t            _sched_contended;
+static uint8_t            _sched_rr;
+
+static cdc_uart_setup_t   _uart_setup[USBD_CDC_Instance_MAX];
+
 extern USBD_HandleTypeDef hUsbDeviceFS;
 
+//
+// interrupt levels are in irq.h. USART, UART DMA and CTS handlers preempt
+// USB and only capture what happened: they post an event for the port
+// and pend the USB interrupt, and usbd_cdc_if_usb_irq() handles it there
+// ahead of the USB stack. queues, ring indices and the USB endpoints are
+// then only ever touched at USB level, or by deferred work with
+// interrupts masked. what the two levels still share, the event bits and
+// a few USART register bits, is changed with interrupts masked.
+//
+#define UART_EV_RX            0x01    /* RX DMA half or full transfer     */
+#define UART_EV_IDLE          0x02    /* RX line went idle                */
+#define UART_EV_TX            0x04    /* UART TX DMA chunk done           */
+#define UART_EV_ERR           0x08    /* SERIAL_STATE bits in _uart_ev_state */
+#define UART_EV_DMA_ERR       0x10    /* a DMA channel has stopped        */
+#define UART_EV_GATE          0x20    /* CTS edge or our XON/XOFF sent    */
+
+static volatile uint8_t   _uart_ev[USBD_CDC_Instance_MAX];
+static volatile uint16_t  _uart_ev_state[USBD_CDC_Instance_MAX];
+
 static int8_t CDC_Init_FS     (void);
 static int8_t CDC_DeInit_FS   (void);
 static int8_t CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance instance);
 static int8_t CDC_Receive_FS  (uint8_t* pbuf, uint32_t *Len, USBD_CDC_Instance instance);
+static int8_t CDC_TransmitCplt_FS (uint8_t* pbuf, uint32_t *Len, USBD_CDC_Instance instance);
+static int8_t CDC_SOF_FS      (void);
+static void check_tx_buffer(USBD_CDC_Instance instance);
 
 USBD_CDC_ItfTypeDef USBD_Interface_fops_FS = 
 {
   CDC_Init_FS,
   CDC_DeInit_FS,
   CDC_Control_FS,  
-  CDC_Receive_FS
+  CDC_Receive_FS,
+  CDC_TransmitCplt_FS,
+  CDC_SOF_FS,
 };
 
 static inline UART_HandleTypeDef*
@@ -55,8 +263,15 @@ get_uart_handle(USBD_CDC_Instance instance)
   case USBD_CDC_Instance_0:
     return &huart1;
 
+#if (USBD_CDC_NUM_PORTS >= 2)
   case USBD_CDC_Instance_1:
     return &huart2;
+#endif
+
+#if (USBD_CDC_NUM_PORTS == 3)
+  case USBD_CDC_Instance_2:
+    return &huart3;
+#endif
 
   default:
     break;
@@ -67,11 +282,347 @@ get_uart_handle(USBD_CDC_Instance instance)
 static inline USBD_CDC_Instance
 get_uart_instance(UART_HandleTypeDef* huart)
 {
-  if(huart == &huart1)
+#if (USBD_CDC_NUM_PORTS >= 2)
+  if(huart == &huart2)
+  {
+    return USBD_CDC_Instance_1;
+  }
+#endif
+#if (USBD_CDC_NUM_PORTS == 3)
+  if(huart == &huart3)
+  {
+    return USBD_CDC_Instance_2;
+  }
+#endif
+  return USBD_CDC_Instance_0;
+}
+
+/* not while CDC_Init_FS/CDC_DeInit_FS wait for usbd_cdc_if_poll() */
+static inline uint8_t
+uart_up(USBD_CDC_Instance instance)
+{
+  return cdc_uart_up(&_uart_setup[instance]);
+}
+
+/* UART level. the rest is up to usbd_cdc_if_usb_irq() */
+static inline void
+uart_event(USBD_CDC_Instance instance, uint8_t ev)
+{
+  _uart_ev[instance] |= ev;
+  NVIC_SetPendingIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+/* DMA counts down from APP_TX_DATA_SIZE. what is consumed is our write index */
+static inline uint32_t
+uart_rx_ptr(UART_HandleTypeDef* huart)
+{
+  uint32_t ptr;
+
+  ptr = APP_TX_DATA_SIZE - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+  if(ptr == APP_TX_DATA_SIZE)
+  {
+    ptr = 0;
+  }
+  return ptr;
+}
+
+//
+// whether UART TX DMA may move data: CTS asserted, no XOFF from the far
+// end and no XON/XOFF of ours waiting to go out first
+//
+static inline uint8_t
+uart_tx_allowed(USBD_CDC_Instance instance)
+{
+  if(flow_ctrl_on(instance) && !gpio_cdc_cts(instance))
+  {
+    return 0;
+  }
+
+  if(xonxoff_on(instance) && (_xonxoff[instance].xoff || _xonxoff[instance].xchar != 0))
+  {
+    return 0;
+  }
+  return 1;
+}
+
+static inline void
+uart_xchar_kick(USBD_CDC_Instance instance)
+{
+  UART_HandleTypeDef* handle = get_uart_handle(instance);
+
+  uint32_t            primask;
+
+  /* during a break the TX pin isn't the USART's. it goes after the break */
+  if(_xonxoff[instance].xchar == 0 || _break_state[instance] == BREAK_ON || !uart_up(instance))
+  {
+    return;
+  }
+
+  primask = __get_PRIMASK();
+  __disable_irq();
+  CLEAR_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+  __HAL_UART_ENABLE_IT(handle, UART_IT_TXE);
+  __set_PRIMASK(primask);
+}
+
+static inline void
+uart_xchar_send(USBD_CDC_Instance instance, uint8_t c)
+{
+  /* a newer one replaces the one not sent yet. the TXE handler takes it */
+  _xonxoff[instance].xchar = c;
+  uart_xchar_kick(instance);
+}
+
+static inline void
+uart_rts_update(USBD_CDC_Instance instance)
+{
+  uint32_t  used;
+
+  if(!flow_ctrl_on(instance) && !xonxoff_on(instance))
+  {
+    return;
+  }
+
+  used = uart_rx_ptr(get_uart_handle(instance)) + APP_TX_DATA_SIZE - UserTxBufPtrOut[instance];
+  if(used >= APP_TX_DATA_SIZE)
+  {
+    used -= APP_TX_DATA_SIZE;
+  }
+
+  if(!_rx_held[instance] && used >= RX_RTS_HIGH)
+  {
+    _rx_held[instance] = 1;
+  }
+  else if(_rx_held[instance] && used <= RX_RTS_LOW)
+  {
+    _rx_held[instance] = 0;
+  }
+  else
+  {
+    return;
+  }
+
+  if(flow_ctrl_on(instance))
+  {
+    gpio_cdc_rts(instance, !_rx_held[instance]);
+  }
+  else
+  {
+    uart_xchar_send(instance, _rx_held[instance] ? XOFF : XON);
+  }
+}
+
+static inline void
+uart_tx_kick(USBD_CDC_Instance instance)
+{
+  uart_tx_queue_t*  q = &_uart_txq[instance];
+  uint32_t          len;
+  uint32_t          primask;
+
+  if(q->in_flight != 0 || q->count == 0 || _break_state[instance] != BREAK_OFF)
+  {
+    return;
+  }
+
+  if(!uart_up(instance) || !uart_tx_allowed(instance))
+  {
+    return;
+  }
+
+  if(q->head > q->tail)
+  {
+    len = q->head - q->tail;
+  }
+  else
+  {
+    len = q->end - q->tail;
+  }
+
+  q->in_flight = len;
+
+  /* HAL_UART_ErrorCallback sets the handle state too */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  HAL_UART_Transmit_DMA(get_uart_handle(instance), &q->buf[q->tail], len);
+  __set_PRIMASK(primask);
+
+  if(xonxoff_on(instance))
+  {
+    USBD_CDC_SetSOF(&hUsbDeviceFS, 1);
+  }
+}
+
+//
+// re-evaluate the UART TX DMA gate after CTS, XON/XOFF or our own
+// XON/XOFF going out has changed it. a chunk held off carries on from
+// where it stopped
+//
+static inline void
+uart_tx_gate(USBD_CDC_Instance instance)
+{
+  UART_HandleTypeDef* handle = get_uart_handle(instance);
+  uint32_t            primask;
+
+  /* a CTS edge in between would otherwise be overwritten */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  if(!uart_tx_allowed(instance))
+  {
+    CLEAR_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+    __set_PRIMASK(primask);
+  }
+  else if(_uart_txq[instance].in_flight != 0)
+  {
+    SET_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+    __set_PRIMASK(primask);
+  }
+  else
+  {
+    __set_PRIMASK(primask);
+    uart_tx_kick(instance);
+  }
+}
+
+//
+// OUT transfers land straight in the queue. the EP is armed on the free
+// space after head for as many whole packets as fit, up to
+// USB_OUT_XFER_SIZE. when not even a packet fits before the end of the
+// buffer, data wraps early at end and the transfer goes to the start.
+// with no room at all the EP is left un-armed, which NAKs the host, until
+// UART TX completion frees some.
+//
+static inline void
+usb_out_arm(USBD_CDC_Instance instance)
+{
+  uart_tx_queue_t*  q = &_uart_txq[instance];
+  uint32_t          room;
+
+  if(q->count == 0)
+  {
+    q->head = 0;
+    q->tail = 0;
+    q->end  = UART_TX_QUEUE_SIZE;
+  }
+
+  if(q->head > q->tail || q->count == 0)
+  {
+    room = UART_TX_QUEUE_SIZE - q->head;
+    if(room < CDC_DATA_FS_OUT_PACKET_SIZE && q->tail >= CDC_DATA_FS_OUT_PACKET_SIZE)
+    {
+      q->end  = q->head;
+      q->head = 0;
+      room    = q->tail;
+    }
+  }
+  else
+  {
+    room = q->tail - q->head;
+  }
+
+  if(room > USB_OUT_XFER_SIZE)
+  {
+    room = USB_OUT_XFER_SIZE;
+  }
+  room -= room % CDC_DATA_FS_OUT_PACKET_SIZE;
+
+  if(room == 0)
+  {
+    return;
+  }
+
+  q->rx_armed = 1;
+  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &q->buf[q->head], room, instance);
+  USBD_CDC_ReceivePacket(&hUsbDeviceFS, instance);
+}
+
+static inline void
+uart_txq_reset(USBD_CDC_Instance instance)
+{
+  uart_tx_queue_t*  q = &_uart_txq[instance];
+
+  /* an armed OUT transfer keeps its place at head */
+  q->tail       = q->head;
+  q->end        = UART_TX_QUEUE_SIZE;
+  q->count      = 0;
+  q->in_flight  = 0;
+
+  if(!q->rx_armed && _usb_connected)
+  {
+    usb_out_arm(instance);
+  }
+}
+
+//
+// UART TX DMA is about to be stopped by a re-init. whatever it hasn't
+// handed to the USART yet stays queued and is sent again afterwards
+//
+static inline void
+uart_tx_stop(USBD_CDC_Instance instance)
+{
+  uart_tx_queue_t*    q = &_uart_txq[instance];
+  UART_HandleTypeDef* handle = get_uart_handle(instance);
+  uint32_t            sent;
+
+  if(q->in_flight == 0)
+  {
+    return;
+  }
+
+  CLEAR_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+  sent = q->in_flight - __HAL_DMA_GET_COUNTER(handle->hdmatx);
+
+  q->tail += sent;
+  if(q->tail >= q->end)
+  {
+    q->tail = 0;
+    q->end  = UART_TX_QUEUE_SIZE;
+  }
+  q->count -= sent;
+  q->in_flight = 0;
+}
+
+static inline void
+uart_break_start(USBD_CDC_Instance instance)
+{
+  UART_HandleTypeDef* handle = get_uart_handle(instance);
+
+  /* an XON/XOFF not sent yet waits for uart_break_stop */
+  __HAL_UART_DISABLE_IT(handle, UART_IT_TXE);
+
+  _break_state[instance] = BREAK_ON;
+  usart_tx_break(handle, 1);
+
+  if(_break_ms[instance] != BREAK_FOREVER)
+  {
+    USBD_CDC_SetSOF(&hUsbDeviceFS, 1);
+  }
+}
+
+static inline void
+uart_break_stop(USBD_CDC_Instance instance)
+{
+  if(_break_state[instance] == BREAK_ON)
   {
-    return USBD_CDC_Instance_0;
+    usart_tx_break(get_uart_handle(instance), 0);
+  }
+  _break_state[instance] = BREAK_OFF;
+
+  uart_xchar_kick(instance);
+  uart_tx_kick(instance);
+}
+
+static inline void
+uart_break_tick(USBD_CDC_Instance instance)
+{
+  if(_break_state[instance] != BREAK_ON || _break_ms[instance] == BREAK_FOREVER)
+  {
+    return;
+  }
+
+  if(--_break_ms[instance] == 0)
+  {
+    uart_break_stop(instance);
   }
-  return USBD_CDC_Instance_1;
 }
 
 /**
@@ -83,27 +634,50 @@ get_uart_instance(UART_HandleTypeDef* huart)
 static int8_t
 CDC_Init_FS(void)
 { 
-  UserTxBufPtrIn[0] =
-  UserTxBufPtrIn[1] = 0;
-
-  UserTxBufPtrOut[0] =
-  UserTxBufPtrOut[1] = 0;
-
-  ComPort_Config(USBD_CDC_Instance_0);
-  ComPort_Config(USBD_CDC_Instance_1);
-
-  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, &UserTxBufferFS[0][0], 0, USBD_CDC_Instance_0);
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &UserRxBufferFS[0][0], USBD_CDC_Instance_0);
+  USBD_CDC_Instance instance;
 
-  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, &UserTxBufferFS[1][0], 0, USBD_CDC_Instance_1);
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &UserRxBufferFS[1][0], USBD_CDC_Instance_1);
-
-  if(HAL_TIM_Base_Start_IT(&htim1) != HAL_OK)
+  for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
   {
-    Error_Handler();
+    UserTxBufPtrIn[instance] = 0;
+    UserTxBufPtrOut[instance] = 0;
+    _tx_in_flight[instance] = 0;
+    _uart_txq[instance].rx_armed = 0;
+    _uart_setup[instance].pending = CDC_UART_SETUP_NONE;
+    _break_state[instance] = BREAK_OFF;
+    gpio_cdc_control_lines(instance, 0, 0);
+    _rx_held[instance] = 1;
+    _xonxoff[instance].xoff = 0;
+    _xonxoff[instance].xchar = 0;
+    _in_policy[instance].latency = IN_LATENCY_DEFAULT;
+    _in_policy[instance].flags = 0;
+    _in_policy[instance].min_fill = IN_MIN_FILL_DEFAULT;
+    _in_policy[instance].timer = 1;
+    _in_policy[instance].age = 0;
+    _in_policy[instance].flush = 0;
+    _sched[instance].weight = _sched_weight[instance] != 0 ? _sched_weight[instance] : 1;
+    _sched[instance].rate = _sched_rate[instance];
+    _sched[instance].deficit = 0;
+    _sched[instance].tokens = 0;
+    _sched[instance].tick = HAL_GetTick() - SCHED_BURST_MS;
+
+    /* the UART is set up by usbd_cdc_if_poll(). nothing old goes out */
+    _uart_setup[instance].pending = CDC_UART_SETUP_OPEN;
+    uart_tx_stop(instance);
+    uart_txq_reset(instance);
+
+    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, &UserTxBufferFS[instance][0], 0, instance);
+    USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &_uart_txq[instance].buf[0], USB_OUT_XFER_SIZE, instance);
+
+    /* class arms the OUT EP on this as soon as we return */
+    _uart_txq[instance].rx_armed = 1;
   }
 
+  _sched_prio_bytes = 0;
+  _sched_contended = 0;
+  _sched_rr = 0;
+
   _usb_connected = 1;
+  work_post(WORK_CDC_POLL);
   return (USBD_OK);
 }
 
@@ -116,107 +690,76 @@ CDC_Init_FS(void)
 static int8_t
 CDC_DeInit_FS(void)
 {
-  if(HAL_TIM_Base_Stop_IT(&htim1) != HAL_OK)
-  {
-    Error_Handler();
-  }
+  USBD_CDC_Instance instance;
 
-  if(HAL_UART_DeInit(&huart1) != HAL_OK)
-  {
-    Error_Handler();
-  }
+  USBD_CDC_SetSOF(&hUsbDeviceFS, 0);
 
-  if(HAL_UART_DeInit(&huart2) != HAL_OK)
+  for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
   {
-    Error_Handler();
+    /* HAL_UART_DeInit is left to usbd_cdc_if_poll() */
+    _uart_setup[instance].pending = CDC_UART_SETUP_CLOSE;
+    _break_state[instance] = BREAK_OFF;
+    gpio_cdc_control_lines(instance, 0, 0);
   }
 
   _usb_connected = 0;
+  work_post(WORK_CDC_POLL);
 
   return (USBD_OK);
 }
 
+static inline void
+sched_dma_priority(UART_HandleTypeDef* handle, USBD_CDC_Instance instance)
+{
+  /* RX overruns lose data, a slow TX only waits. RX stays above TX */
+  handle->hdmarx->Init.Priority = sched_prio(instance) ? DMA_PRIORITY_VERY_HIGH : DMA_PRIORITY_HIGH;
+  handle->hdmatx->Init.Priority = sched_prio(instance) ? DMA_PRIORITY_MEDIUM : DMA_PRIORITY_LOW;
+
+  /* both channels are disabled until the transfers start */
+  MODIFY_REG(handle->hdmarx->Instance->CCR, DMA_CCR_PL, handle->hdmarx->Init.Priority);
+  MODIFY_REG(handle->hdmatx->Instance->CCR, DMA_CCR_PL, handle->hdmatx->Init.Priority);
+}
+
 static void
 ComPort_Config(USBD_CDC_Instance instance)
 {
   UART_HandleTypeDef* handle;
+  uint32_t            primask;
 
   handle = get_uart_handle(instance);
 
-  if(HAL_UART_DeInit(handle) != HAL_OK)
-  {
-    /* Initialization Error */
-    Error_Handler();
-  }
-
-  /* set the Stop bit */
-  switch (LineCoding[instance].format)
-  {
-    case 0:
-      handle->Init.StopBits = UART_STOPBITS_1;
-      break;
-    case 2:
-      handle->Init.StopBits = UART_STOPBITS_2;
-      break;
-    default :
-      handle->Init.StopBits = UART_STOPBITS_1;
-      break;
-  }
+  cdc_uart_config(handle, &LineCoding[instance]);
 
-  /* set the parity bit*/
-  switch (LineCoding[instance].paritytype)
-  {
-    case 0:
-      handle->Init.Parity = UART_PARITY_NONE;
-      break;
-    case 1:
-      handle->Init.Parity = UART_PARITY_ODD;
-      break;
-    case 2:
-      handle->Init.Parity = UART_PARITY_EVEN;
-      break;
-    default :
-      handle->Init.Parity = UART_PARITY_NONE;
-      break;
-  }
+  /* what the old setup posted and USB level hasn't seen yet. errors still count */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  _uart_ev[instance] &= UART_EV_ERR;
+  __set_PRIMASK(primask);
 
-  /*set the data type : only 8bits and 9bits is supported */
-  switch (LineCoding[instance].datatype)
-  {
-    case 0x07:
-      /* With this configuration a parity (Even or
-       * Odd) must be set */
-      handle->Init.WordLength = UART_WORDLENGTH_8B;
-      break;
-    case 0x08:
-      if(handle->Init.Parity == UART_PARITY_NONE)
-      {
-        handle->Init.WordLength = UART_WORDLENGTH_8B;
-      }
-      else
-      {
-        handle->Init.WordLength = UART_WORDLENGTH_9B;
-      }
+  /* MspInit has set up both channels at the default level */
+  sched_dma_priority(handle, instance);
 
-      break;
-    default :
-      handle->Init.WordLength = UART_WORDLENGTH_8B;
-      break;
-  }
+  /* the ring starts over */
+  UserTxBufPtrIn[instance] = 0;
+  UserTxBufPtrOut[instance] = 0;
+  _tx_in_flight[instance] = 0;
+  _xonxoff[instance].skip_head = 0;
+  _xonxoff[instance].skip_tail = 0;
+  _xonxoff[instance].skip_count = 0;
 
-  handle->Init.BaudRate = LineCoding[instance].bitrate;
-  handle->Init.HwFlowCtl  = UART_HWCONTROL_NONE;
-  handle->Init.Mode       = UART_MODE_TX_RX;
+  cdc_uart_rx_start(handle, (uint8_t *)&UserTxBufferFS[instance][0], APP_TX_DATA_SIZE);
 
-  if(HAL_UART_Init(handle) != HAL_OK)
+  /* DeInit has stopped TX DMA and handed the TX pin back to the USART */
+  if(_break_state[instance] != BREAK_OFF)
   {
-    /* Initialization Error */
-    Error_Handler();
+    uart_break_start(instance);
   }
 
-  /* Start reception: provide the buffer pointer with
-   * offset and the buffer size */
-  HAL_UART_Receive_IT(handle, (uint8_t *)(&UserTxBufferFS[instance][UserTxBufPtrIn[instance]]), 1);
+  /* and has disabled TXE with an XON/XOFF still to send */
+  uart_xchar_kick(instance);
+
+  /* ring starts out empty */
+  uart_rts_update(instance);
 }
 /**
   * @brief  CDC_Control_FS
@@ -229,6 +772,12 @@ ComPort_Config(USBD_CDC_Instance instance)
 static int8_t
 CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance instance)
 { 
+  uint16_t  duration;
+  uint16_t  lines;
+  uint32_t  irqs[3];
+  uint8_t   i;
+  in_policy_t*  policy = &_in_policy[instance];
+
   /* USER CODE BEGIN 5 */
   switch (cmd)
   {
@@ -276,8 +825,9 @@ CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance
     LineCoding[instance].paritytype = pbuf[5];
     LineCoding[instance].datatype   = pbuf[6];
 
-    /* Set the new configuration */
-    ComPort_Config(instance);
+    /* applied by usbd_cdc_if_poll() */
+    cdc_uart_request(&_uart_setup[instance], get_uart_handle(instance), &LineCoding[instance]);
+    work_post(WORK_CDC_POLL);
     break;
 
   case CDC_GET_LINE_CODING:     
@@ -291,12 +841,94 @@ CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance
     break;
 
   case CDC_SET_CONTROL_LINE_STATE:
-
+    /* no data stage. wValue bit 0 is DTR, bit 1 RTS */
+    lines = ((USBD_SetupReqTypedef*)pbuf)->wValue;
+    if(flow_ctrl_on(instance))
+    {
+      /* RTS belongs to flow control */
+      gpio_cdc_control_lines(instance, lines & 0x01, !_rx_held[instance]);
+    }
+    else
+    {
+      gpio_cdc_control_lines(instance, lines & 0x01, lines & 0x02);
+    }
     break;
 
   case CDC_SEND_BREAK:
- 
+    /* no data stage. pbuf is the setup request, wValue the duration in ms */
+    duration = ((USBD_SetupReqTypedef*)pbuf)->wValue;
+    if(duration == 0)
+    {
+      uart_break_stop(instance);
+      break;
+    }
+
+    /* the first SOF may come right away. round up to at least duration,
+       but never onto BREAK_FOREVER. 0xfffe ms ends up 1 ms short */
+    if(duration == BREAK_FOREVER)
+    {
+      _break_ms[instance] = BREAK_FOREVER;
+    }
+    else
+    {
+      _break_ms[instance] = (duration < BREAK_FOREVER - 1) ? duration + 1 : BREAK_FOREVER - 1;
+    }
+
+    if(_break_state[instance] == BREAK_OFF)
+    {
+      /* a port not set up yet starts it from ComPort_Config */
+      if(_uart_txq[instance].in_flight == 0 && uart_up(instance))
+      {
+        uart_break_start(instance);
+      }
+      else
+      {
+        _break_state[instance] = BREAK_PENDING;
+      }
+    }
+    else if(_break_state[instance] == BREAK_ON && _break_ms[instance] != BREAK_FOREVER)
+    {
+      /* over one that lasted until SEND_BREAK 0. SOF times it from here */
+      USBD_CDC_SetSOF(&hUsbDeviceFS, 1);
+    }
     break;    
+
+  case CDC_SET_LATENCY_TIMER:
+    if(length < CDC_LATENCY_TIMER_SIZE)
+    {
+      break;
+    }
+    policy->latency   = pbuf[0] != 0 ? pbuf[0] : 1;
+    policy->flags     = pbuf[1] & CDC_LATENCY_ADAPTIVE;
+    policy->min_fill  = (uint16_t)(pbuf[2] | (pbuf[3] << 8));
+    if(policy->min_fill == 0)
+    {
+      policy->min_fill = 1;
+    }
+    else if(policy->min_fill > IN_MIN_FILL_MAX)
+    {
+      policy->min_fill = IN_MIN_FILL_MAX;
+    }
+    policy->timer     = 1;
+    break;
+
+  case CDC_GET_LATENCY_TIMER:
+    pbuf[0] = policy->latency;
+    pbuf[1] = policy->flags;
+    pbuf[2] = (uint8_t)(policy->min_fill);
+    pbuf[3] = (uint8_t)(policy->min_fill >> 8);
+    break;
+
+  case CDC_GET_IRQ_COUNT:
+    usart_irq_count(get_uart_handle(instance), irqs);
+    for(i = 0; i < 3; i++)
+    {
+      pbuf[4 * i]     = (uint8_t)(irqs[i]);
+      pbuf[4 * i + 1] = (uint8_t)(irqs[i] >> 8);
+      pbuf[4 * i + 2] = (uint8_t)(irqs[i] >> 16);
+      pbuf[4 * i + 3] = (uint8_t)(irqs[i] >> 24);
+    }
+    break;
     
   default:
     break;
@@ -312,10 +944,11 @@ CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance
   *         through this function.
   *           
   *         @note
-  *         This function will block any OUT packet reception on USB endpoint 
-  *         untill exiting this function. If you exit this function before transfer
-  *         is complete on CDC interface (ie. using DMA controller) it will result 
-  *         in receiving more data while previous ones are still not sent.
+  *         the transfer, up to USB_OUT_XFER_SIZE bytes and ended by a short
+  *         packet, has landed in the per port UART TX queue. the EP is
+  *         re-armed right away as long as another packet fits and UART TX
+  *         DMA is started on the whole contiguous run, so the host is only
+  *         NAKed while the queue is full.
   *                 
   * @param  Buf: Buffer of data to be received
   * @param  Len: Number of data received (in bytes)
@@ -324,84 +957,750 @@ CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance
 static int8_t
 CDC_Receive_FS (uint8_t* Buf, uint32_t *Len, USBD_CDC_Instance instance)
 {
-  UART_HandleTypeDef* huart = get_uart_handle(instance);
+  uart_tx_queue_t*  q = &_uart_txq[instance];
+
+  /* Buf is &q->buf[q->head]. data is already in place */
+  q->rx_armed = 0;
+
+  q->head += *Len;
+  if(q->head >= UART_TX_QUEUE_SIZE)
+  {
+    q->head = 0;
+  }
+  q->count += *Len;
 
-  HAL_UART_Transmit_DMA(huart, Buf, *Len);
+  uart_tx_kick(instance);
+  usb_out_arm(instance);
   return (USBD_OK);
 }
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
-{
-  USBD_CDC_Instance instance = get_uart_instance(huart);
+/**
+  * @brief  CDC_TransmitCplt_FS
+  *         IN transfer from the receive ring has been acknowledged by host.
+  *         the slice is released and the next pending segment is chained
+  *         from here instead of waiting for the next SOF.
+  *         called from USB interrupt context.
+  *
+  * @param  Buf: Buffer of data that was sent
+  * @param  Len: Number of data sent (in bytes)
+  * @retval Result of the operation: USBD_OK if all operations are OK else USBD_FAIL
+  */
+static int8_t
+CDC_TransmitCplt_FS(uint8_t* Buf, uint32_t *Len, USBD_CDC_Instance instance)
+{
+  UserTxBufPtrOut[instance] += _tx_in_flight[instance];
+  if(UserTxBufPtrOut[instance] >= APP_TX_DATA_SIZE)
+  {
+    UserTxBufPtrOut[instance] -= APP_TX_DATA_SIZE;
+  }
+  _tx_in_flight[instance] = 0;
 
-  /* Initiate next USB packet transfer once UART completes transfer
-   * (transmitting data over Tx line) */
-  USBD_CDC_ReceivePacket(&hUsbDeviceFS, instance);
+  /* the last one from a ring that is to be reset */
+  if(_uart_setup[instance].pending == CDC_UART_SETUP_SWITCH)
+  {
+    work_post(WORK_CDC_POLL);
+    return (USBD_OK);
+  }
+
+  uart_rts_update(instance);
+  check_tx_buffer(instance);
+  return (USBD_OK);
+}
+
+static inline void
+uart_tx_done(USBD_CDC_Instance instance)
+{
+  uart_tx_queue_t*  q = &_uart_txq[instance];
+
+  q->tail += q->in_flight;
+  if(q->tail >= q->end)
+  {
+    q->tail = 0;
+    q->end  = UART_TX_QUEUE_SIZE;
+  }
+  q->count -= q->in_flight;
+  q->in_flight = 0;
+
+  if(_break_state[instance] == BREAK_PENDING)
+  {
+    uart_break_start(instance);
+  }
+
+  uart_tx_kick(instance);
+
+  if(!q->rx_armed)
+  {
+    usb_out_arm(instance);
+  }
 }
 
 void
-HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+  uart_event(get_uart_instance(huart), UART_EV_TX);
+}
+
+//
+// XON/XOFF among the bytes DMA has just put in the ring. called before
+// they are published, so the IN path never sees one not queued for skip
+//
+static inline void
+uart_rx_xonxoff(USBD_CDC_Instance instance, uint32_t ptr)
+{
+  xonxoff_t*  x = &_xonxoff[instance];
+  uint8_t*    ring = UserTxBufferFS[instance];
+  uint32_t    pos;
+  uint8_t     xoff = x->xoff;
+
+  for(pos = UserTxBufPtrIn[instance]; pos != ptr; pos = (pos + 1) % APP_TX_DATA_SIZE)
+  {
+    if(ring[pos] != XON && ring[pos] != XOFF)
+    {
+      continue;
+    }
+
+    xoff = (ring[pos] == XOFF);
+    if(x->skip_count < XON_MAX_SKIP)
+    {
+      x->skip[x->skip_head] = pos;
+      x->skip_head = (x->skip_head + 1) % XON_MAX_SKIP;
+      x->skip_count++;
+    }
+  }
+
+  if(xoff != x->xoff)
+  {
+    x->xoff = xoff;
+    uart_tx_gate(instance);
+  }
+}
+
+static inline void
+uart_rx_update(UART_HandleTypeDef* huart)
 {
   USBD_CDC_Instance instance = get_uart_instance(huart);
+  uint32_t          ptr = uart_rx_ptr(huart);
+
+  if(xonxoff_on(instance))
+  {
+    uart_rx_xonxoff(instance, ptr);
+  }
+
+  UserTxBufPtrIn[instance] = ptr;
+  uart_rts_update(instance);
+  check_tx_buffer(instance);
+
+  /* ring isn't empty. time it */
+  USBD_CDC_SetSOF(&hUsbDeviceFS, 1);
+}
+
+void
+HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  uart_event(get_uart_instance(huart), UART_EV_RX);
+}
+
+void
+HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  /* circular mode. DMA has already wrapped around to the start of the ring */
+  uart_event(get_uart_instance(huart), UART_EV_RX);
+}
 
-  /* Increment Index for buffer writing */
-  UserTxBufPtrIn[instance]++;
+void
+usbd_cdc_if_uart_irq(UART_HandleTypeDef* huart)
+{
+  USBD_CDC_Instance instance = get_uart_instance(huart);
 
-  /* To avoid buffer overflow */
-  if(UserTxBufPtrIn[instance] == APP_RX_DATA_SIZE)
+  /*
+   * our XON/XOFF. TXE is disabled again before HAL_UART_IRQHandler runs,
+   * which would otherwise take it for an interrupt driven transmit
+   */
+  if(__HAL_UART_GET_FLAG(huart, UART_FLAG_TXE) != RESET &&
+     __HAL_UART_GET_IT_SOURCE(huart, UART_IT_TXE) != RESET)
   {
-    UserTxBufPtrIn[instance] = 0;
+    __HAL_UART_DISABLE_IT(huart, UART_IT_TXE);
+
+    if(_xonxoff[instance].xchar != 0)
+    {
+      huart->Instance->DR = _xonxoff[instance].xchar;
+      _xonxoff[instance].xchar = 0;
+    }
+    /* DMA TX, if any, resumes at USB level */
+    uart_event(instance, UART_EV_GATE);
   }
 
-  /* Start another reception: provide the buffer pointer with
-   * offset and the buffer size */
-  HAL_UART_Receive_IT(huart, (uint8_t *)(&UserTxBufferFS[instance][UserTxBufPtrIn[instance]]), 1);
+  if(__HAL_UART_GET_FLAG(huart, UART_FLAG_IDLE) != RESET &&
+     __HAL_UART_GET_IT_SOURCE(huart, UART_IT_IDLE) != RESET)
+  {
+    __HAL_UART_CLEAR_IDLEFLAG(huart);
+
+    /* line went idle. publish whatever DMA has received so far */
+    uart_event(instance, UART_EV_IDLE);
+  }
 }
 
+//
+// HAL has already cleared the error flags. RX DMA is still running and
+// the byte in error, if any, is in the ring. a DMA transfer error has
+// stopped its channel, so the port is re-initialized, keeping the TX
+// queue. only what was in the RX ring is lost then. the re-init is left
+// to usbd_cdc_if_poll(), as a frame format change that can't wait.
+// counting is done here, the rest at USB level.
+//
 void
-HAL_UART_ErrorCallback(UART_HandleTypeDef *UartHandle)
+HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  USBD_CDC_Instance instance = get_uart_instance(huart);
+  uint32_t          code = huart->ErrorCode;
+  uint16_t          state;
+  uint8_t           ev = UART_EV_ERR;
+  uint32_t          primask;
+
+  state = cdc_uart_error(huart, code, &_uart_err[instance], _uart_txq[instance].in_flight != 0);
+  if(code & HAL_UART_ERROR_DMA)
+  {
+    ev |= UART_EV_DMA_ERR;
+  }
+
+  if(state == 0 && !(ev & UART_EV_DMA_ERR))
+  {
+    return;
+  }
+
+  /* a higher priority USART can post in between */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  _uart_ev_state[instance] |= state;
+  __set_PRIMASK(primask);
+
+  uart_event(instance, ev);
+}
+
+
+//
+// zero copy IN path.
+// the IN endpoint is pointed straight into the receive ring. the slice stays
+// owned by the endpoint until USBD_CDC_DataIn reports completion through
+// CDC_TransmitCplt_FS, and only then UserTxBufPtrOut is advanced past it.
+// a wrapped ring is sent as two back to back transfers, the tail up to the
+// end of the ring first and then the head, chained from the completion.
+// SOF only has to kick ports that are idle, and age what the IN flush
+// policy holds back.
+//
+static inline uint8_t
+in_flush_due(USBD_CDC_Instance instance, uint32_t pending)
 {
-  /* Transfer error occured in reception and/or transmission process
-   * */
-  Error_Handler();
+  in_policy_t*  p = &_in_policy[instance];
+
+  if(p->flush)
+  {
+    p->flush = 0;
+    return 1;
+  }
+
+  if(!(p->flags & CDC_LATENCY_ADAPTIVE))
+  {
+    return pending >= p->min_fill || p->age >= p->latency;
+  }
+
+  if(p->age < p->timer)
+  {
+    return 0;
+  }
+
+  /* sustained load fills a packet within the timer. coalesce longer */
+  if(pending >= CDC_DATA_FS_IN_PACKET_SIZE)
+  {
+    p->timer = (p->timer * 2 > p->latency) ? p->latency : p->timer * 2;
+  }
+  else if(p->timer > 1)
+  {
+    p->timer /= 2;
+  }
+  return 1;
 }
 
+static inline uint8_t
+sched_backlogged(USBD_CDC_Instance instance)
+{
+  return _tx_in_flight[instance] != 0 || UserTxBufPtrOut[instance] != UserTxBufPtrIn[instance];
+}
+
+//
+// called first thing every SOF. credits the ports outside the strict
+// class for the frame that starts
+//
+static inline void
+sched_frame(void)
+{
+  USBD_CDC_Instance instance;
+  sched_t*          sc;
+  uint32_t          weights = 0;
+  uint32_t          share;
+  int32_t           quantum;
+  uint8_t           active = 0;
+
+  for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
+  {
+    if(!sched_prio(instance) && sched_backlogged(instance))
+    {
+      weights += _sched[instance].weight;
+      active++;
+    }
+  }
+
+  share = _sched_prio_bytes < SCHED_FRAME_BYTES ? SCHED_FRAME_BYTES - _sched_prio_bytes : 0;
+  _sched_contended = active > 1 || _sched_prio_bytes != 0;
+  _sched_prio_bytes = 0;
+
+  for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
+  {
+    sc = &_sched[instance];
+
+    /* DRR. credit isn't saved up while there is nothing to send */
+    if(sched_prio(instance) || !sched_backlogged(instance))
+    {
+      sc->deficit = 0;
+      continue;
+    }
+
+    quantum = (int32_t)(share * sc->weight / weights);
+    sc->deficit += quantum;
+    if(sc->deficit > 2 * quantum && sc->deficit > CDC_DATA_FS_IN_PACKET_SIZE)
+    {
+      sc->deficit = 2 * quantum > CDC_DATA_FS_IN_PACKET_SIZE ? 2 * quantum : CDC_DATA_FS_IN_PACKET_SIZE;
+    }
+  }
+
+  _sched_rr = (_sched_rr + 1) % USBD_CDC_Instance_MAX;
+}
+
+//
+// n-th port to serve, n from 0 to 2 * USBD_CDC_Instance_MAX - 1. the
+// strict class in the first half, the others in the second.
+// USBD_CDC_Instance_MAX for the ports a half skips
+//
+static inline USBD_CDC_Instance
+sched_order(uint8_t n)
+{
+  USBD_CDC_Instance instance = (USBD_CDC_Instance)((_sched_rr + n) % USBD_CDC_Instance_MAX);
+
+  if((n < USBD_CDC_Instance_MAX) != sched_prio(instance))
+  {
+    return USBD_CDC_Instance_MAX;
+  }
+  return instance;
+}
+
+//
+// how much of an IN transfer of len the port may start now. a cut
+// transfer ends on a packet boundary, and is held back if that is less
+// than a packet
+//
+static inline uint32_t
+sched_grant(USBD_CDC_Instance instance, uint32_t len)
+{
+  sched_t*  sc = &_sched[instance];
+  uint32_t  now;
+  uint32_t  depth;
+  uint32_t  grant = len;
+
+  if(sc->rate != 0)
+  {
+    depth = sc->rate * SCHED_BURST_MS;
+    if(depth < CDC_DATA_FS_IN_PACKET_SIZE)
+    {
+      depth = CDC_DATA_FS_IN_PACKET_SIZE;
+    }
+
+    /* a long idle fills it without the multiplication overflowing */
+    now = HAL_GetTick();
+    if(now - sc->tick > depth / sc->rate)
+    {
+      sc->tokens = depth;
+    }
+    else
+    {
+      sc->tokens += (now - sc->tick) * sc->rate;
+      sc->tokens = sc->tokens > depth ? depth : sc->tokens;
+    }
+    sc->tick = now;
+
+    grant = grant > sc->tokens ? sc->tokens : grant;
+  }
+
+  if(!sched_prio(instance) && _sched_contended)
+  {
+    grant = (int32_t)grant > sc->deficit ? (sc->deficit > 0 ? sc->deficit : 0) : grant;
+  }
+
+  if(grant < len)
+  {
+    grant -= grant % CDC_DATA_FS_IN_PACKET_SIZE;
+  }
+  return grant;
+}
+
+static inline void
+sched_charge(USBD_CDC_Instance instance, uint32_t len)
+{
+  sched_t*  sc = &_sched[instance];
+
+  if(sc->rate != 0)
+  {
+    sc->tokens -= len;
+  }
+
+  /* what a port sent alone would otherwise starve it once it isn't */
+  if(sched_prio(instance))
+  {
+    _sched_prio_bytes += len;
+  }
+  else if(_sched_contended)
+  {
+    sc->deficit -= len;
+  }
+}
 
 static void
 check_tx_buffer(USBD_CDC_Instance instance)
 {
+  USBD_CDC_HandleTypeDef*   hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  xonxoff_t*                x = &_xonxoff[instance];
   uint32_t buffptr;
   uint32_t buffsize;
+  uint32_t pending;
 
-  if(UserTxBufPtrOut[instance] != UserTxBufPtrIn[instance])
+  if(hcdc == NULL || hcdc->TxState[instance] != 0 || !uart_up(instance))
   {
-    if(UserTxBufPtrOut[instance] > UserTxBufPtrIn[instance]) /* Rollback */
+    return;
+  }
+
+  buffptr = UserTxBufPtrOut[instance];
+
+  /* received XON/XOFF are stepped over in place */
+  while(x->skip_count != 0 && x->skip[x->skip_tail] == buffptr && buffptr != UserTxBufPtrIn[instance])
+  {
+    x->skip_tail = (x->skip_tail + 1) % XON_MAX_SKIP;
+    x->skip_count--;
+    buffptr = (buffptr + 1) % APP_TX_DATA_SIZE;
+    UserTxBufPtrOut[instance] = buffptr;
+  }
+
+  if(buffptr == UserTxBufPtrIn[instance])
+  {
+    return;
+  }
+
+  pending = UserTxBufPtrIn[instance] + APP_TX_DATA_SIZE - buffptr;
+  if(pending >= APP_TX_DATA_SIZE)
+  {
+    pending -= APP_TX_DATA_SIZE;
+  }
+  if(!in_flush_due(instance, pending))
+  {
+    return;
+  }
+
+  if(buffptr > UserTxBufPtrIn[instance]) /* Rollback. tail first */
+  {
+    buffsize = APP_TX_DATA_SIZE - buffptr;
+  }
+  else
+  {
+    buffsize = UserTxBufPtrIn[instance] - buffptr;
+  }
+
+  /* and the transfer ends short of the next one */
+  if(x->skip_count != 0 && x->skip[x->skip_tail] > buffptr &&
+     x->skip[x->skip_tail] < buffptr + buffsize)
+  {
+    buffsize = x->skip[x->skip_tail] - buffptr;
+  }
+
+  buffsize = sched_grant(instance, buffsize);
+  if(buffsize == 0)
+  {
+    /* the scheduler holds it back. sent at a later SOF */
+    _in_policy[instance].flush = 1;
+    return;
+  }
+
+  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, (uint8_t*)&UserTxBufferFS[instance][buffptr], buffsize, instance);
+
+  if(USBD_CDC_TransmitPacket(&hUsbDeviceFS, instance) == USBD_OK)
+  {
+    _tx_in_flight[instance] = buffsize;
+    _in_policy[instance].age = 0;
+    sched_charge(instance, buffsize);
+  }
+}
+
+static inline uint8_t
+port_needs_sof(USBD_CDC_Instance instance)
+{
+  /* received data, published or not, that host hasn't acknowledged */
+  if(uart_rx_ptr(get_uart_handle(instance)) != UserTxBufPtrOut[instance])
+  {
+    return 1;
+  }
+
+  if(_break_state[instance] == BREAK_ON && _break_ms[instance] != BREAK_FOREVER)
+  {
+    return 1;
+  }
+
+  return xonxoff_on(instance) && _uart_txq[instance].in_flight != 0;
+}
+
+/**
+  * @brief  CDC_SOF_FS
+  *         start of frame, while some port has something to time.
+  *         called from USB interrupt context.
+  * @retval Result of the operation: USBD_OK if all operations are OK else USBD_FAIL
+  */
+static int8_t
+CDC_SOF_FS(void)
+{
+  USBD_CDC_Instance instance;
+  uint8_t           busy = 0;
+  uint8_t           n;
+
+  /* nothing to time until the ports are up. don't take SOF until then */
+  if(!_usb_connected)
+  {
+    USBD_CDC_SetSOF(&hUsbDeviceFS, 0);
+    return (USBD_OK);
+  }
+
+  sched_frame();
+
+  for(n = 0; n < 2 * USBD_CDC_Instance_MAX; n++)
+  {
+    instance = sched_order(n);
+    if(instance == USBD_CDC_Instance_MAX || !uart_up(instance))
     {
-      buffsize = APP_RX_DATA_SIZE - UserTxBufPtrOut[instance];
+      continue;
     }
-    else
+
+    if(xonxoff_on(instance) && _uart_txq[instance].in_flight != 0)
     {
-      buffsize = UserTxBufPtrIn[instance] - UserTxBufPtrOut[instance];
+      uart_rx_update(get_uart_handle(instance));
     }
+    uart_rts_update(instance);
+    if(_tx_in_flight[instance] == 0 && UserTxBufPtrOut[instance] != UserTxBufPtrIn[instance] &&
+       _in_policy[instance].age != 0xff)
+    {
+      _in_policy[instance].age++;
+    }
+    check_tx_buffer(instance);
+    uart_break_tick(instance);
+
+    busy |= port_needs_sof(instance);
+  }
 
-    buffptr = UserTxBufPtrOut[instance];
+  if(!busy)
+  {
+    USBD_CDC_SetSOF(&hUsbDeviceFS, 0);
+  }
+  return (USBD_OK);
+}
 
-    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, (uint8_t*)&UserTxBufferFS[instance][buffptr], buffsize, instance);
+//
+// CTS edge on a port with flow control
+//
+void
+HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+  USBD_CDC_Instance   instance = (USBD_CDC_Instance)gpio_cdc_cts_port(GPIO_Pin);
+
+  if(instance >= USBD_CDC_Instance_MAX || !flow_ctrl_on(instance) || !_usb_connected)
+  {
+    return;
+  }
 
-    if(USBD_CDC_TransmitPacket(&hUsbDeviceFS, instance) == USBD_OK)
+  /* stopping can't wait for USB level. the chunk in flight pauses here */
+  if(!uart_tx_allowed(instance))
+  {
+    CLEAR_BIT(get_uart_handle(instance)->Instance->CR3, USART_CR3_DMAT);
+  }
+  uart_event(instance, UART_EV_GATE);
+}
+
+/**
+  * @brief  usbd_cdc_if_usb_irq
+  *         UART events posted since the last time, handled ahead of the
+  *         USB stack in the USB interrupt.
+  * @retval None
+  */
+void
+usbd_cdc_if_usb_irq(void)
+{
+  USBD_CDC_Instance instance;
+  uint32_t          primask;
+  uint8_t           ev;
+  uint16_t          state;
+  uint8_t           n;
+
+  /* in the order SOF serves the ports */
+  for(n = 0; n < 2 * USBD_CDC_Instance_MAX; n++)
+  {
+    instance = sched_order(n);
+    if(instance == USBD_CDC_Instance_MAX || _uart_ev[instance] == 0)
     {
-      UserTxBufPtrOut[instance] += buffsize;
-      if (UserTxBufPtrOut[instance] == APP_RX_DATA_SIZE)
-      {
-        UserTxBufPtrOut[instance] = 0;
-      }
+      continue;
+    }
+
+    /* the UART's old setup. ComPort_Config or the close drops them */
+    if(!uart_up(instance))
+    {
+      continue;
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    ev = _uart_ev[instance];
+    state = _uart_ev_state[instance];
+    _uart_ev[instance] = 0;
+    _uart_ev_state[instance] = 0;
+    __set_PRIMASK(primask);
+
+    if(ev & UART_EV_DMA_ERR)
+    {
+      cdc_uart_restart(&_uart_setup[instance]);
+      work_post(WORK_CDC_POLL);
     }
+
+    if(ev & UART_EV_TX)
+    {
+      uart_tx_done(instance);
+    }
+
+    if((ev & UART_EV_IDLE) && (_in_policy[instance].flags & CDC_LATENCY_ADAPTIVE))
+    {
+      _in_policy[instance].flush = 1;
+      _in_policy[instance].timer = 1;
+    }
+
+    if(ev & (UART_EV_RX | UART_EV_IDLE))
+    {
+      uart_rx_update(get_uart_handle(instance));
+    }
+
+    if(ev & UART_EV_GATE)
+    {
+      uart_tx_gate(instance);
+    }
+
+    if(state != 0)
+    {
+      USBD_CDC_SerialState(&hUsbDeviceFS, CDC_SERIAL_STATE_DCD | CDC_SERIAL_STATE_DSR | state, instance);
+    }
+  }
+}
+
+//
+// the USB interrupt and this port's UART level ones, for a UART setup
+// that runs unmasked. the other ports and SysTick carry on meanwhile
+//
+static inline void
+port_irq_hold(USBD_CDC_Instance instance, uint8_t hold)
+{
+  if(hold)
+  {
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    usart_irq_hold(get_uart_handle(instance), 1);
+  }
+  else
+  {
+    usart_irq_hold(get_uart_handle(instance), 0);
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
   }
 }
 
+//
+// deferred side of SET_LINE_CODING, of CDC_Init_FS/CDC_DeInit_FS and of
+// the DMA error recovery, run as WORK_CDC_POLL. the USB interrupt works
+// on the queues and the UART level ones on the same USART, so each port
+// is checked and its queues handed over with interrupts masked, which
+// is IRQ_PROF_MASKED in a measurement build. the HAL re-init after that
+// only holds off the USB interrupt and the port's own, as the EXTI for
+// CTS only ever clears DMAT. a port that has to wait for its queues is
+// looked at again every ms.
+//
 void
-HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
+usbd_cdc_if_poll(void)
 {
-  check_tx_buffer(USBD_CDC_Instance_0);
-  check_tx_buffer(USBD_CDC_Instance_1);
+  USBD_CDC_Instance   instance;
+  UART_HandleTypeDef* handle;
+  uint32_t            primask;
+  uint8_t             setup;
+  uint8_t             again = 0;
+
+  for(instance = USBD_CDC_Instance_0; instance < USBD_CDC_Instance_MAX; instance++)
+  {
+    if(_uart_setup[instance].pending == CDC_UART_SETUP_NONE)
+    {
+      continue;
+    }
+
+    handle = get_uart_handle(instance);
+
+    port_irq_hold(instance, 1);
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    IRQ_PROF_ENTER();
+
+    /* the ring has to go to host before the switch. no coalescing */
+    if(_uart_setup[instance].pending == CDC_UART_SETUP_FULL)
+    {
+      _in_policy[instance].flush = 1;
+      uart_rx_update(handle);
+    }
+
+    setup = cdc_uart_step(&_uart_setup[instance], handle, LineCoding[instance].bitrate,
+                          _uart_txq[instance].in_flight == 0,
+                          _tx_in_flight[instance] == 0 &&
+                          UserTxBufPtrOut[instance] == UserTxBufPtrIn[instance],
+                          _tx_in_flight[instance] == 0);
+
+    if(setup == CDC_UART_SETUP_FULL || setup == CDC_UART_SETUP_CLOSE)
+    {
+      uart_tx_stop(instance);
+    }
+    if(setup == CDC_UART_SETUP_CLOSE)
+    {
+      _uart_ev[instance] = 0;
+      _uart_ev_state[instance] = 0;
+    }
+
+    again |= (_uart_setup[instance].pending != CDC_UART_SETUP_NONE);
+
+    IRQ_PROF_EXIT(IRQ_PROF_MASKED);
+    __set_PRIMASK(primask);
+
+    if(setup == CDC_UART_SETUP_CLOSE)
+    {
+      if(HAL_UART_DeInit(handle) != HAL_OK)
+      {
+        Error_Handler();
+      }
+    }
+    else if(setup != CDC_UART_SETUP_NONE)
+    {
+      ComPort_Config(instance);
+      uart_tx_kick(instance);
+    }
+
+    port_irq_hold(instance, 0);
+  }
+
+  if(again)
+  {
+    work_post_in(WORK_CDC_POLL, 1);
+  }
 }
+
+#endif /* !USBD_CDC_MUX */
@@ -0,0 +1,1007 @@
+#include "usbd_cdc_if.h"
+#include "usart.h"
+#include "cdc_uart.h"
+#include "work.h"
+#include "irq.h"
+#include "cdc_mux_proto.h"
+
+#if (USBD_CDC_MUX == 1)
+
+//
+// multiplexed mode. a single CDC port carries every USART as a channel of
+// the framing described in cdc_mux_proto.h. this replaces usbd_cdc_if.c
+// and provides the same interface to the class and the interrupt handlers.
+//
+// MUX_RX_RING_SIZE   : UART RX -> USB IN. circular DMA ring per channel
+// MUX_TXQ_SIZE       : USB OUT -> UART TX byte queue per channel
+// MUX_OUT_XFER_SIZE  : OUT transfer buffer. frames are parsed out of it
+// MUX_IN_XFER_SIZE   : IN transfer buffer. frames of all channels are
+//                      packed into it
+// MUX_CREDIT_BATCH   : freed UART TX queue space is returned to host in
+//                      batches of at least this, or when the queue drains
+//
+#define MUX_RX_RING_SIZE    256
+#define MUX_TXQ_SIZE        512
+#define MUX_OUT_XFER_SIZE   256
+#define MUX_IN_XFER_SIZE    256
+#define MUX_CREDIT_BATCH    64
+
+//
+// LINE_CODING frames are applied as deferred work by usbd_cdc_if_poll(),
+// with the state machine in cdc_uart.c that usbd_cdc_if.c uses for
+// SET_LINE_CODING. IN frames are copies, so no IN transfer ever holds the
+// re-init back. the channel ring is smaller than a port's.
+// CDC_Init_FS and CDC_DeInit_FS leave the UARTs to the same deferred work.
+//
+
+//
+// UART level handlers only post events to the channel, the same way
+// usbd_cdc_if.c does. usbd_cdc_if_usb_irq() handles them in the USB
+// interrupt, so channel state below is only changed at USB level
+//
+#define MUX_EV_RX           0x01    /* RX DMA half/full or line idle    */
+#define MUX_EV_TX           0x02    /* UART TX DMA chunk done           */
+#define MUX_EV_ERR          0x04    /* SERIAL_STATE bits in ev_state    */
+#define MUX_EV_DMA_ERR      0x08    /* a DMA channel has stopped        */
+
+/* frame parser state */
+#define MUX_PARSE_HDR       0
+#define MUX_PARSE_LEN       1
+#define MUX_PARSE_PAYLOAD   2
+
+typedef struct
+{
+  /* UART RX -> host */
+  uint8_t       rx_ring[MUX_RX_RING_SIZE];
+  __IO uint32_t rx_in;          /* written by UART RX DMA                   */
+  uint32_t      rx_out;         /* read by the IN frame builder             */
+  uint32_t      tx_credit;      /* DATA bytes host has granted us           */
+
+  /* host -> UART TX */
+  uint8_t       txq[MUX_TXQ_SIZE];
+  uint32_t      txq_head;       /* written by the OUT frame parser          */
+  uint32_t      txq_tail;       /* read by UART TX DMA                      */
+  uint32_t      txq_count;      /* bytes queued, including the in flight    */
+  uint32_t      txq_in_flight;  /* bytes from tail owned by UART TX DMA     */
+  uint32_t      credit_return;  /* freed queue space not yet granted back   */
+
+  /* UART errors. counted for the debugger, reported in SERIAL_STATE */
+  cdc_uart_err_t  err;
+  uint16_t      serial_state;   /* one shot bits not sent to host yet       */
+
+  /* posted at UART level */
+  __IO uint8_t  ev;
+  __IO uint16_t ev_state;
+
+  USBD_CDC_LineCodingTypeDef  line_coding;
+  cdc_uart_setup_t            setup;
+} mux_channel_t;
+
+typedef struct
+{
+  uint8_t   state;
+  uint8_t   hdr;
+  uint8_t   len;
+  uint8_t   pos;
+  uint8_t   ctl[CDC_MUX_LINE_CODING_SIZE];  /* payload of non DATA frames */
+} mux_parser_t;
+
+static mux_channel_t      _mux_ch[CDC_MUX_NUM_CHANNELS];
+static mux_parser_t       _mux_parser;
+static uint8_t            _mux_sync_pending = 0;
+static uint8_t            _mux_rr = 0;
+
+static uint8_t            _mux_out_buf[MUX_OUT_XFER_SIZE];
+static uint8_t            _mux_in_buf[MUX_IN_XFER_SIZE];
+
+/* line coding of the CDC port itself. only kept for the host tty */
+static USBD_CDC_LineCodingTypeDef _mux_pipe_line_coding =
+{
+  115200, /* baud rate*/
+  0x00,   /* stop bits-1*/
+  0x00,   /* parity - none*/
+  0x08    /* nb. of bits 8*/
+};
+
+extern USBD_HandleTypeDef hUsbDeviceFS;
+
+static int8_t CDC_Init_FS     (void);
+static int8_t CDC_DeInit_FS   (void);
+static int8_t CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance instance);
+static int8_t CDC_Receive_FS  (uint8_t* pbuf, uint32_t *Len, USBD_CDC_Instance instance);
+static int8_t CDC_TransmitCplt_FS (uint8_t* pbuf, uint32_t *Len, USBD_CDC_Instance instance);
+static int8_t CDC_SOF_FS      (void);
+static void mux_in_kick(void);
+
+USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
+{
+  CDC_Init_FS,
+  CDC_DeInit_FS,
+  CDC_Control_FS,
+  CDC_Receive_FS,
+  CDC_TransmitCplt_FS,
+  CDC_SOF_FS,
+};
+
+static inline UART_HandleTypeDef*
+get_uart_handle(uint8_t chan)
+{
+  switch(chan)
+  {
+  case 0:
+    return &huart1;
+
+  case 1:
+    return &huart2;
+
+  case 2:
+    return &huart3;
+
+  default:
+    break;
+  }
+  return NULL;
+}
+
+static inline uint8_t
+get_uart_channel(UART_HandleTypeDef* huart)
+{
+  if(huart == &huart1)
+  {
+    return 0;
+  }
+  if(huart == &huart2)
+  {
+    return 1;
+  }
+  return 2;
+}
+
+/* not while CDC_Init_FS/CDC_DeInit_FS wait for usbd_cdc_if_poll() */
+static inline uint8_t
+uart_up(uint8_t chan)
+{
+  return cdc_uart_up(&_mux_ch[chan].setup);
+}
+
+static inline void
+uart_tx_kick(uint8_t chan)
+{
+  mux_channel_t*  ch = &_mux_ch[chan];
+  uint32_t        len;
+  uint32_t        primask;
+
+  if(ch->txq_in_flight != 0 || ch->txq_count == 0 || !uart_up(chan))
+  {
+    return;
+  }
+
+  len = MUX_TXQ_SIZE - ch->txq_tail;
+  if(len > ch->txq_count)
+  {
+    len = ch->txq_count;
+  }
+
+  ch->txq_in_flight = len;
+
+  /* HAL_UART_ErrorCallback sets the handle state too */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  HAL_UART_Transmit_DMA(get_uart_handle(chan), &ch->txq[ch->txq_tail], len);
+  __set_PRIMASK(primask);
+}
+
+//
+// host never sends beyond the credit it got, so there's always room.
+// anything over that is a protocol violation and is dropped.
+//
+static inline void
+uart_txq_put(uint8_t chan, const uint8_t* buf, uint32_t len)
+{
+  mux_channel_t*  ch = &_mux_ch[chan];
+  uint32_t        n;
+
+  if(len > MUX_TXQ_SIZE - ch->txq_count)
+  {
+    len = MUX_TXQ_SIZE - ch->txq_count;
+  }
+  ch->txq_count += len;
+
+  while(len != 0)
+  {
+    n = MUX_TXQ_SIZE - ch->txq_head;
+    if(n > len)
+    {
+      n = len;
+    }
+    memcpy(&ch->txq[ch->txq_head], buf, n);
+
+    ch->txq_head += n;
+    if(ch->txq_head == MUX_TXQ_SIZE)
+    {
+      ch->txq_head = 0;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+//
+// UART TX DMA is about to be stopped by a re-init. what it hasn't handed
+// to the USART yet stays queued
+//
+static inline void
+uart_tx_stop(uint8_t chan)
+{
+  mux_channel_t*      ch = &_mux_ch[chan];
+  UART_HandleTypeDef* handle = get_uart_handle(chan);
+  uint32_t            sent;
+
+  if(ch->txq_in_flight == 0)
+  {
+    return;
+  }
+
+  CLEAR_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+  sent = ch->txq_in_flight - __HAL_DMA_GET_COUNTER(handle->hdmatx);
+
+  ch->txq_tail += sent;
+  if(ch->txq_tail >= MUX_TXQ_SIZE)
+  {
+    ch->txq_tail -= MUX_TXQ_SIZE;
+  }
+  ch->txq_count     -= sent;
+  ch->credit_return += sent;
+  ch->txq_in_flight  = 0;
+}
+
+static void
+mux_port_config(uint8_t chan)
+{
+  mux_channel_t*      ch = &_mux_ch[chan];
+  UART_HandleTypeDef* handle = get_uart_handle(chan);
+  uint32_t            primask;
+
+  cdc_uart_config(handle, &ch->line_coding);
+
+  /* what the old setup posted and USB level hasn't seen yet. errors still count */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  ch->ev &= MUX_EV_ERR;
+  __set_PRIMASK(primask);
+
+  ch->rx_in   = 0;
+  ch->rx_out  = 0;
+
+  cdc_uart_rx_start(handle, ch->rx_ring, MUX_RX_RING_SIZE);
+}
+
+static void
+mux_sync(void)
+{
+  mux_channel_t*  ch;
+  uint8_t         chan;
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    ch = &_mux_ch[chan];
+
+    /* new session. nothing granted yet and nothing stale sent */
+    ch->tx_credit     = 0;
+    ch->rx_out        = ch->rx_in;
+    ch->credit_return = MUX_TXQ_SIZE - ch->txq_count;
+    ch->serial_state  = 0;
+  }
+  _mux_sync_pending = 1;
+}
+
+static void
+mux_frame_done(void)
+{
+  mux_parser_t*   p = &_mux_parser;
+  uint8_t         chan = CDC_MUX_HDR_CHAN(p->hdr);
+
+  switch(CDC_MUX_HDR_TYPE(p->hdr))
+  {
+  case CDC_MUX_TYPE_CREDIT:
+    if(chan < CDC_MUX_NUM_CHANNELS && p->len == CDC_MUX_CREDIT_SIZE)
+    {
+      _mux_ch[chan].tx_credit += (uint32_t)(p->ctl[0] | (p->ctl[1] << 8));
+    }
+    break;
+
+  case CDC_MUX_TYPE_LINE_CODING:
+    if(chan < CDC_MUX_NUM_CHANNELS && p->len == CDC_MUX_LINE_CODING_SIZE)
+    {
+      _mux_ch[chan].line_coding.bitrate    = (uint32_t)(p->ctl[0] | (p->ctl[1] << 8) |
+                                                        (p->ctl[2] << 16) | (p->ctl[3] << 24));
+      _mux_ch[chan].line_coding.format     = p->ctl[4];
+      _mux_ch[chan].line_coding.paritytype = p->ctl[5];
+      _mux_ch[chan].line_coding.datatype   = p->ctl[6];
+
+      /* applied by usbd_cdc_if_poll() */
+      cdc_uart_request(&_mux_ch[chan].setup, get_uart_handle(chan), &_mux_ch[chan].line_coding);
+      work_post(WORK_CDC_POLL);
+    }
+    break;
+
+  case CDC_MUX_TYPE_SYNC:
+    if(chan == CDC_MUX_SYNC_CHAN && p->len == CDC_MUX_SYNC_SIZE &&
+       memcmp(p->ctl, CDC_MUX_SYNC_MAGIC, CDC_MUX_SYNC_SIZE) == 0)
+    {
+      mux_sync();
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+//
+// OUT stream parser. frames run across transfer boundaries, so the state
+// is kept between calls. DATA payload is copied straight into the UART TX
+// queue of its channel, other payloads are collected in ctl.
+//
+static void
+mux_parse(const uint8_t* buf, uint32_t len)
+{
+  mux_parser_t*   p = &_mux_parser;
+  uint32_t        n;
+  uint8_t         chan;
+
+  while(len != 0)
+  {
+    switch(p->state)
+    {
+    case MUX_PARSE_HDR:
+      p->hdr    = *buf++;
+      len--;
+      p->state  = MUX_PARSE_LEN;
+      break;
+
+    case MUX_PARSE_LEN:
+      p->len    = *buf++;
+      len--;
+      p->pos    = 0;
+      if(p->len == 0)
+      {
+        mux_frame_done();
+        p->state = MUX_PARSE_HDR;
+      }
+      else
+      {
+        p->state = MUX_PARSE_PAYLOAD;
+      }
+      break;
+
+    case MUX_PARSE_PAYLOAD:
+      n = p->len - p->pos;
+      if(n > len)
+      {
+        n = len;
+      }
+
+      chan = CDC_MUX_HDR_CHAN(p->hdr);
+      if(CDC_MUX_HDR_TYPE(p->hdr) == CDC_MUX_TYPE_DATA)
+      {
+        if(chan < CDC_MUX_NUM_CHANNELS)
+        {
+          uart_txq_put(chan, buf, n);
+        }
+      }
+      else if(p->pos < sizeof(p->ctl))
+      {
+        memcpy(&p->ctl[p->pos], buf,
+            (p->pos + n > sizeof(p->ctl)) ? sizeof(p->ctl) - p->pos : n);
+      }
+
+      buf     += n;
+      len     -= n;
+      p->pos  += n;
+      if(p->pos == p->len)
+      {
+        mux_frame_done();
+        p->state = MUX_PARSE_HDR;
+      }
+      break;
+    }
+  }
+}
+
+static inline uint32_t
+mux_put_hdr(uint32_t len, uint8_t type, uint8_t chan, uint8_t plen)
+{
+  _mux_in_buf[len++] = CDC_MUX_HDR(type, chan);
+  _mux_in_buf[len++] = plen;
+  return len;
+}
+
+//
+// packs whatever is due into one IN transfer. SYNC echo first, then credit
+// returns and UART errors, and then DATA of every channel within its credit, starting at a
+// different channel each time so a busy port can't starve the others.
+//
+static void
+mux_in_kick(void)
+{
+  USBD_CDC_HandleTypeDef*   hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  mux_channel_t*            ch;
+  uint32_t                  len = 0;
+  uint32_t                  avail, n, credit;
+  uint8_t                   i, chan;
+
+  if(hcdc == NULL || hcdc->TxState[USBD_CDC_Instance_0] != 0)
+  {
+    return;
+  }
+
+  if(_mux_sync_pending)
+  {
+    len = mux_put_hdr(len, CDC_MUX_TYPE_SYNC, CDC_MUX_SYNC_CHAN, CDC_MUX_SYNC_SIZE);
+    memcpy(&_mux_in_buf[len], CDC_MUX_SYNC_MAGIC, CDC_MUX_SYNC_SIZE);
+    len += CDC_MUX_SYNC_SIZE;
+    _mux_sync_pending = 0;
+  }
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    ch = &_mux_ch[chan];
+    if(ch->credit_return == 0 ||
+       (ch->credit_return < MUX_CREDIT_BATCH && ch->txq_count != 0))
+    {
+      continue;
+    }
+
+    credit = ch->credit_return > 0xffff ? 0xffff : ch->credit_return;
+    ch->credit_return -= credit;
+
+    len = mux_put_hdr(len, CDC_MUX_TYPE_CREDIT, chan, CDC_MUX_CREDIT_SIZE);
+    _mux_in_buf[len++] = (uint8_t)(credit);
+    _mux_in_buf[len++] = (uint8_t)(credit >> 8);
+  }
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    ch = &_mux_ch[chan];
+    if(ch->serial_state == 0)
+    {
+      continue;
+    }
+
+    len = mux_put_hdr(len, CDC_MUX_TYPE_SERIAL_STATE, chan, CDC_MUX_SERIAL_STATE_SIZE);
+    _mux_in_buf[len++] = LOBYTE(ch->serial_state);
+    _mux_in_buf[len++] = HIBYTE(ch->serial_state);
+    ch->serial_state = 0;
+  }
+
+  for(i = 0; i < CDC_MUX_NUM_CHANNELS; i++)
+  {
+    chan  = (_mux_rr + i) % CDC_MUX_NUM_CHANNELS;
+    ch    = &_mux_ch[chan];
+
+    if(len + CDC_MUX_HDR_SIZE >= MUX_IN_XFER_SIZE)
+    {
+      break;
+    }
+
+    if(ch->rx_in >= ch->rx_out)
+    {
+      avail = ch->rx_in - ch->rx_out;
+    }
+    else
+    {
+      avail = MUX_RX_RING_SIZE - ch->rx_out + ch->rx_in;
+    }
+    if(avail > ch->tx_credit)
+    {
+      avail = ch->tx_credit;
+    }
+    if(avail > MUX_IN_XFER_SIZE - len - CDC_MUX_HDR_SIZE)
+    {
+      avail = MUX_IN_XFER_SIZE - len - CDC_MUX_HDR_SIZE;
+    }
+    if(avail > CDC_MUX_MAX_PAYLOAD)
+    {
+      avail = CDC_MUX_MAX_PAYLOAD;
+    }
+    if(avail == 0)
+    {
+      continue;
+    }
+
+    len = mux_put_hdr(len, CDC_MUX_TYPE_DATA, chan, avail);
+    ch->tx_credit -= avail;
+
+    /* ring may wrap inside the frame */
+    while(avail != 0)
+    {
+      n = MUX_RX_RING_SIZE - ch->rx_out;
+      if(n > avail)
+      {
+        n = avail;
+      }
+      memcpy(&_mux_in_buf[len], &ch->rx_ring[ch->rx_out], n);
+
+      len         += n;
+      avail       -= n;
+      ch->rx_out  += n;
+      if(ch->rx_out == MUX_RX_RING_SIZE)
+      {
+        ch->rx_out = 0;
+      }
+    }
+  }
+  _mux_rr = (_mux_rr + 1) % CDC_MUX_NUM_CHANNELS;
+
+  if(len == 0)
+  {
+    return;
+  }
+
+  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, _mux_in_buf, len, USBD_CDC_Instance_0);
+  USBD_CDC_TransmitPacket(&hUsbDeviceFS, USBD_CDC_Instance_0);
+}
+
+/**
+  * @brief  CDC_Init_FS
+  *         Initializes every multiplexed UART and the pipe buffers
+  * @param  None
+  * @retval Result of the operation: USBD_OK if all operations are OK else USBD_FAIL
+  */
+static int8_t
+CDC_Init_FS(void)
+{
+  uint8_t chan;
+
+  _mux_parser.state = MUX_PARSE_HDR;
+  _mux_sync_pending = 0;
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    _mux_ch[chan].line_coding = _mux_pipe_line_coding;
+    _mux_ch[chan].tx_credit   = 0;
+    _mux_ch[chan].serial_state = 0;
+
+    /* the UART is set up by usbd_cdc_if_poll(). nothing old goes out */
+    _mux_ch[chan].setup.pending = CDC_UART_SETUP_OPEN;
+    uart_tx_stop(chan);
+    _mux_ch[chan].rx_in         = 0;
+    _mux_ch[chan].rx_out        = 0;
+    _mux_ch[chan].txq_head      = 0;
+    _mux_ch[chan].txq_tail      = 0;
+    _mux_ch[chan].txq_count     = 0;
+    _mux_ch[chan].txq_in_flight = 0;
+
+    /* host hands out and asks for credit after its SYNC */
+    _mux_ch[chan].credit_return = 0;
+  }
+
+  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, _mux_in_buf, 0, USBD_CDC_Instance_0);
+  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, _mux_out_buf, MUX_OUT_XFER_SIZE, USBD_CDC_Instance_0);
+
+  work_post(WORK_CDC_POLL);
+  return (USBD_OK);
+}
+
+/**
+  * @brief  CDC_DeInit_FS
+  *         DeInitializes the multiplexed UARTs
+  * @param  None
+  * @retval Result of the operation: USBD_OK if all operations are OK else USBD_FAIL
+  */
+static int8_t
+CDC_DeInit_FS(void)
+{
+  uint8_t chan;
+
+  USBD_CDC_SetSOF(&hUsbDeviceFS, 0);
+
+  /* HAL_UART_DeInit is left to usbd_cdc_if_poll() */
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    _mux_ch[chan].setup.pending = CDC_UART_SETUP_CLOSE;
+  }
+
+  work_post(WORK_CDC_POLL);
+  return (USBD_OK);
+}
+
+/**
+  * @brief  CDC_Control_FS
+  *         Manage the CDC class requests. the UARTs are configured through
+  *         LINE_CODING frames, the pipe's own line coding is only stored
+  * @param  cmd: Command code
+  * @param  pbuf: Buffer containing command data (request parameters)
+  * @param  length: Number of data to be sent (in bytes)
+  * @retval Result of the operation: USBD_OK if all operations are OK else USBD_FAIL
+  */
+static int8_t
+CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length, USBD_CDC_Instance instance)
+{
+  uint32_t  irqs[3];
+  uint32_t  sum[3] = { 0, 0, 0 };
+  uint8_t   chan;
+  uint8_t   i;
+
+  switch (cmd)
+  {
+  case CDC_SET_LINE_CODING:
+    _mux_pipe_line_coding.bitrate    = (uint32_t)(pbuf[0] | (pbuf[1] << 8) |
+                                                 (pbuf[2] << 16) | (pbuf[3] << 24));
+    _mux_pipe_line_coding.format     = pbuf[4];
+    _mux_pipe_line_coding.paritytype = pbuf[5];
+    _mux_pipe_line_coding.datatype   = pbuf[6];
+    break;
+
+  case CDC_GET_LINE_CODING:
+    pbuf[0] = (uint8_t)(_mux_pipe_line_coding.bitrate);
+    pbuf[1] = (uint8_t)(_mux_pipe_line_coding.bitrate >> 8);
+    pbuf[2] = (uint8_t)(_mux_pipe_line_coding.bitrate >> 16);
+    pbuf[3] = (uint8_t)(_mux_pipe_line_coding.bitrate >> 24);
+    pbuf[4] = _mux_pipe_line_coding.format;
+    pbuf[5] = _mux_pipe_line_coding.paritytype;
+    pbuf[6] = _mux_pipe_line_coding.datatype;
+    break;
+
+  case CDC_GET_IRQ_COUNT:
+    /* the pipe carries every channel, so it reports their sum */
+    for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+    {
+      usart_irq_count(get_uart_handle(chan), irqs);
+      for(i = 0; i < 3; i++)
+      {
+        sum[i] += irqs[i];
+      }
+    }
+    for(i = 0; i < 3; i++)
+    {
+      pbuf[4 * i]     = (uint8_t)(sum[i]);
+      pbuf[4 * i + 1] = (uint8_t)(sum[i] >> 8);
+      pbuf[4 * i + 2] = (uint8_t)(sum[i] >> 16);
+      pbuf[4 * i + 3] = (uint8_t)(sum[i] >> 24);
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return (USBD_OK);
+}
+
+/**
+  * @brief  CDC_Receive_FS
+  *         an OUT transfer of frames has landed in _mux_out_buf. it's
+  *         parsed into the channel queues right here, so the EP is
+  *         re-armed on the same buffer straight away.
+  * @param  Buf: Buffer of data to be received
+  * @param  Len: Number of data received (in bytes)
+  * @retval Result of the operation: USBD_OK if all operations are OK else USBD_FAIL
+  */
+static int8_t
+CDC_Receive_FS (uint8_t* Buf, uint32_t *Len, USBD_CDC_Instance instance)
+{
+  uint8_t chan;
+
+  mux_parse(Buf, *Len);
+
+  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, _mux_out_buf, MUX_OUT_XFER_SIZE, USBD_CDC_Instance_0);
+  USBD_CDC_ReceivePacket(&hUsbDeviceFS, USBD_CDC_Instance_0);
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    uart_tx_kick(chan);
+  }
+
+  /* SYNC echo or credit returned by a LINE_CODING */
+  mux_in_kick();
+  return (USBD_OK);
+}
+
+/**
+  * @brief  CDC_TransmitCplt_FS
+  *         IN transfer has been acknowledged by host. _mux_in_buf is free
+  *         again and the next one is packed right away.
+  * @param  Buf: Buffer of data that was sent
+  * @param  Len: Number of data sent (in bytes)
+  * @retval Result of the operation: USBD_OK if all operations are OK else USBD_FAIL
+  */
+static int8_t
+CDC_TransmitCplt_FS(uint8_t* Buf, uint32_t *Len, USBD_CDC_Instance instance)
+{
+  mux_in_kick();
+  return (USBD_OK);
+}
+
+static inline void
+mux_event(uint8_t chan, uint8_t ev)
+{
+  _mux_ch[chan].ev |= ev;
+  NVIC_SetPendingIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+static inline void
+uart_tx_done(uint8_t chan)
+{
+  mux_channel_t*  ch = &_mux_ch[chan];
+
+  ch->txq_tail += ch->txq_in_flight;
+  if(ch->txq_tail >= MUX_TXQ_SIZE)
+  {
+    ch->txq_tail -= MUX_TXQ_SIZE;
+  }
+  ch->txq_count     -= ch->txq_in_flight;
+  ch->credit_return += ch->txq_in_flight;
+  ch->txq_in_flight  = 0;
+
+  uart_tx_kick(chan);
+}
+
+void
+HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+  mux_event(get_uart_channel(huart), MUX_EV_TX);
+}
+
+static inline void
+uart_rx_update(UART_HandleTypeDef* huart)
+{
+  mux_channel_t*  ch = &_mux_ch[get_uart_channel(huart)];
+  uint32_t        ptr;
+
+  /* DMA counts down from MUX_RX_RING_SIZE. what is consumed is our write index */
+  ptr = MUX_RX_RING_SIZE - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+  if(ptr == MUX_RX_RING_SIZE)
+  {
+    ptr = 0;
+  }
+  ch->rx_in = ptr;
+
+  /* packed into the IN transfer at the next SOF */
+  USBD_CDC_SetSOF(&hUsbDeviceFS, 1);
+}
+
+void
+HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  mux_event(get_uart_channel(huart), MUX_EV_RX);
+}
+
+void
+HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  mux_event(get_uart_channel(huart), MUX_EV_RX);
+}
+
+void
+usbd_cdc_if_uart_irq(UART_HandleTypeDef* huart)
+{
+  if(__HAL_UART_GET_FLAG(huart, UART_FLAG_IDLE) != RESET &&
+     __HAL_UART_GET_IT_SOURCE(huart, UART_IT_IDLE) != RESET)
+  {
+    __HAL_UART_CLEAR_IDLEFLAG(huart);
+    mux_event(get_uart_channel(huart), MUX_EV_RX);
+  }
+}
+
+//
+// same recovery as usbd_cdc_if.c. the error is reported on the channel
+// in a SERIAL_STATE frame
+//
+void
+HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  uint8_t         chan = get_uart_channel(huart);
+  mux_channel_t*  ch = &_mux_ch[chan];
+  uint32_t        code = huart->ErrorCode;
+  uint16_t        state;
+  uint8_t         ev = MUX_EV_ERR;
+  uint32_t        primask;
+
+  state = cdc_uart_error(huart, code, &ch->err, ch->txq_in_flight != 0);
+  if(code & HAL_UART_ERROR_DMA)
+  {
+    ev |= MUX_EV_DMA_ERR;
+  }
+
+  if(state == 0 && !(ev & MUX_EV_DMA_ERR))
+  {
+    return;
+  }
+
+  /* a higher priority USART can post in between */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  ch->ev_state |= state;
+  __set_PRIMASK(primask);
+
+  mux_event(chan, ev);
+}
+
+//
+// SOF is only taken while a channel has received data it has credit
+// for. new credit and everything else kick the IN side by themselves
+//
+static int8_t
+CDC_SOF_FS(void)
+{
+  uint8_t chan;
+
+  mux_in_kick();
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    if(_mux_ch[chan].rx_in != _mux_ch[chan].rx_out && _mux_ch[chan].tx_credit != 0)
+    {
+      return (USBD_OK);
+    }
+  }
+
+  USBD_CDC_SetSOF(&hUsbDeviceFS, 0);
+  return (USBD_OK);
+}
+
+/**
+  * @brief  usbd_cdc_if_usb_irq
+  *         channel events posted since the last time, handled ahead of
+  *         the USB stack in the USB interrupt.
+  * @retval None
+  */
+void
+usbd_cdc_if_usb_irq(void)
+{
+  mux_channel_t*  ch;
+  uint8_t         chan;
+  uint32_t        primask;
+  uint8_t         ev;
+  uint8_t         kick = 0;
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    ch = &_mux_ch[chan];
+
+    /* the UART's old setup. mux_port_config or the close drops them */
+    if(ch->ev == 0 || !uart_up(chan))
+    {
+      continue;
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    ev = ch->ev;
+    ch->serial_state |= ch->ev_state;
+    ch->ev = 0;
+    ch->ev_state = 0;
+    __set_PRIMASK(primask);
+
+    if(ev & MUX_EV_DMA_ERR)
+    {
+      /* re-initialized by usbd_cdc_if_poll() right away */
+      cdc_uart_restart(&ch->setup);
+      work_post(WORK_CDC_POLL);
+    }
+
+    if(ev & MUX_EV_TX)
+    {
+      uart_tx_done(chan);
+    }
+
+    if(ev & MUX_EV_RX)
+    {
+      uart_rx_update(get_uart_handle(chan));
+    }
+
+    kick = 1;
+  }
+
+  if(kick)
+  {
+    mux_in_kick();
+  }
+}
+
+//
+// the USB interrupt and this channel's UART level ones, for a UART setup
+// that runs unmasked
+//
+static inline void
+mux_irq_hold(uint8_t chan, uint8_t hold)
+{
+  if(hold)
+  {
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    usart_irq_hold(get_uart_handle(chan), 1);
+  }
+  else
+  {
+    usart_irq_hold(get_uart_handle(chan), 0);
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+  }
+}
+
+//
+// deferred side of LINE_CODING frames, of CDC_Init_FS/CDC_DeInit_FS and
+// of the DMA error recovery, run as WORK_CDC_POLL. each channel is checked
+// and its queues handed over with interrupts masked, the HAL re-init
+// after that only holds off the USB interrupt and the channel's own
+//
+void
+usbd_cdc_if_poll(void)
+{
+  mux_channel_t*      ch;
+  UART_HandleTypeDef* handle;
+  uint32_t            primask;
+  uint8_t             setup;
+  uint8_t             chan;
+  uint8_t             again = 0;
+
+  for(chan = 0; chan < CDC_MUX_NUM_CHANNELS; chan++)
+  {
+    ch = &_mux_ch[chan];
+    if(ch->setup.pending == CDC_UART_SETUP_NONE)
+    {
+      continue;
+    }
+
+    handle = get_uart_handle(chan);
+
+    mux_irq_hold(chan, 1);
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    IRQ_PROF_ENTER();
+
+    if(ch->setup.pending == CDC_UART_SETUP_FULL)
+    {
+      uart_rx_update(handle);
+    }
+
+    /* IN frames are copies. nothing reads the ring after it */
+    setup = cdc_uart_step(&ch->setup, handle, ch->line_coding.bitrate,
+                          ch->txq_in_flight == 0, ch->rx_out == ch->rx_in, 1);
+
+    if(setup == CDC_UART_SETUP_FULL || setup == CDC_UART_SETUP_CLOSE)
+    {
+      uart_tx_stop(chan);
+    }
+    if(setup == CDC_UART_SETUP_CLOSE)
+    {
+      ch->ev = 0;
+      ch->ev_state = 0;
+    }
+
+    again |= (ch->setup.pending != CDC_UART_SETUP_NONE);
+
+    IRQ_PROF_EXIT(IRQ_PROF_MASKED);
+    __set_PRIMASK(primask);
+
+    if(setup == CDC_UART_SETUP_CLOSE)
+    {
+      if(HAL_UART_DeInit(handle) != HAL_OK)
+      {
+        Error_Handler();
+      }
+    }
+    else if(setup != CDC_UART_SETUP_NONE)
+    {
+      mux_port_config(chan);
+      uart_tx_kick(chan);
+
+      /* credit freed by uart_tx_stop() */
+      if(setup == CDC_UART_SETUP_FULL)
+      {
+        mux_in_kick();
+      }
+    }
+
+    mux_irq_hold(chan, 0);
+  }
+
+  if(again)
+  {
+    work_post_in(WORK_CDC_POLL, 1);
+  }
+}
+
+#endif /* USBD_CDC_MUX */
@@ -3,12 +3,79 @@
 #include "usbd_def.h"
 #include "usbd_core.h"
 #include "usbd_cdc.h"
+#include "irq.h"
 
 PCD_HandleTypeDef hpcd_USB_FS;
 void _Error_Handler(char * file, int line);
 
+/* SOF interrupt as last asked for by the class. HAL drops it on resume */
+static uint8_t _sof_enabled = 0;
+
 void HAL_PCDEx_SetConnectionState(PCD_HandleTypeDef *hpcd, uint8_t state);
 
+//
+// PMA layout.
+//
+// STM32 USB has 512 bytes of PMA. PMA addresses are local byte addresses.
+// the endpoint descriptor table sits at 0x00, one 8 byte entry per endpoint
+// number in use, and endpoint buffers are laid out back to back after it
+// in the order below. each offset is derived from the previous one, so
+// resizing or double buffering an endpoint is a matter of changing its
+// size or buffer count here.
+//
+#define PMA_SIZE                512
+#define PMA_NUM_EP              (1 + USBD_CDC_NUM_PORTS * 2 + USBD_VENDOR_BULK)
+
+#define PMA_EP0_SIZE            USB_MAX_EP0_SIZE
+#define PMA_CDC_CMD_SIZE        CDC_CMD_PACKET_SIZE
+#define PMA_CDC_IN_SIZE         CDC_DATA_FS_IN_PACKET_SIZE
+#define PMA_CDC_OUT_SIZE        CDC_DATA_FS_OUT_PACKET_SIZE
+
+#if (USBD_CDC_IN_DBL_BUF == 1)
+#define PMA_CDC_IN_NBUF         2
+#else
+#define PMA_CDC_IN_NBUF         1
+#endif
+
+#if (USBD_CDC_OUT_DBL_BUF == 1)
+#define PMA_CDC_OUT_NBUF        2
+#else
+#define PMA_CDC_OUT_NBUF        1
+#endif
+
+#define PMA_EP0_OUT             (PMA_NUM_EP * 8)
+#define PMA_EP0_IN              (PMA_EP0_OUT  + PMA_EP0_SIZE)
+
+/* CDC instance n : bulk IN, bulk OUT and notification buffers back to back */
+#define PMA_CDC_PORT_SIZE       (PMA_CDC_IN_SIZE * PMA_CDC_IN_NBUF + \
+                                 PMA_CDC_OUT_SIZE * PMA_CDC_OUT_NBUF + \
+                                 PMA_CDC_CMD_SIZE)
+#define PMA_CDC_IN(n)           (PMA_EP0_IN + PMA_EP0_SIZE + (n) * PMA_CDC_PORT_SIZE)
+#define PMA_CDC_OUT(n)          (PMA_CDC_IN(n)  + PMA_CDC_IN_SIZE * PMA_CDC_IN_NBUF)
+#define PMA_CDC_CMD(n)          (PMA_CDC_OUT(n) + PMA_CDC_OUT_SIZE * PMA_CDC_OUT_NBUF)
+
+#if (USBD_VENDOR_BULK == 1)
+/* vendor bulk pair after the last CDC instance */
+#define PMA_VENDOR_SIZE         VENDOR_FS_MAX_PACKET_SIZE
+#define PMA_VENDOR_IN           PMA_CDC_IN(USBD_CDC_NUM_PORTS)
+#define PMA_VENDOR_OUT          (PMA_VENDOR_IN + PMA_VENDOR_SIZE)
+#define PMA_END                 (PMA_VENDOR_OUT + PMA_VENDOR_SIZE)
+#else
+#define PMA_END                 PMA_CDC_IN(USBD_CDC_NUM_PORTS)
+#endif
+
+#if (PMA_END > PMA_SIZE)
+#error "USB endpoint buffers don't fit in the 512 byte PMA"
+#endif
+
+#if ((PMA_EP0_SIZE | PMA_CDC_CMD_SIZE | PMA_CDC_IN_SIZE | PMA_CDC_OUT_SIZE) & 0x1)
+#error "USB endpoint buffers have to be a multiple of 2 bytes"
+#endif
+
+/* HAL_PCDEx_PMAConfig kind and address for an endpoint of nbuf buffers */
+#define PMA_KIND(nbuf)                (((nbuf) == 2) ? PCD_DBL_BUF : PCD_SNG_BUF)
+#define PMA_ADDR(addr, size, nbuf)    (((nbuf) == 2) ? ((addr) | (((addr) + (size)) << 16)) : (addr))
+
 /*******************************************************************************
                        LL Driver Callbacks (PCD -> USB Device Library)
 *******************************************************************************/
@@ -22,7 +89,7 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef* pcdHandle)
     __HAL_RCC_USB_CLK_ENABLE();
 
     /* Peripheral interrupt init */
-    HAL_NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, 0, 0);
+    HAL_NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, IRQ_PRIO_USB, 0);
     HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
   }
 }
@@ -134,7 +201,7 @@ void HAL_PCD_SuspendCallback(PCD_HandleTypeDef *hpcd)
 void HAL_PCD_ResumeCallback(PCD_HandleTypeDef *hpcd)
 {
   USBD_LL_Resume((USBD_HandleTypeDef*)hpcd->pData);
-  
+  USBD_LL_SOFInterrupt((USBD_HandleTypeDef*)hpcd->pData, _sof_enabled);
 }
 
 /**
@@ -189,6 +256,8 @@ void HAL_PCD_DisconnectCallback(PCD_HandleTypeDef *hpcd)
   */
 USBD_StatusTypeDef  USBD_LL_Init (USBD_HandleTypeDef *pdev)
 { 
+  uint8_t n;
+
   /* Init USB_IP */
   /* Link The driver to the stack */
   hpcd_USB_FS.pData = pdev;
@@ -206,38 +275,21 @@ USBD_StatusTypeDef  USBD_LL_Init (USBD_HandleTypeDef *pdev)
     _Error_Handler(__FILE__, __LINE__);
   }
 
-#if 0
-  //
-  // STM32 USB has 512 bytes buffer for endpoints
-  // 
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, 0x18);        // EP0 Out        64 bytes
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, 0x58);        // EP0 In         104 bytes
-
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x81 , PCD_SNG_BUF, 0xC0);        // CDC0_IN_EP     64 bytes
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x01 , PCD_SNG_BUF, 0x110);       // CDC0_OUT_EP    64 bytes
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, 0x100);       // CDC0_CMD_EP    16 bytes
-#else
-
-  // hkim
-  // we have 8 endpoints and one endpoint descriptor is 8 bytes ( 4 16 bit words according to the datasheet)
-  // and the endpoint descriptor table is located at PMA 0x00.
-  // So first 64 bytes should be reserved for descriptor table.
-  //
-#define START_OFFSET    0x20
-#define SIZE_UNIT       (64/2)
-
-
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, START_OFFSET + SIZE_UNIT * 0);            // EP0 Out        64 bytes
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, START_OFFSET + SIZE_UNIT * 1);            // EP0 In         104 bytes
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, PMA_EP0_OUT);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, PMA_EP0_IN);
 
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x81 , PCD_SNG_BUF, START_OFFSET + SIZE_UNIT * 2);            // CDC0_IN_EP     64 bytes
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x01 , PCD_SNG_BUF, START_OFFSET + SIZE_UNIT * 3);            // CDC0_OUT_EP    64 bytes
-
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x83 , PCD_SNG_BUF, START_OFFSET + SIZE_UNIT * 4);            // CDC1_IN_EP     64 bytes
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x03 , PCD_SNG_BUF, START_OFFSET + SIZE_UNIT * 5);            // CDC1_OUT_EP    64 bytes
+  for(n = 0; n < USBD_CDC_NUM_PORTS; n++)
+  {
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_IN_EP(n) , PMA_KIND(PMA_CDC_IN_NBUF),
+        PMA_ADDR(PMA_CDC_IN(n), PMA_CDC_IN_SIZE, PMA_CDC_IN_NBUF));
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_OUT_EP(n) , PMA_KIND(PMA_CDC_OUT_NBUF),
+        PMA_ADDR(PMA_CDC_OUT(n), PMA_CDC_OUT_SIZE, PMA_CDC_OUT_NBUF));
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_CMD_EP(n) , PCD_SNG_BUF, PMA_CDC_CMD(n));
+  }
 
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, START_OFFSET + SIZE_UNIT * 6);            // CDC0_CMD_EP    16 bytes
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x84 , PCD_SNG_BUF, START_OFFSET + SIZE_UNIT * 7 + 0x08);     // CDC1_CMD_EP    16 bytes
+#if (USBD_VENDOR_BULK == 1)
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , VENDOR_IN_EP , PCD_SNG_BUF, PMA_VENDOR_IN);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , VENDOR_OUT_EP , PCD_SNG_BUF, PMA_VENDOR_OUT);
 #endif
 
   return USBD_OK;
@@ -641,6 +693,47 @@ USBD_StatusTypeDef  USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
   return usb_status; 
 }
 
+/**
+  * @brief  Sets NAK on an OUT endpoint.
+  *         hardware NAKs a single buffered endpoint by itself after a
+  *         reception. a double buffered one stays VALID, so the class
+  *         has to do it when it has no buffer to offer.
+  *         next USBD_LL_PrepareReceive makes the endpoint VALID again.
+  * @param  pdev: Device handle
+  * @param  ep_addr: Endpoint Number
+  * @retval USBD Status
+  */
+USBD_StatusTypeDef  USBD_LL_NakOutEP (USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef*) pdev->pData;
+
+  PCD_SET_EP_RX_STATUS(hpcd->Instance, ep_addr & 0x7F, USB_EP_RX_NAK);
+  return USBD_OK;
+}
+
+/**
+  * @brief  Unmasks or masks the SOF interrupt.
+  *         the CDC class only takes SOF while it has something to
+  *         schedule on it, the device is left alone otherwise.
+  * @param  pdev: Device handle
+  * @param  enable: 1 to unmask, 0 to mask
+  * @retval None
+  */
+void  USBD_LL_SOFInterrupt (USBD_HandleTypeDef *pdev, uint8_t enable)
+{
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef*) pdev->pData;
+
+  _sof_enabled = enable;
+  if(enable)
+  {
+    hpcd->Instance->CNTR |= USB_CNTR_SOFM;
+  }
+  else
+  {
+    hpcd->Instance->CNTR &= ~USB_CNTR_SOFM;
+  }
+}
+
 /**
   * @brief  Returns the last transfered packet size.
   * @param  pdev: Device handle
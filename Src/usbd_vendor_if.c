@@ -0,0 +1,118 @@
+#include "usbd_vendor_if.h"
+
+#if (USBD_VENDOR_BULK == 1)
+
+//
+// raw bulk loopback on the vendor interface. OUT transfers are sent
+// straight back IN from the same buffer, two buffers ping pong so the
+// host can keep one transfer in each direction in flight. this is the
+// place to hook a real producer or consumer of bulk streams.
+//
+// VENDOR_XFER_SIZE : largest transfer in either direction
+//
+#define VENDOR_XFER_SIZE    1024
+#define VENDOR_NUM_BUF      2
+
+typedef struct
+{
+  uint8_t   data[VENDOR_XFER_SIZE];
+  uint32_t  len;          /* bytes waiting to go IN. 0 when free */
+} vendor_buf_t;
+
+static vendor_buf_t       _vbuf[VENDOR_NUM_BUF];
+static uint8_t            _vbuf_rx;     /* buffer the OUT EP is armed on     */
+static uint8_t            _vbuf_tx;     /* buffer next to go IN              */
+static uint8_t            _rx_armed;
+
+extern USBD_HandleTypeDef hUsbDeviceFS;
+
+static int8_t Vendor_Init_FS          (void);
+static int8_t Vendor_DeInit_FS        (void);
+static int8_t Vendor_Receive_FS       (uint8_t* pbuf, uint32_t len);
+static int8_t Vendor_TransmitCplt_FS  (uint8_t* pbuf, uint32_t len);
+
+USBD_Vendor_ItfTypeDef USBD_Vendor_fops_FS =
+{
+  Vendor_Init_FS,
+  Vendor_DeInit_FS,
+  Vendor_Receive_FS,
+  Vendor_TransmitCplt_FS,
+};
+
+static inline void
+vendor_rx_arm(void)
+{
+  vendor_buf_t* b = &_vbuf[_vbuf_rx];
+
+  if(_rx_armed || b->len != 0)
+  {
+    return;
+  }
+
+  _rx_armed = 1;
+  USBD_Vendor_Receive(&hUsbDeviceFS, b->data, VENDOR_XFER_SIZE);
+}
+
+static inline void
+vendor_tx_kick(void)
+{
+  vendor_buf_t* b = &_vbuf[_vbuf_tx];
+
+  if(b->len == 0)
+  {
+    return;
+  }
+  USBD_Vendor_Transmit(&hUsbDeviceFS, b->data, b->len);
+}
+
+static int8_t
+Vendor_Init_FS(void)
+{
+  uint8_t i;
+
+  for(i = 0; i < VENDOR_NUM_BUF; i++)
+  {
+    _vbuf[i].len = 0;
+  }
+  _vbuf_rx  = 0;
+  _vbuf_tx  = 0;
+  _rx_armed = 0;
+
+  vendor_rx_arm();
+  return (USBD_OK);
+}
+
+static int8_t
+Vendor_DeInit_FS(void)
+{
+  return (USBD_OK);
+}
+
+static int8_t
+Vendor_Receive_FS(uint8_t* pbuf, uint32_t len)
+{
+  _rx_armed = 0;
+
+  if(len != 0)
+  {
+    _vbuf[_vbuf_rx].len = len;
+    _vbuf_rx = (_vbuf_rx + 1) % VENDOR_NUM_BUF;
+  }
+
+  vendor_tx_kick();
+  vendor_rx_arm();
+  return (USBD_OK);
+}
+
+static int8_t
+Vendor_TransmitCplt_FS(uint8_t* pbuf, uint32_t len)
+{
+  _vbuf[_vbuf_tx].len = 0;
+  _vbuf_tx = (_vbuf_tx + 1) % VENDOR_NUM_BUF;
+
+  vendor_tx_kick();
+  vendor_rx_arm();
+  return (USBD_OK);
+}
+
+#endif /* USBD_VENDOR_BULK */
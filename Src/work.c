@@ -0,0 +1,132 @@
+#include "stm32f1xx_hal.h"
+#include "work.h"
+#include "irq.h"
+
+//
+// posted work is a bit per work_id_t. work_run() takes the whole set at
+// once and calls each handler, over again while handlers or interrupts
+// keep posting. PendSV has the lowest priority, so every other interrupt
+// preempts a handler, which has to mask them around what it shares with
+// them. a post from an interrupt handler runs as soon as the last
+// handler has returned, before the thread gets the CPU again.
+//
+// timed posts count down on SysTick, 1 ms each.
+//
+// idle time is sampled: a SysTick that wakes the CPU from WFI counts the
+// ms before it as idle. idle_ticks / ticks is the share of time asleep,
+// give or take the ms with short interrupts in them.
+//
+static volatile uint32_t  _work_pending = 0;
+static work_fn_t          _work_fn[WORK_MAX];
+static volatile uint16_t  _work_due[WORK_MAX];    /* ms until posted. 0 when not timed */
+static work_stats_t       _work_stats;
+
+void
+work_init(void)
+{
+  HAL_NVIC_SetPriority(PendSV_IRQn, IRQ_PRIO_WORK, 0);
+}
+
+void
+work_set(work_id_t id, work_fn_t fn)
+{
+  _work_fn[id] = fn;
+}
+
+void
+work_post(work_id_t id)
+{
+  uint32_t  primask;
+
+  primask = __get_PRIMASK();
+  __disable_irq();
+  _work_pending |= (1UL << id);
+  __set_PRIMASK(primask);
+
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+void
+work_post_in(work_id_t id, uint16_t ms)
+{
+  if(ms == 0)
+  {
+    work_post(id);
+    return;
+  }
+
+  /* an earlier timed post of the same work is replaced */
+  _work_due[id] = ms;
+}
+
+//
+// PendSV
+//
+void
+work_run(void)
+{
+  uint32_t  pending;
+  uint32_t  primask;
+  uint8_t   id;
+
+  while(1)
+  {
+    primask = __get_PRIMASK();
+    __disable_irq();
+    pending = _work_pending;
+    _work_pending = 0;
+    __set_PRIMASK(primask);
+
+    if(pending == 0)
+    {
+      return;
+    }
+
+    for(id = 0; id < WORK_MAX; id++)
+    {
+      if((pending & (1UL << id)) && _work_fn[id] != NULL)
+      {
+        _work_stats.runs[id]++;
+        _work_fn[id]();
+      }
+    }
+  }
+}
+
+//
+// thread context. interrupts are masked from before WFI, so the one
+// that wakes the CPU up is still pending when the wake up is accounted
+//
+void
+work_idle(void)
+{
+  __disable_irq();
+  __WFI();
+  if(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+  {
+    _work_stats.idle_ticks++;
+  }
+  __enable_irq();
+}
+
+const work_stats_t*
+work_get_stats(void)
+{
+  return &_work_stats;
+}
+
+void
+HAL_SYSTICK_Callback(void)
+{
+  uint8_t   id;
+
+  _work_stats.ticks++;
+
+  for(id = 0; id < WORK_MAX; id++)
+  {
+    if(_work_due[id] != 0 && --_work_due[id] == 0)
+    {
+      work_post(id);
+    }
+  }
+}